@@ -4,7 +4,9 @@ from satsamplepy.satsamplepy import (
     SampleOptions,
     SampleCacheGenOptions,
     Sample,
+    BatchRing,
 )
+from satsamplepy import RingDataset
 
 from torchgeo.datasets import CDL
 
@@ -115,6 +117,8 @@ def main(rank: int, world_size: int):
     TRAIN_SAMPLEOPT.dbPath = "train-cache.db"
     TRAIN_SAMPLEOPT.nCacheGenThreads = 16
     TRAIN_SAMPLEOPT.nCacheQueryThreads = 8
+    TRAIN_SAMPLEOPT.rank = rank
+    TRAIN_SAMPLEOPT.worldSize = world_size
 
     TRAIN_CACHEOPT = SampleCacheGenOptions()
     TRAIN_CACHEOPT.cldMax = 50
@@ -138,6 +142,8 @@ def main(rank: int, world_size: int):
     TEST_SAMPLEOPT.dbPath = "test-cache.db"
     TEST_SAMPLEOPT.nCacheGenThreads = 32
     TEST_SAMPLEOPT.nCacheQueryThreads = 64
+    TEST_SAMPLEOPT.rank = rank
+    TEST_SAMPLEOPT.worldSize = world_size
 
     TEST_CACHEOPT = SampleCacheGenOptions()
     TEST_CACHEOPT.cldMax = 50
@@ -147,12 +153,21 @@ def main(rank: int, world_size: int):
 
     test_sampler = Sampler("../data/", TEST_SAMPLEOPT, TEST_CACHEOPT, TEST_DATERANGE)
 
-    train_ds = CustomDataset(train_sampler, BATCH_SIZE, BATCHES_PER_EPOCH)
+    N_TRAIN_WORKERS = 8
+    train_ring = BatchRing.create(
+        f"satsample-train-{os.getpid()}-{rank}",
+        n_slots=N_TRAIN_WORKERS + 2,
+        batch_size=BATCH_SIZE,
+        n_channels=N_BANDS,
+        dim=SAMPLE_DIM,
+    )
+    train_ds = RingDataset(train_sampler, train_ring, BATCHES_PER_EPOCH)
     train_loader = DataLoader(
         train_ds,
         shuffle=False,
-        batch_size=1,
-        num_workers=8,
+        batch_size=None,
+        num_workers=N_TRAIN_WORKERS,
+        prefetch_factor=1,
     )
 
     test_ds = CustomDataset(test_sampler, BATCH_SIZE, N_TEST_BATCHES)
@@ -174,11 +189,12 @@ def main(rank: int, world_size: int):
         l = tqdm.tqdm(train_loader)
         if rank != 0:
             l = train_loader
-        for batch in l:
+        for slot in l:
             # samples = train_sampler.randomSample2(BATCH_SIZE)
+            slot, data, masks = train_ring.acquire(slot)
             batch = {
-                "data": batch[0].squeeze(0),
-                "masks": cdlutil.isCrop(batch[1].squeeze(0)),
+                "data": data,
+                "masks": cdlutil.isCrop(masks),
             }
             # print("samples", samples[0])
             # print("masks", samples[1])
@@ -191,6 +207,9 @@ def main(rank: int, world_size: int):
             loss = train_epoch(unet, batch, opt, DEVICE)
             totalTrainLoss += loss
 
+            del batch, data, masks
+            train_ring.release(slot)
+
         print("avg train loss:", totalTrainLoss / BATCHES_PER_EPOCH)
 
         testSamples = test_sampler.randomSample2(BATCH_SIZE)
@@ -0,0 +1,71 @@
+#include "maskJoin.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+namespace cpuproc {
+
+// Clears out[i] where mask[i] is outside [boundMin, boundMax]. The CUDA
+// kernel compares through a (signed) char, so values above 127 always count
+// as out of range there; do the same to keep the outputs identical.
+static void joinUCharMask(const unsigned char *__restrict mask,
+                          unsigned char *__restrict out, size_t n,
+                          int boundMin, int boundMax) {
+  for (size_t i = 0; i < n; i++) {
+    int value = (int8_t)mask[i];
+    out[i] &= (unsigned char)((value >= boundMin) & (value <= boundMax));
+  }
+}
+
+// Runs fn(rowBegin, rowEnd) over nThreads contiguous row ranges.
+template <typename F>
+static void forEachRowRange(size_t bandDimY, size_t nThreads, F fn) {
+  nThreads = std::clamp(nThreads, (size_t)1, std::max(bandDimY, (size_t)1));
+
+  std::vector<std::thread> threads;
+  size_t rowsPerThread = (bandDimY + nThreads - 1) / nThreads;
+  for (size_t rowBegin = 0; rowBegin < bandDimY; rowBegin += rowsPerThread) {
+    threads.emplace_back(fn, rowBegin,
+                         std::min(rowBegin + rowsPerThread, bandDimY));
+  }
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+void joinMasks(unsigned char *detfooMasks, size_t nDetfooMasks,
+               unsigned char *cldMask, unsigned char maxCldPercentage,
+               unsigned char *snwMask, unsigned char maxSnwPercentage,
+               unsigned char *outMask, size_t bandDimX, size_t bandDimY,
+               size_t nThreads) {
+  size_t nPixels = bandDimX * bandDimY;
+
+  forEachRowRange(bandDimY, nThreads, [&](size_t rowBegin, size_t rowEnd) {
+    size_t begin = rowBegin * bandDimX;
+    size_t n = (rowEnd - rowBegin) * bandDimX;
+
+    std::memset(outMask + begin, 1, n);
+
+    for (size_t maskIdx = 0; maskIdx < nDetfooMasks; maskIdx++) {
+      joinUCharMask(detfooMasks + maskIdx * nPixels + begin, outMask + begin,
+                    n, 1, 255);
+    }
+    joinUCharMask(cldMask + begin, outMask + begin, n, 0, maxCldPercentage);
+    joinUCharMask(snwMask + begin, outMask + begin, n, 0, maxSnwPercentage);
+  });
+}
+
+void joinSclMask(unsigned char *sclMask, unsigned char *outMask,
+                 size_t bandDimX, size_t bandDimY, size_t nThreads) {
+  forEachRowRange(bandDimY, nThreads, [&](size_t rowBegin, size_t rowEnd) {
+    size_t begin = rowBegin * bandDimX;
+    joinUCharMask(sclMask + begin, outMask + begin,
+                  (rowEnd - rowBegin) * bandDimX, 4, 6);
+  });
+}
+
+} // namespace cpuproc
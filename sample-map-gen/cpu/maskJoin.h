@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+
+namespace cpuproc {
+
+// CPU counterpart of joinMasks in cuda/maskJoin.h, producing the same mask.
+// Rows are split across nThreads threads; the inner loops are branch free so
+// the compiler vectorizes them.
+void joinMasks(unsigned char *detfooMasks, size_t nDetfooMasks,
+               unsigned char *cldMask, unsigned char maxCldPercentage,
+               unsigned char *snwMask, unsigned char maxSnwPercentage,
+               unsigned char *outMask, size_t bandDimX, size_t bandDimY,
+               size_t nThreads);
+
+// Clears outMask where the scene classification is outside [4, 6]
+// (vegetation, bare soil, water), the same rule the sampler applies when it
+// joins the MSK bundle itself.
+void joinSclMask(unsigned char *sclMask, unsigned char *outMask,
+                 size_t bandDimX, size_t bandDimY, size_t nThreads);
+
+} // namespace cpuproc
@@ -1,19 +1,33 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cpl_conv.h>
 #include <cpl_error.h>
+#include <cpl_string.h>
+#include <cpl_vsi.h>
 #include <cstddef>
 #include <cstdlib>
 #include <execution>
+#include <fstream>
 #include <future>
 #include <gdal.h>
 #include <iostream>
+#include <memory>
+#include <regex>
 
 #include <gdal_priv.h>
 #include <gdal_utils.h>
 
+#include "cpu/maskJoin.h"
+#ifdef HAS_CUDA
 #include "cuda/mapgen.h"
 #include "cuda/maskJoin.h"
 #include <cuda_runtime.h>
+#endif
+#include "queue.h"
+#include "taskPool.h"
+#include <thread>
 #include <unordered_set>
 
 #include "third_party/argparse.hpp"
@@ -25,41 +39,209 @@
 struct Args : public argparse::Args {
   size_t &sampleDim =
       kwarg("sd,sample-dim", "Dimension of box to sample").set_default(256);
-  std::vector<std::string> &detfooMasks =
+  std::optional<std::vector<std::string>> &detfooMasks =
       kwarg("dfm,detfoo-masks", "The list of detector footprint masks to use")
           .multi_argument();
-  std::string &cldMask =
+  std::optional<std::string> &cldMask =
       kwarg("cld,cloud-mask", "The path to the cloud probability mask to use");
-  std::string &snwMask =
+  std::optional<std::string> &snwMask =
       kwarg("snw,snow-mask", "The path to the snow probability mask to use");
+  std::optional<std::string> &sclMask =
+      kwarg("scl,scene-class", "Optional scene classification mask to join");
   uint8_t &snwProbMax = kwarg("snwm,snow-max", "The maximum snow probability");
   uint8_t &cldProbMax =
       kwarg("cldm,cloud-max", "The maximum cloud probability");
 
-  std::string &outFile = kwarg("o,out", "output file");
+  std::optional<std::string> &outFile = kwarg("o,out", "output file");
+  bool &cog = flag("cog", "Write a tiled 1-bit Cloud-Optimized GeoTIFF with "
+                          "overviews");
+  std::string &compress =
+      kwarg("c,compress", "Output compression (NONE, ZSTD, DEFLATE, ...)")
+          .set_default("NONE");
+
+  std::optional<std::string> &manifest =
+      kwarg("m,manifest", "File listing one product (zip or SAFE dir) per line");
+  std::optional<std::string> &productDir =
+      kwarg("d,product-dir", "Process every product (zip or SAFE dir) in dir");
+  std::string &outDir =
+      kwarg("od,out-dir", "Output directory in batch mode").set_default(".");
+  size_t &nReadWorkers =
+      kwarg("rw,read-workers", "Number of products read concurrently")
+          .set_default(2);
+
+  size_t &nThreads =
+      kwarg("j,threads", "Number of threads for reading and joining masks")
+          .set_default(std::thread::hardware_concurrency());
+  bool &cpu = flag("cpu", "Join masks on the CPU even if CUDA is available");
 };
 
-int main(int argc, const char **argv) {
-  auto args = argparse::parse<Args>(argc, argv);
+struct ProductMasks {
+  std::string name;
+  std::vector<std::string> detfooMasks;
+  std::string cldMask;
+  std::string snwMask;
+  std::string sclMask; // optional
+  std::string outFile;
+};
 
-  GDALAllRegister();
+// Host buffers for one product. The batch pipeline recycles a fixed set of
+// these, so after the first few products nothing is allocated any more.
+struct MaskBuffers {
+  size_t dsXSize = 0, dsYSize = 0;
+  size_t nDetfooMasks = 0;
+
+  std::vector<unsigned char> detfoo;
+  std::vector<unsigned char> cld;
+  std::vector<unsigned char> snw;
+  std::vector<unsigned char> scl;
+  std::vector<unsigned char> out;
+
+  // georeferencing of the output grid, taken from the finest DETFOO mask
+  std::optional<std::array<double, 6>> geoTransform;
+  std::string projection;
+
+  void resize(size_t xSize, size_t ySize, size_t nMasks, bool hasScl) {
+    dsXSize = xSize;
+    dsYSize = ySize;
+    nDetfooMasks = nMasks;
+
+    size_t nPixels = xSize * ySize;
+    detfoo.resize(nPixels * nMasks);
+    cld.resize(nPixels);
+    snw.resize(nPixels);
+    scl.resize(hasScl ? nPixels : 0);
+    out.resize(nPixels);
+  }
+};
 
-  std::vector<GDALDataset *> detfooMasks;
-  for (const auto &maskPath : args.detfooMasks) {
-    std::cout << "opening " << std::filesystem::path(maskPath) << std::endl;
-    detfooMasks.push_back(GDALDataset::Open(maskPath.c_str(), GA_ReadOnly));
+// Finds the masks of a SAFE product (zipped or unpacked) the same way
+// sentinelRepackV2.sh does.
+static std::pair<ProductMasks, std::optional<std::string>>
+findProductMasks(const std::filesystem::path &product,
+                 const std::filesystem::path &outDir) {
+  ProductMasks masks;
+  masks.name = product.stem().string();
+  masks.outFile = (outDir / (masks.name + "-MSK_OK.tif")).string();
+
+  std::string root = product.extension() == ".zip"
+                         ? "/vsizip/" + product.string()
+                         : product.string();
+
+  char **files = VSIReadDirRecursive(root.c_str());
+  if (!files) {
+    return std::make_pair(masks, "Failed to list \"" + root + "\"");
+  }
 
-    if (!detfooMasks.back()) {
-      std::cout << "Failed to open \"" << maskPath << "\"" << std::endl;
-      exit(EXIT_FAILURE);
+  static const std::regex detfooRegex("DETFOO.*\\.jp2$");
+  static const std::regex cldRegex("CLD.*20m\\.jp2$");
+  static const std::regex snwRegex("SNW.*20m\\.jp2$");
+  static const std::regex sclRegex("SCL.*20m\\.jp2$");
+
+  for (char **file = files; *file; file++) {
+    std::string path = root + "/" + *file;
+
+    if (std::regex_search(*file, detfooRegex)) {
+      masks.detfooMasks.push_back(path);
+    } else if (std::regex_search(*file, cldRegex)) {
+      masks.cldMask = path;
+    } else if (std::regex_search(*file, snwRegex)) {
+      masks.snwMask = path;
+    } else if (std::regex_search(*file, sclRegex)) {
+      masks.sclMask = path;
     }
   }
+  CSLDestroy(files);
+
+  std::sort(masks.detfooMasks.begin(), masks.detfooMasks.end());
+
+  if (masks.detfooMasks.empty() || masks.cldMask.empty() ||
+      masks.snwMask.empty()) {
+    return std::make_pair(masks,
+                          "\"" + root + "\" is missing DETFOO, CLD or SNW masks");
+  }
+
+  return std::make_pair(masks, std::nullopt);
+}
+
+static std::pair<std::vector<std::filesystem::path>, std::optional<std::string>>
+listProducts(const Args &args) {
+  std::vector<std::filesystem::path> products;
+
+  if (args.manifest) {
+    std::ifstream manifest(*args.manifest);
+    if (!manifest) {
+      return std::make_pair(products,
+                            "Failed to open manifest \"" + *args.manifest + "\"");
+    }
+
+    std::string line;
+    while (std::getline(manifest, line)) {
+      if (!line.empty() && line[0] != '#') {
+        products.emplace_back(line);
+      }
+    }
+  }
+
+  if (args.productDir) {
+    std::error_code ec;
+    for (const auto &entry :
+         std::filesystem::directory_iterator(*args.productDir, ec)) {
+      const auto &path = entry.path();
+      if (path.extension() == ".zip" || path.extension() == ".SAFE") {
+        products.push_back(path);
+      }
+    }
+
+    if (ec) {
+      return std::make_pair(products, "Failed to list \"" + *args.productDir +
+                                          "\": " + ec.message());
+    }
+
+    std::sort(products.begin(), products.end());
+  }
+
+  return std::make_pair(products, std::nullopt);
+}
 
+// Reads band 1 of `path` into `out`, resampled to dsXSize x dsYSize. Every
+// call opens its own dataset handle so reads can run concurrently.
+static std::optional<std::string> readMask(const std::string &path,
+                                           unsigned char *out, size_t dsXSize,
+                                           size_t dsYSize) {
+  auto dsPtr =
+      GDALDatasetUniquePtr(GDALDataset::Open(path.c_str(), GA_ReadOnly));
+  if (!dsPtr) {
+    return "Failed to open \"" + path + "\"";
+  }
+
+  CPLErr readErr = dsPtr->GetRasterBand(1)->RasterIO(
+      GDALRWFlag::GF_Read, 0, 0, dsPtr->GetRasterXSize(),
+      dsPtr->GetRasterYSize(), out, dsXSize, dsYSize, GDALDataType::GDT_Byte, 0,
+      0);
+
+  if (readErr) {
+    return "Failed to read \"" + path + "\"";
+  }
+
+  return std::nullopt;
+}
+
+// Reads every mask of `product` on `pool`, which all readers share so -j
+// bounds the mask decodes in flight across products.
+static std::optional<std::string> readProduct(const ProductMasks &product,
+                                              MaskBuffers &buffers,
+                                              sats::TaskPool &pool) {
   size_t dsXSize = 0, dsYSize = 0;
-  for (const auto &ds : detfooMasks) {
-    size_t newXSize = ds->GetRasterXSize(), newYSize = ds->GetRasterYSize();
+  buffers.geoTransform.reset();
+  buffers.projection.clear();
+  for (const auto &maskPath : product.detfooMasks) {
+    auto ds =
+        GDALDatasetUniquePtr(GDALDataset::Open(maskPath.c_str(), GA_ReadOnly));
+    if (!ds) {
+      return "Failed to open \"" + maskPath + "\"";
+    }
 
-    std::cout << newXSize << ", " << newYSize << std::endl;
+    size_t newXSize = ds->GetRasterXSize(), newYSize = ds->GetRasterYSize();
 
     size_t maxX = std::max(newXSize, dsXSize);
     size_t minX = std::min(newXSize, dsXSize);
@@ -68,111 +250,328 @@ int main(int argc, const char **argv) {
     size_t minY = std::min(newYSize, dsYSize);
 
     if (minX && maxX % minX) {
-      std::cout << "dataset x dimension " << minX << " is not a factor of "
-                << maxX << std::endl;
-      return EXIT_FAILURE;
+      return "dataset x dimension " + std::to_string(minX) +
+             " is not a factor of " + std::to_string(maxX);
     }
 
     if (minY && maxY % minY) {
-      std::cout << "dataset y dimension " << minY << " is not a factor of "
-                << maxY << std::endl;
-      return EXIT_FAILURE;
+      return "dataset y dimension " + std::to_string(minY) +
+             " is not a factor of " + std::to_string(maxY);
+    }
+
+    std::array<double, 6> geoTransform;
+    if ((newXSize == maxX || !buffers.geoTransform) &&
+        ds->GetGeoTransform(geoTransform.data()) == CE_None) {
+      // rescale so a coarser mask still describes the output grid
+      geoTransform[1] *= (double)newXSize / maxX;
+      geoTransform[2] *= (double)newXSize / maxX;
+      geoTransform[4] *= (double)newYSize / maxY;
+      geoTransform[5] *= (double)newYSize / maxY;
+      buffers.geoTransform = geoTransform;
+      buffers.projection = ds->GetProjectionRef();
     }
 
     dsXSize = maxX;
     dsYSize = maxY;
   }
 
-  std::cout << "ds size: " << dsXSize << ", " << dsYSize << std::endl;
-
-  unsigned char *masks = (unsigned char *)malloc(
-      sizeof(unsigned char) * dsXSize * dsYSize * detfooMasks.size());
+  buffers.resize(dsXSize, dsYSize, product.detfooMasks.size(),
+                 !product.sclMask.empty());
+  size_t nPixels = dsXSize * dsYSize;
 
-  for (size_t i = 0; i < detfooMasks.size(); i++) {
-    const auto &ds = detfooMasks[i];
-
-    std::cout << "read: " << i << std::endl;
+  // the masks live in separate (often compressed) files, so decode them
+  // concurrently rather than one after another
+  std::vector<std::pair<std::string, unsigned char *>> reads;
+  for (size_t i = 0; i < product.detfooMasks.size(); i++) {
+    reads.emplace_back(product.detfooMasks[i],
+                       buffers.detfoo.data() + i * nPixels);
+  }
+  reads.emplace_back(product.cldMask, buffers.cld.data());
+  reads.emplace_back(product.snwMask, buffers.snw.data());
+  if (!product.sclMask.empty()) {
+    reads.emplace_back(product.sclMask, buffers.scl.data());
+  }
 
-    CPLErr readErr = ds->GetRasterBand(1)->RasterIO(
-        GDALRWFlag::GF_Read, 0, 0, ds->GetRasterXSize(), ds->GetRasterYSize(),
-        masks + i * dsXSize * dsYSize * sizeof(unsigned char), dsXSize, dsYSize,
-        GDALDataType::GDT_Byte, 0, 0);
+  std::vector<std::future<std::optional<std::string>>> readResults;
+  for (const auto &read : reads) {
+    using ReadTask = std::packaged_task<std::optional<std::string>()>;
+    auto task = std::make_shared<ReadTask>([&]() {
+      return readMask(read.first, read.second, dsXSize, dsYSize);
+    });
+    readResults.push_back(task->get_future());
+    pool.submit([task]() { (*task)(); });
+  }
 
-    if (readErr) {
-      std::cout << "readErr: " << readErr << std::endl;
+  std::optional<std::string> err;
+  for (auto &result : readResults) {
+    if (auto readErr = result.get(); readErr && !err) {
+      err = readErr;
     }
   }
 
-  unsigned char *cldMask =
-      (unsigned char *)malloc(sizeof(unsigned char) * dsXSize * dsYSize);
-  {
-    auto dsPtr = GDALDatasetUniquePtr(
-        GDALDataset::Open(args.cldMask.c_str(), GA_ReadOnly));
+  return err;
+}
 
-    std::cout << "dsPtr: " << dsPtr.get() << std::endl;
-    if (!dsPtr) {
-      std::cout << "Failed to open \"" << args.cldMask << "\"" << std::endl;
-      exit(EXIT_FAILURE);
-    }
+static void joinProduct(const Args &args, MaskBuffers &buffers) {
+  // joinDetfooMasks(masks, outMask, dsXSize, dsYSize, detfooMasks.size());
+#ifdef HAS_CUDA
+  if (!args.cpu) {
+    joinMasks(buffers.detfoo.data(), buffers.nDetfooMasks, buffers.cld.data(),
+              args.cldProbMax, buffers.snw.data(), args.snwProbMax,
+              buffers.out.data(), buffers.dsXSize, buffers.dsYSize);
+  } else
+#endif
+  {
+    cpuproc::joinMasks(buffers.detfoo.data(), buffers.nDetfooMasks,
+                       buffers.cld.data(), args.cldProbMax, buffers.snw.data(),
+                       args.snwProbMax, buffers.out.data(), buffers.dsXSize,
+                       buffers.dsYSize, args.nThreads);
+  }
 
-    CPLErr readErr = dsPtr->GetRasterBand(1)->RasterIO(
-        GDALRWFlag::GF_Read, 0, 0, dsPtr->GetRasterXSize(),
-        dsPtr->GetRasterYSize(), cldMask, dsXSize, dsYSize,
-        GDALDataType::GDT_Byte, 0, 0);
+  if (!buffers.scl.empty()) {
+    cpuproc::joinSclMask(buffers.scl.data(), buffers.out.data(),
+                         buffers.dsXSize, buffers.dsYSize, args.nThreads);
+  }
+}
 
-    if (readErr) {
-      std::cout << "Failed to read \"" << args.cldMask << "\"" << std::endl;
-      exit(EXIT_FAILURE);
-    }
+// Writes the mask one row of blocks at a time and flushes after each, so the
+// encoder only ever holds a single strip.
+static std::optional<std::string> writeStrips(GDALDataset *ds,
+                                              const MaskBuffers &buffers) {
+  if (buffers.geoTransform) {
+    auto geoTransform = *buffers.geoTransform;
+    ds->SetGeoTransform(geoTransform.data());
+    ds->SetProjection(buffers.projection.c_str());
   }
 
-  unsigned char *snwMask =
-      (unsigned char *)malloc(sizeof(unsigned char) * dsXSize * dsYSize);
-  {
-    auto dsPtr = GDALDatasetUniquePtr(
-        GDALDataset::Open(args.snwMask.c_str(), GA_ReadOnly));
-    std::cout << "dsPtr: " << dsPtr.get() << std::endl;
+  GDALRasterBand *band = ds->GetRasterBand(1);
+  int blockXSize, blockYSize;
+  band->GetBlockSize(&blockXSize, &blockYSize);
 
-    if (!dsPtr) {
-      std::cout << "Failed to open \"" << args.snwMask << "\"" << std::endl;
-      exit(EXIT_FAILURE);
-    }
+  for (size_t row = 0; row < buffers.dsYSize; row += blockYSize) {
+    size_t nRows = std::min((size_t)blockYSize, buffers.dsYSize - row);
 
-    CPLErr readErr = dsPtr->GetRasterBand(1)->RasterIO(
-        GDALRWFlag::GF_Read, 0, 0, dsPtr->GetRasterXSize(),
-        dsPtr->GetRasterYSize(), snwMask, dsXSize, dsYSize,
-        GDALDataType::GDT_Byte, 0, 0);
+    CPLErr err = band->RasterIO(
+        GF_Write, 0, row, buffers.dsXSize, nRows,
+        (void *)(buffers.out.data() + row * buffers.dsXSize), buffers.dsXSize,
+        nRows, GDALDataType::GDT_Byte, 0, 0);
 
-    if (readErr) {
-      std::cout << "Failed to read \"" << args.snwMask << "\"" << std::endl;
-      exit(EXIT_FAILURE);
+    if (err || band->FlushCache() != CE_None) {
+      return "GDAL Error writing rows " + std::to_string(row);
     }
   }
 
-  unsigned char *outMask =
-      (unsigned char *)malloc(sizeof(unsigned char) * dsXSize * dsYSize);
-  // joinDetfooMasks(masks, outMask, dsXSize, dsYSize, detfooMasks.size());
-  joinMasks(masks, detfooMasks.size(), cldMask, args.cldProbMax, snwMask,
-            args.snwProbMax, outMask, dsXSize, dsYSize);
+  return std::nullopt;
+}
 
+static std::optional<std::string> writeProduct(const Args &args,
+                                               const ProductMasks &product,
+                                               const MaskBuffers &buffers) {
   GDALDriver *gtiffDriver =
       GDALDriver::FromHandle(GDALGetDriverByName("GTiff"));
-  GDALDataset *outDS = gtiffDriver->Create(args.outFile.c_str(), dsXSize,
-                                           dsYSize, 1, GDT_Byte, NULL);
+
+  // The COG driver can only CreateCopy, so stream the strips into a 1-bit
+  // tiled scratch file in memory (~15 MB for a 10980^2 product) and lay the
+  // COG out from that.
+  std::string stripPath =
+      args.cog ? "/vsimem/" + product.name + "-strips.tif" : product.outFile;
+
+  CPLStringList options;
+  if (args.cog) {
+    options.SetNameValue("TILED", "YES");
+    options.SetNameValue("BLOCKXSIZE", "512");
+    options.SetNameValue("BLOCKYSIZE", "512");
+    options.SetNameValue("NBITS", "1");
+  } else {
+    options.SetNameValue("COMPRESS", args.compress.c_str());
+  }
+
+  auto outDS = GDALDatasetUniquePtr(
+      gtiffDriver->Create(stripPath.c_str(), buffers.dsXSize, buffers.dsYSize,
+                          1, GDT_Byte, options.List()));
   // GDALDataset *outDS =
   //     cogDriver->CreateCopy("out.tif", detfooMasks[0], FALSE, NULL, NULL,
   //     NULL);
 
-  std::cout << "size: " << outDS->GetRasterXSize() << ", "
-            << outDS->GetRasterYSize() << std::endl;
-  CPLErr err = outDS->GetRasterBand(1)->RasterIO(
-      GF_Write, 0, 0, outDS->GetRasterXSize(), outDS->GetRasterYSize(),
-      (void *)outMask, dsXSize, dsYSize, GDALDataType::GDT_Byte, 0, 0);
+  if (!outDS) {
+    return "Failed to create \"" + stripPath + "\"";
+  }
+
+  // the sampler only uses the mask for the thresholds it was joined with,
+  // COG's CreateCopy carries these over
+  GDALRasterBand *band = outDS->GetRasterBand(1);
+  band->SetMetadataItem("SATS_CLD_MAX",
+                        std::to_string(args.cldProbMax).c_str());
+  band->SetMetadataItem("SATS_SNW_MAX",
+                        std::to_string(args.snwProbMax).c_str());
+
+  auto err = writeStrips(outDS.get(), buffers);
+  if (!err && !args.cog && outDS->Close() != CE_None) {
+    err = "GDAL Error writing \"" + product.outFile + "\"";
+  }
+
+  if (err || !args.cog) {
+    return err;
+  }
+
+  // nearest keeps the overviews binary
+  CPLStringList cogOptions;
+  cogOptions.SetNameValue("COMPRESS", args.compress.c_str());
+  cogOptions.SetNameValue("BLOCKSIZE", "512");
+  cogOptions.SetNameValue("NBITS", "1");
+  cogOptions.SetNameValue("OVERVIEWS", "AUTO");
+  cogOptions.SetNameValue("OVERVIEW_RESAMPLING", "NEAREST");
+  cogOptions.SetNameValue("NUM_THREADS", std::to_string(args.nThreads).c_str());
+
+  GDALDriver *cogDriver = GDALDriver::FromHandle(GDALGetDriverByName("COG"));
+  auto cogDS = GDALDatasetUniquePtr(
+      cogDriver->CreateCopy(product.outFile.c_str(), outDS.get(), FALSE,
+                            cogOptions.List(), NULL, NULL));
+
+  outDS.reset();
+  VSIUnlink(stripPath.c_str());
+
+  if (!cogDS || cogDS->Close() != CE_None) {
+    return "GDAL Error writing \"" + product.outFile + "\"";
+  }
+
+  return std::nullopt;
+}
+
+static double msSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+int main(int argc, const char **argv) {
+  auto args = argparse::parse<Args>(argc, argv);
+
+  GDALAllRegister();
+
+  std::vector<ProductMasks> products;
+  if (args.manifest || args.productDir) {
+    auto [productPaths, err] = listProducts(args);
+    if (err) {
+      std::cout << *err << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    std::filesystem::create_directories(args.outDir);
+
+    for (const auto &path : productPaths) {
+      auto [masks, findErr] = findProductMasks(path, args.outDir);
+      if (findErr) {
+        std::cout << *findErr << ", skipping" << std::endl;
+        continue;
+      }
+
+      products.push_back(std::move(masks));
+    }
+  } else {
+    if (!args.detfooMasks || !args.cldMask || !args.snwMask || !args.outFile) {
+      std::cout << "--dfm, --cld, --snw and -o are required without "
+                   "--manifest or --product-dir"
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    products.push_back(ProductMasks{
+        .name = std::filesystem::path(*args.outFile).stem().string(),
+        .detfooMasks = *args.detfooMasks,
+        .cldMask = *args.cldMask,
+        .snwMask = *args.snwMask,
+        .sclMask = args.sclMask.value_or(""),
+        .outFile = *args.outFile,
+    });
+  }
+
+  // Readers pull products off a shared counter and fill free buffer sets
+  // while this thread joins and writes the previous product. The buffer pool
+  // bounds how many products are held in memory at once.
+  struct ReadResult {
+    size_t product;
+    MaskBuffers *buffers;
+    double readMs;
+    std::optional<std::string> err;
+  };
+
+  size_t nReadWorkers =
+      std::clamp(args.nReadWorkers, (size_t)1, std::max(products.size(), (size_t)1));
+
+  std::vector<MaskBuffers> bufferPool(nReadWorkers + 1);
+  BlockingQueue<MaskBuffers *> freeBuffers;
+  for (auto &buffers : bufferPool) {
+    freeBuffers.push(&buffers);
+  }
+
+  BlockingQueue<ReadResult> readResults;
+  std::atomic<size_t> nextProduct = 0;
+  std::atomic<size_t> nReadersLeft = nReadWorkers;
+
+  sats::TaskPool maskReads(std::max<size_t>(args.nThreads, 1));
+
+  std::vector<std::thread> readers;
+  for (size_t i = 0; i < nReadWorkers; i++) {
+    readers.emplace_back([&]() {
+      while (true) {
+        size_t product = nextProduct.fetch_add(1);
+        if (product >= products.size()) {
+          break;
+        }
+
+        MaskBuffers *buffers = *freeBuffers.pop();
+        auto start = std::chrono::steady_clock::now();
+        auto err = readProduct(products[product], *buffers, maskReads);
+        readResults.push(ReadResult{product, buffers, msSince(start), err});
+      }
+
+      if (nReadersLeft.fetch_sub(1) == 1) {
+        readResults.close();
+      }
+    });
+  }
+
+  auto batchStart = std::chrono::steady_clock::now();
+  size_t nFailed = 0;
+
+  while (auto result = readResults.pop()) {
+    const ProductMasks &product = products[result->product];
+
+    if (result->err) {
+      std::cout << product.name << ": " << *result->err << std::endl;
+      freeBuffers.push(result->buffers);
+      nFailed++;
+      continue;
+    }
+
+    auto joinStart = std::chrono::steady_clock::now();
+    joinProduct(args, *result->buffers);
+    double joinMs = msSince(joinStart);
+
+    auto writeStart = std::chrono::steady_clock::now();
+    auto writeErr = writeProduct(args, product, *result->buffers);
+    double writeMs = msSince(writeStart);
 
-  if (err) {
-    std::cout << "GDAL Error: " << err << std::endl;
-    exit(EXIT_FAILURE);
+    freeBuffers.push(result->buffers);
+
+    if (writeErr) {
+      std::cout << product.name << ": " << *writeErr << std::endl;
+      nFailed++;
+      continue;
+    }
+
+    std::cout << product.name << ": read " << result->readMs << " ms, join "
+              << joinMs << " ms, write " << writeMs << " ms" << std::endl;
   }
 
-  outDS->Close();
+  for (auto &reader : readers) {
+    reader.join();
+  }
+
+  std::cout << "processed " << products.size() - nFailed << "/"
+            << products.size() << " products in " << msSince(batchStart) / 1000
+            << " s" << std::endl;
+
+  return nFailed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+// Minimal blocking queue used to hand buffers between the batch pipeline
+// stages. pop() returns std::nullopt once the queue is closed and drained.
+template <typename T> class BlockingQueue {
+public:
+  void push(T value) {
+    {
+      std::lock_guard lock(mutex);
+      items.push_back(std::move(value));
+    }
+    cv.notify_one();
+  }
+
+  std::optional<T> pop() {
+    std::unique_lock lock(mutex);
+    cv.wait(lock, [&]() { return !items.empty() || closed; });
+
+    if (items.empty()) {
+      return std::nullopt;
+    }
+
+    T value = std::move(items.front());
+    items.pop_front();
+    return value;
+  }
+
+  void close() {
+    {
+      std::lock_guard lock(mutex);
+      closed = true;
+    }
+    cv.notify_all();
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<T> items;
+  bool closed = false;
+};
@@ -0,0 +1,414 @@
+#include <benchmark/benchmark.h>
+
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <gdal_priv.h>
+
+#include "cpu/mapgen.h"
+#include "cpu/normalize.h"
+#include "cpu/percentile.h"
+#include "sampleMap.h"
+#include "sampler.h"
+#include "synthetic.h"
+
+namespace cpuproc = sats::cpuproc;
+
+// Hot paths of the sampler on synthetic data. The kernels run on in-memory
+// masks and bands; the end-to-end benchmarks build a Sampler over a dataset
+// from sats::synthetic, generated once into $SATSAMPLE_BENCH_DATA (default
+// <tmp>/satsample-bench) and reused by later runs.
+
+static constexpr size_t maskDim = 5490; // a full 20 m product
+static constexpr size_t sampleDim = 256;
+static constexpr size_t scalingFactor = 2;
+
+// 0/1 mask with a few cloud discs, like a mostly clear product
+static std::vector<uint8_t> cloudyMask(size_t dim, uint64_t seed) {
+  std::vector<uint8_t> mask(dim * dim, 1);
+  std::mt19937_64 rng(seed);
+  std::uniform_real_distribution<double> pos(0, dim);
+  std::uniform_real_distribution<double> radius(dim / 30.0, dim / 10.0);
+
+  for (size_t i = 0; i < 6; i++) {
+    double cx = pos(rng), cy = pos(rng), r = radius(rng);
+    for (size_t y = 0; y < dim; y++) {
+      for (size_t x = 0; x < dim; x++) {
+        if ((x - cx) * (x - cx) + (y - cy) * (y - cy) < r * r) {
+          mask[y * dim + x] = 0;
+        }
+      }
+    }
+  }
+
+  return mask;
+}
+
+static std::vector<uint16_t> randomBand(size_t n, uint64_t seed) {
+  std::vector<uint16_t> band(n);
+  std::mt19937_64 rng(seed);
+  std::uniform_int_distribution<int> value(0, 10000);
+  for (auto &v : band) {
+    v = (uint16_t)value(rng);
+  }
+  return band;
+}
+
+static const std::vector<uint8_t> &sampleMapBytes() {
+  static std::vector<uint8_t> map = [] {
+    auto mask = cloudyMask(maskDim, 1);
+    cpuproc::mapgen(mask.data(), maskDim, maskDim, sampleDim / scalingFactor,
+                    0.99);
+    return mask;
+  }();
+  return map;
+}
+
+static void BM_Mapgen(benchmark::State &state) {
+  const size_t dim = state.range(0);
+  const auto mask = cloudyMask(dim, 1);
+  std::vector<uint8_t> stage(mask.size()), quality(mask.size());
+
+  for (auto _ : state) {
+    stage = mask;
+    cpuproc::mapgen(stage.data(), dim, dim, sampleDim / scalingFactor, 0.99,
+                    quality.data());
+    benchmark::DoNotOptimize(stage.data());
+  }
+
+  state.SetItemsProcessed(state.iterations() * dim * dim);
+}
+BENCHMARK(BM_Mapgen)->Arg(1098)->Arg(maskDim)->Unit(benchmark::kMillisecond);
+
+static void BM_GenerateSampleMap(benchmark::State &state) {
+  const size_t dim = state.range(0);
+  const size_t nPixels = dim * dim;
+  const size_t nDetfoo = 13;
+
+  // DETFOO..., CLD, SNW, SCL planes as in the MSK bundle
+  auto clear = cloudyMask(dim, 2);
+  std::vector<uint8_t> masks(nPixels * (nDetfoo + 3));
+  for (size_t i = 0; i < nPixels; i++) {
+    for (size_t m = 0; m < nDetfoo; m++) {
+      masks[m * nPixels + i] = 1;
+    }
+    masks[nDetfoo * nPixels + i] = clear[i] ? 2 : 90;
+    masks[(nDetfoo + 1) * nPixels + i] = 0;
+    masks[(nDetfoo + 2) * nPixels + i] = clear[i] ? 4 : 9;
+  }
+
+  std::vector<uint8_t> out(nPixels), quality(nPixels);
+
+  for (auto _ : state) {
+    cpuproc::generateSampleMap(
+        masks.data(), nDetfoo, masks.data() + nDetfoo * nPixels, 50,
+        masks.data() + (nDetfoo + 1) * nPixels, 50,
+        masks.data() + (nDetfoo + 2) * nPixels, out.data(), dim, dim,
+        sampleDim / scalingFactor, 0.99, quality.data());
+    benchmark::DoNotOptimize(out.data());
+  }
+
+  state.SetItemsProcessed(state.iterations() * nPixels);
+}
+BENCHMARK(BM_GenerateSampleMap)
+    ->Arg(1098)
+    ->Arg(maskDim)
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_Percentiles(benchmark::State &state) {
+  const size_t n = state.range(0);
+  const auto raw = randomBand(n, 3);
+  const std::vector<float> data(raw.begin(), raw.end());
+
+  for (auto _ : state) {
+    auto values = cpuproc::percentiles(data.data(), data.size(), {1, 99});
+    benchmark::DoNotOptimize(values.data());
+  }
+
+  state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_Percentiles)
+    ->Arg(1 << 20)
+    ->Arg(1 << 24)
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_PercentilesU16(benchmark::State &state) {
+  const size_t n = state.range(0);
+  const auto raw = randomBand(n, 3);
+
+  for (auto _ : state) {
+    auto values = cpuproc::percentilesU16(raw.data(), raw.size(), {1, 99});
+    benchmark::DoNotOptimize(values.data());
+  }
+
+  state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_PercentilesU16)
+    ->Arg(1 << 20)
+    ->Arg(1 << 24)
+    ->Unit(benchmark::kMillisecond);
+
+// One sample's decode: 10 normalized bands and NDVI
+template <typename T> static void BM_Normalize(benchmark::State &state) {
+  const size_t bandSize = sampleDim * sampleDim;
+  const size_t nRaw = 10;
+  const auto raw = randomBand(nRaw * bandSize, 4);
+  std::vector<T> out((nRaw + 1) * bandSize);
+
+  for (auto _ : state) {
+    for (size_t i = 0; i < nRaw; i++) {
+      cpuproc::normalizeBand(raw.data() + i * bandSize, bandSize, 100.0f,
+                             1.0f / 4000.0f, out.data() + i * bandSize);
+    }
+    cpuproc::ndvi(raw.data() + 2 * bandSize, raw.data() + 3 * bandSize,
+                  bandSize, out.data() + nRaw * bandSize);
+    benchmark::DoNotOptimize(out.data());
+  }
+
+  state.SetBytesProcessed(state.iterations() * raw.size() * sizeof(uint16_t));
+}
+BENCHMARK(BM_Normalize<float>);
+BENCHMARK(BM_Normalize<cpuproc::Half>);
+BENCHMARK(BM_Normalize<cpuproc::BFloat16>);
+
+// Sampler::computeSampleIndex is SampleMap::select on the product's map
+static void BM_ComputeSampleIndex(benchmark::State &state) {
+  const auto &bytes = sampleMapBytes();
+  const auto map = sats::SampleMap::fromBytes(bytes.data(), bytes.size());
+  const size_t nOK = map.count();
+
+  std::mt19937_64 rng(5);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(map.select(rng() % nOK));
+  }
+
+  state.counters["runs"] = map.nRuns();
+}
+BENCHMARK(BM_ComputeSampleIndex);
+
+static void BM_SampleMapSerialize(benchmark::State &state) {
+  const auto &bytes = sampleMapBytes();
+
+  for (auto _ : state) {
+    auto map = sats::SampleMap::fromBytes(bytes.data(), bytes.size());
+    auto blob = map.serialize();
+    benchmark::DoNotOptimize(blob.data());
+  }
+
+  state.SetBytesProcessed(state.iterations() * bytes.size());
+}
+BENCHMARK(BM_SampleMapSerialize)->Unit(benchmark::kMicrosecond);
+
+static void BM_SampleMapDeserialize(benchmark::State &state) {
+  const auto &bytes = sampleMapBytes();
+  const auto blob =
+      sats::SampleMap::fromBytes(bytes.data(), bytes.size()).serialize();
+
+  for (auto _ : state) {
+    auto map = sats::SampleMap::deserialize(blob.data(), blob.size());
+    benchmark::DoNotOptimize(map);
+  }
+
+  state.counters["blob_bytes"] = blob.size();
+}
+BENCHMARK(BM_SampleMapDeserialize)->Unit(benchmark::kMicrosecond);
+
+static std::filesystem::path benchDataDir() {
+  if (const char *dir = std::getenv("SATSAMPLE_BENCH_DATA")) {
+    return dir;
+  }
+  return std::filesystem::temp_directory_path() / "satsample-bench";
+}
+
+// Built on first use, cache included, so only steady state is timed
+static sats::Sampler *benchSampler() {
+  static std::unique_ptr<sats::Sampler> sampler = []() {
+    const auto dir = benchDataDir();
+
+    if (!std::filesystem::exists(dir / "2022_30m_cdls.tif")) {
+      std::cout << "generating synthetic dataset in " << dir << std::endl;
+      auto err = sats::synthetic::generate(dir, {.nProducts = 8});
+      if (err) {
+        std::cout << "synthetic dataset failed: " << err.value() << std::endl;
+        return std::unique_ptr<sats::Sampler>();
+      }
+    }
+
+    return std::make_unique<sats::Sampler>(
+        dir,
+        sats::Sampler::SampleOptions{
+            .dbPath = dir / "cache.db",
+            .nCacheGenThreads = 4,
+            .nCacheQueryThreads = 4,
+        },
+        sats::Sampler::SampleCacheGenOptions{
+            .minOKPercentage = 0.99,
+            .sampleDim = sampleDim,
+            .cldMax = 50,
+            .snwMax = 50,
+        },
+        std::nullopt, false);
+  }();
+
+  return sampler.get();
+}
+
+static void BM_RandomSampleV2(benchmark::State &state) {
+  sats::Sampler *sampler = benchSampler();
+  if (!sampler) {
+    state.SkipWithError("no synthetic dataset");
+    return;
+  }
+
+  const size_t n = state.range(0);
+  for (auto _ : state) {
+    auto samples = sampler->randomSampleV2(n);
+    benchmark::DoNotOptimize(samples.data());
+  }
+
+  state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_RandomSampleV2)
+    ->Arg(8)
+    ->Arg(32)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+// randomSampleV2 plus fillBatch, what randomBatch does for Python
+static void BM_RandomBatch(benchmark::State &state) {
+  sats::Sampler *sampler = benchSampler();
+  if (!sampler) {
+    state.SkipWithError("no synthetic dataset");
+    return;
+  }
+
+  const size_t n = state.range(0);
+  const size_t bandSize = sampleDim * sampleDim;
+  std::vector<float> bands, labels(n * bandSize);
+
+  for (auto _ : state) {
+    auto samples = sampler->randomSampleV2(n);
+    if (samples.empty()) {
+      state.SkipWithError("randomSampleV2 returned no samples");
+      break;
+    }
+
+    bands.resize(samples.size() * samples[0].nBands * bandSize);
+    auto err = sampler->fillBatch(samples, bands.data(), labels.data());
+    if (err) {
+      state.SkipWithError(err->c_str());
+      break;
+    }
+    benchmark::DoNotOptimize(bands.data());
+  }
+
+  state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_RandomBatch)
+    ->Arg(8)
+    ->Arg(32)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+// The cache store methods are private to the Sampler
+class SamplerBench {
+public:
+  struct Entry {
+    sats::Sampler::ComputationCache cache;
+  };
+
+  static size_t nProducts(const sats::Sampler &sampler) {
+    return sampler.infos.size();
+  }
+
+  // getCacheEntry: row lookup, blob copies and sample map decode
+  static std::optional<std::string> readEntry(sats::Sampler &sampler,
+                                              size_t index, Entry *entry) {
+    bool present = false;
+    auto err = sampler.getCacheEntry(sampler.connectionPool[0],
+                                     sampler.infos[index], &entry->cache,
+                                     &present);
+    if (!err && !present) {
+      return "no cache entry for " + sampler.infos[index].productName;
+    }
+    return err;
+  }
+
+  // writeCacheEntry on the writer connection, one commit per entry
+  static std::optional<std::string> writeEntry(sats::Sampler &sampler,
+                                               const Entry &entry) {
+    return sampler.writeCacheEntry(sampler.writerConnection, entry.cache);
+  }
+};
+
+static void BM_CacheEntryRead(benchmark::State &state) {
+  sats::Sampler *sampler = benchSampler();
+  if (!sampler || !SamplerBench::nProducts(*sampler)) {
+    state.SkipWithError("no synthetic dataset");
+    return;
+  }
+
+  const size_t nProducts = SamplerBench::nProducts(*sampler);
+  size_t i = 0;
+
+  for (auto _ : state) {
+    SamplerBench::Entry entry;
+    if (auto err = SamplerBench::readEntry(*sampler, i++ % nProducts, &entry)) {
+      state.SkipWithError(err->c_str());
+      break;
+    }
+    benchmark::DoNotOptimize(entry.cache.sampleCache.nOK);
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CacheEntryRead)->Unit(benchmark::kMicrosecond);
+
+// Rewrites existing entries with the same contents, so the store is left as
+// it was
+static void BM_CacheEntryWrite(benchmark::State &state) {
+  sats::Sampler *sampler = benchSampler();
+  if (!sampler || !SamplerBench::nProducts(*sampler)) {
+    state.SkipWithError("no synthetic dataset");
+    return;
+  }
+
+  std::vector<SamplerBench::Entry> entries(SamplerBench::nProducts(*sampler));
+  for (size_t i = 0; i < entries.size(); i++) {
+    if (auto err = SamplerBench::readEntry(*sampler, i, &entries[i])) {
+      state.SkipWithError(err->c_str());
+      return;
+    }
+  }
+
+  size_t i = 0;
+  for (auto _ : state) {
+    if (auto err = SamplerBench::writeEntry(*sampler,
+                                            entries[i++ % entries.size()])) {
+      state.SkipWithError(err->c_str());
+      break;
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CacheEntryWrite)->Unit(benchmark::kMicrosecond)->UseRealTime();
+
+int main(int argc, char **argv) {
+  GDALAllRegister();
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+
+  return 0;
+}
@@ -2,10 +2,13 @@
 #include <ATen/ops/tensor.h>
 #include <ATen/ops/zero.h>
 #include <c10/core/TensorOptions.h>
+#include <chrono>
 #include <filesystem>
+#include <format>
 
 #include <pybind11/cast.h>
 #include <pybind11/detail/common.h>
+#include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/pytypes.h>
 #include <pybind11/stl.h>
@@ -13,72 +16,272 @@
 
 #include <torch/extension.h>
 
-#include "cdlCache.h"
+#include "batchRing.h"
+#include "chipShard.h"
+#include "metrics.h"
 #include "sampler.h"
+#include "trace.h"
 
 namespace py = pybind11;
 
-std::pair<torch::Tensor, torch::Tensor> randomBatch(sats::Sampler &m,
-                                                    size_t n) {
-  std::vector<sats::Sampler::Sample> samples = m.randomSampleV2(n);
+static std::pair<sats::Sampler::BatchDType, torch::Dtype>
+parseDType(const std::string &dtype) {
+  if (dtype == "float32") {
+    return std::make_pair(sats::Sampler::BatchDType::FLOAT32, torch::kFloat32);
+  } else if (dtype == "float16") {
+    return std::make_pair(sats::Sampler::BatchDType::FLOAT16, torch::kFloat16);
+  } else if (dtype == "bfloat16") {
+    return std::make_pair(sats::Sampler::BatchDType::BFLOAT16,
+                          torch::kBFloat16);
+  }
+
+  throw std::invalid_argument(std::format(
+      "dtype must be float32, float16 or bfloat16, not {}", dtype));
+}
+
+static std::pair<torch::Tensor, torch::Tensor>
+batchTensors(sats::Sampler &m,
+             const std::vector<sats::Sampler::Sample> &samples,
+             const std::string &dtype) {
+  auto [batchDType, tensorDType] = parseDType(dtype);
 
   auto tensorOpts = at::TensorOptions()
                         .device("cpu")
                         .dtype(torch::kFloat32)
                         .memory_format(torch::MemoryFormat::Contiguous);
   torch::Tensor tensor =
-      torch::empty({static_cast<long>(n), (long)samples[0].bands.size(),
+      torch::empty({(long)samples.size(), (long)samples[0].nBands,
                     (long)m.getSampleDim(), (long)m.getSampleDim()},
+                   tensorOpts.dtype(tensorDType));
+
+  torch::Tensor cdlTensor =
+      torch::empty({(long)samples.size(), 1, (long)m.getSampleDim(),
+                    (long)m.getSampleDim()},
                    tensorOpts);
 
-#pragma omp parallel for
-  for (size_t i = 0; i < n; i++) {
-    for (size_t j = 0; j < samples[0].bands.size(); j++) {
-      using namespace torch::indexing;
-      torch::Tensor t = tensor[i][j];
+  auto err = m.fillBatch(samples, tensor.data_ptr(),
+                         (float *)cdlTensor.data_ptr(), batchDType);
+  if (err) {
+    throw std::runtime_error(err.value());
+  }
 
-      memcpy((float *)t.data_ptr(), samples[i].bands[j].data(),
-             m.getSampleDim() * m.getSampleDim() * sizeof(float));
-    }
+  return std::make_pair(tensor, cdlTensor);
+}
+
+std::pair<torch::Tensor, torch::Tensor>
+randomBatch(sats::Sampler &m, size_t n, const std::string &dtype) {
+  std::vector<sats::Sampler::Sample> samples = m.randomSampleV2(n);
+
+  if (samples.empty()) {
+    throw std::runtime_error("randomSampleV2 returned no samples");
   }
 
-  torch::Tensor cdlTensor = torch::empty(
-      {static_cast<long>(n), 1, (long)m.getSampleDim(), (long)m.getSampleDim()},
-      tensorOpts);
+  return batchTensors(m, samples, dtype);
+}
+
+// Next batch of the epoch as (bands, labels), or None once the shard is done
+py::object epochBatch(sats::Sampler &m, sats::Sampler::EpochCursor &cursor,
+                      const sats::Sampler::EpochOptions &options, size_t n,
+                      const std::string &dtype) {
+  if (auto err = m.checkEpochOptions(options)) {
+    throw std::invalid_argument(err.value());
+  }
+
+  std::vector<sats::Sampler::Sample> samples = m.epochSample(cursor, options, n);
+
+  if (samples.empty()) {
+    return py::none();
+  }
+
+  return py::cast(batchTensors(m, samples, dtype));
+}
+
+static py::buffer_info sampleBuffer(sats::Sampler::Sample &s) {
+  s.decode();
+
+  // a default constructed sample decodes to nothing, expose it with no bands
+  size_t nBands = s.bands.empty() ? 0 : s.nBands;
+  return py::buffer_info(
+      s.bands.data(), sizeof(float), py::format_descriptor<float>::format(), 3,
+      {(py::ssize_t)nBands, (py::ssize_t)s.dim, (py::ssize_t)s.dim},
+      {(py::ssize_t)(sizeof(float) * s.dim * s.dim),
+       (py::ssize_t)(sizeof(float) * s.dim), (py::ssize_t)sizeof(float)});
+}
+
+// {"stages": {stage: {count, total_ms, mean_us, p50_us, p90_us, p99_us,
+// max_us}}, "counters": {counter: n}, "cache_hit_rate": .., ...}
+static py::dict metricsDict() {
+  namespace metrics = sats::metrics;
+  metrics::Snapshot snapshot = metrics::snapshot();
+
+  py::dict stages;
+  for (size_t i = 0; i < metrics::nStages; i++) {
+    const auto &stage = snapshot.stages[i];
+
+    py::dict d;
+    d["count"] = stage.count;
+    d["total_ms"] = stage.totalNs / 1e6;
+    d["mean_us"] = stage.count ? stage.totalNs / 1e3 / stage.count : 0.0;
+    d["p50_us"] = stage.p50Ns / 1e3;
+    d["p90_us"] = stage.p90Ns / 1e3;
+    d["p99_us"] = stage.p99Ns / 1e3;
+    d["max_us"] = stage.maxNs / 1e3;
+    stages[metrics::name((metrics::Stage)i)] = d;
+  }
+
+  py::dict counters;
+  for (size_t i = 0; i < metrics::nCounters; i++) {
+    counters[metrics::name((metrics::Counter)i)] = snapshot.counters[i];
+  }
+
+  auto rate = [&](metrics::Counter hits, metrics::Counter misses) {
+    uint64_t h = snapshot.counters[(size_t)hits];
+    uint64_t total = h + snapshot.counters[(size_t)misses];
+    return total ? (double)h / total : 0.0;
+  };
+
+  py::dict out;
+  out["stages"] = stages;
+  out["counters"] = counters;
+  out["cache_hit_rate"] =
+      rate(metrics::Counter::CACHE_REUSES, metrics::Counter::CACHE_LOADS);
+  out["quality_map_hit_rate"] = rate(metrics::Counter::QUALITY_MAP_HITS,
+                                     metrics::Counter::QUALITY_MAP_MISSES);
+  return out;
+}
+
+static std::shared_ptr<sats::ShardSampler>
+shardSamplerOrThrow(std::pair<std::unique_ptr<sats::ShardSampler>,
+                              std::optional<std::string>>
+                        ret) {
+  if (ret.second) {
+    throw std::runtime_error(ret.second.value());
+  }
+
+  return std::shared_ptr<sats::ShardSampler>(std::move(ret.first));
+}
+
+// Decodes chips into fresh (bands, labels) tensors. `indices` empty draws n
+// random chips instead.
+static std::pair<torch::Tensor, torch::Tensor>
+shardBatch(sats::ShardSampler &s, const std::vector<size_t> &indices,
+           size_t n) {
+  long batch = indices.empty() ? (long)n : (long)indices.size();
+  long dim = (long)s.getSampleDim();
+
+  auto tensorOpts = at::TensorOptions()
+                        .device("cpu")
+                        .dtype(torch::kFloat32)
+                        .memory_format(torch::MemoryFormat::Contiguous);
+  torch::Tensor bands = torch::empty(
+      {batch, (long)s.getNChannels(), dim, dim}, tensorOpts);
+  torch::Tensor labels = torch::empty({batch, 1, dim, dim}, tensorOpts);
+
+  std::optional<std::string> err;
+  {
+    py::gil_scoped_release release;
+    err = indices.empty()
+              ? s.sampleBatch(n, (float *)bands.data_ptr(),
+                              (float *)labels.data_ptr())
+              : s.readChips(indices, (float *)bands.data_ptr(),
+                            (float *)labels.data_ptr());
+  }
+
+  if (err) {
+    throw std::runtime_error(err.value());
+  }
+
+  return std::make_pair(bands, labels);
+}
 
-#pragma omp parallel for
-  for (size_t i = 0; i < n; i++) {
-    std::string cdlPath = m.yearToCDL[samples[i].year];
+static std::shared_ptr<sats::BatchRing>
+ringOrThrow(std::pair<std::unique_ptr<sats::BatchRing>,
+                      std::optional<std::string>>
+                ret) {
+  if (ret.second) {
+    throw std::runtime_error(ret.second.value());
+  }
+
+  return std::shared_ptr<sats::BatchRing>(std::move(ret.first));
+}
+
+// Fills one free slot with a fresh batch and returns its index, or -1 if no
+// slot freed up within `timeoutMs`.
+long fillRing(sats::BatchRing &ring, sats::Sampler &m, int64_t timeoutMs) {
+  py::gil_scoped_release release;
+
+  auto slot = ring.acquireFree(timeoutMs);
+  if (!slot) {
+    return -1;
+  }
+
+  // the slot goes back to FREE on any failure, including exceptions thrown
+  // while sampling, otherwise it stays FILLING until the process dies
+  size_t nValid;
+  try {
+    const auto &shape = ring.getShape();
+    std::vector<sats::Sampler::Sample> samples =
+        m.randomSampleV2(shape.batchSize);
 
-    if (cdlPath.empty()) {
-      std::cout << "cdl for year " << samples[i].year << " is empty!"
-                << std::endl;
-      continue;
+    std::optional<std::string> err;
+    if (samples.empty()) {
+      err = "randomSampleV2 returned no samples";
+    } else if (samples[0].nBands != shape.nChannels ||
+               m.getSampleDim() != shape.dim) {
+      err = std::format("sampler produces ({}, {}, {}) samples, ring holds "
+                        "({}, {}, {})",
+                        samples[0].nBands, m.getSampleDim(), m.getSampleDim(),
+                        shape.nChannels, shape.dim, shape.dim);
+    } else {
+      err = m.fillBatch(samples, ring.bands(slot.value()),
+                        ring.labels(slot.value()));
     }
 
-    torch::Tensor t = cdlTensor[i][0];
-
-    std::vector<float> dat =
-        sats::cdl::read(cdlPath, samples[i].crs.c_str(),
-                        sats::cdl::ProjWin{
-                            .xmin = (double)samples[i].coordsMin.first,
-                            .xmax = (double)samples[i].coordsMax.first,
-                            .ymin = (double)samples[i].coordsMin.second,
-                            .ymax = (double)samples[i].coordsMax.second,
-                        },
-                        (double)m.getSampleDim(), (double)m.getSampleDim());
-
-    if (dat.empty()) {
-      std::cout << "cdl read for " << samples[i].year << " returned empty!"
-                << std::endl;
-      continue;
+    if (err) {
+      throw std::runtime_error(err.value());
     }
+    nValid = samples.size();
+  } catch (...) {
+    ring.abandon(slot.value());
+    throw;
+  }
+
+  ring.publish(slot.value(), nValid);
+  return (long)slot.value();
+}
 
-    memcpy((float *)t.data_ptr(), dat.data(),
-           m.getSampleDim() * m.getSampleDim() * sizeof(float));
+// Maps a READY slot as (bands, labels) tensors without copying. The tensors
+// keep the mapping alive; the slot stays claimed until released.
+py::tuple acquireRing(std::shared_ptr<sats::BatchRing> ring, long slot,
+                      int64_t timeoutMs) {
+  std::optional<size_t> claimed;
+  {
+    py::gil_scoped_release release;
+    if (slot < 0) {
+      claimed = ring->acquireReady(timeoutMs);
+    } else if (ring->acquire(slot, timeoutMs)) {
+      claimed = slot;
+    }
   }
 
-  return std::make_pair(tensor, cdlTensor);
+  if (!claimed) {
+    return py::make_tuple(-1, py::none(), py::none());
+  }
+
+  const auto &shape = ring->getShape();
+  long nValid = (long)ring->validCount(claimed.value());
+
+  auto tensorOpts = at::TensorOptions().device("cpu").dtype(torch::kFloat32);
+  torch::Tensor bands = torch::from_blob(
+      ring->bands(claimed.value()),
+      {nValid, (long)shape.nChannels, (long)shape.dim, (long)shape.dim},
+      [ring](void *) {}, tensorOpts);
+  torch::Tensor labels = torch::from_blob(
+      ring->labels(claimed.value()),
+      {nValid, 1, (long)shape.dim, (long)shape.dim}, [ring](void *) {},
+      tensorOpts);
+
+  return py::make_tuple((long)claimed.value(), bands, labels);
 }
 
 PYBIND11_MODULE(satsamplepy, m) {
@@ -89,16 +292,40 @@ PYBIND11_MODULE(satsamplepy, m) {
                      &sats::Sampler::SampleOptions::nCacheGenThreads)
       .def_readwrite("nCacheQueryThreads",
                      &sats::Sampler::SampleOptions::nCacheQueryThreads)
+      .def_readwrite("nCacheComputeThreads",
+                     &sats::Sampler::SampleOptions::nCacheComputeThreads)
+      .def_readwrite("rank", &sats::Sampler::SampleOptions::rank)
+      .def_readwrite("worldSize", &sats::Sampler::SampleOptions::worldSize)
+      .def_readwrite("minQuality", &sats::Sampler::SampleOptions::minQuality)
+      .def_readwrite("generateMissingCache",
+                     &sats::Sampler::SampleOptions::generateMissingCache)
+      .def_readwrite("jitter", &sats::Sampler::SampleOptions::jitter)
+      .def_readwrite("backgroundCache",
+                     &sats::Sampler::SampleOptions::backgroundCache)
+      .def_readwrite("hugePages", &sats::Sampler::SampleOptions::hugePages)
+      .def_readwrite("numaLocal", &sats::Sampler::SampleOptions::numaLocal)
       .def(py::pickle(
           [](const sats::Sampler::SampleOptions &s) {
-            return py::make_tuple(s.dbPath, s.nCacheGenThreads,
-                                  s.nCacheQueryThreads);
+            return py::make_tuple(
+                s.dbPath, s.nCacheGenThreads, s.nCacheQueryThreads,
+                s.nCacheComputeThreads, s.rank, s.worldSize, s.minQuality,
+                s.generateMissingCache, s.jitter, s.backgroundCache,
+                s.hugePages, s.numaLocal);
           },
           [](py::tuple t) {
             return sats::Sampler::SampleOptions{
                 t[0].cast<std::filesystem::path>(),
                 t[1].cast<size_t>(),
                 t[2].cast<size_t>(),
+                t[3].cast<size_t>(),
+                t[4].cast<size_t>(),
+                t[5].cast<size_t>(),
+                t[6].cast<float>(),
+                t[7].cast<bool>(),
+                t[8].cast<bool>(),
+                t[9].cast<bool>(),
+                t[10].cast<bool>(),
+                t[11].cast<bool>(),
             };
           }));
   py::class_<sats::Sampler::SampleCacheGenOptions>(m, "SampleCacheGenOptions")
@@ -142,9 +369,18 @@ PYBIND11_MODULE(satsamplepy, m) {
             };
           }));
 
-  py::class_<sats::Sampler::Sample>(m, "Sample")
+  py::class_<sats::Sampler::Sample>(m, "Sample", py::buffer_protocol())
       .def(py::init<>())
-      .def_readwrite("bands", &sats::Sampler::Sample::bands)
+      .def_buffer([](sats::Sampler::Sample &s) { return sampleBuffer(s); })
+      .def_property_readonly(
+          "bands",
+          [](py::object self) {
+            // (C, H, W) view over the sample's own buffer, no copy
+            auto &s = self.cast<sats::Sampler::Sample &>();
+            return py::array(sampleBuffer(s), self);
+          })
+      .def_readonly("n_bands", &sats::Sampler::Sample::nBands)
+      .def_readonly("dim", &sats::Sampler::Sample::dim)
       .def_readwrite("coords_min", &sats::Sampler::Sample::coordsMin)
       .def_readwrite("coords_max", &sats::Sampler::Sample::coordsMax)
       .def_readwrite("crs", &sats::Sampler::Sample::crs)
@@ -153,18 +389,93 @@ PYBIND11_MODULE(satsamplepy, m) {
       .def_readwrite("day", &sats::Sampler::Sample::day)
       .def(py::pickle(
           [](const sats::Sampler::Sample &s) {
-            return py::make_tuple(s.bands, s.coordsMin, s.coordsMax, s.crs,
-                                  s.year, s.month, s.day);
+            // raw reflectance, decoded again on the other side
+            return py::make_tuple(
+                py::bytes((const char *)s.raw.data(),
+                          s.raw.size() * sizeof(uint16_t)),
+                s.lower, s.scale, s.nBands, s.dim, s.crs, s.coordsMin,
+                s.coordsMax, s.year, s.month, s.day);
           },
           [](py::tuple t) {
-            return sats::Sampler::Sample{
-                t[0].cast<std::vector<std::vector<float>>>(),
-                t[1].cast<std::string>(),
-                t[2].cast<std::pair<size_t, size_t>>(),
-                t[3].cast<std::pair<size_t, size_t>>(),
-                t[4].cast<size_t>(),
-                t[5].cast<size_t>(),
-                t[6].cast<size_t>(),
+            std::string_view raw = t[0].cast<std::string_view>();
+            auto lower = t[1].cast<std::vector<float>>();
+            auto scale = t[2].cast<std::vector<float>>();
+            size_t nBands = t[3].cast<size_t>();
+            size_t dim = t[4].cast<size_t>();
+
+            // every band but the trailing ndvi one is carried raw
+            size_t nRaw = nBands ? nBands - 1 : 0;
+            if (raw.size() != nRaw * dim * dim * sizeof(uint16_t) ||
+                lower.size() != nRaw || scale.size() != nRaw) {
+              throw std::runtime_error(std::format(
+                  "Sample state holds {} raw bytes and {} / {} normalization "
+                  "bands, expected {} and {} for a ({}, {}, {}) sample",
+                  raw.size(), lower.size(), scale.size(),
+                  nRaw * dim * dim * sizeof(uint16_t), nRaw, nBands, dim,
+                  dim));
+            }
+
+            sats::Sampler::Sample s{
+                .raw = sats::Sampler::RawBuffer(raw.size() / sizeof(uint16_t)),
+                .lower = std::move(lower),
+                .scale = std::move(scale),
+                .nBands = nBands,
+                .dim = dim,
+                .bands = {},
+                .crs = t[5].cast<std::string>(),
+                .coordsMin = t[6].cast<std::pair<size_t, size_t>>(),
+                .coordsMax = t[7].cast<std::pair<size_t, size_t>>(),
+                .year = t[8].cast<size_t>(),
+                .month = t[9].cast<size_t>(),
+                .day = t[10].cast<size_t>(),
+            };
+            memcpy(s.raw.data(), raw.data(), s.raw.size() * sizeof(uint16_t));
+
+            return s;
+          }));
+
+  py::class_<sats::Sampler::EpochOptions>(m, "EpochOptions")
+      .def(py::init([]() {
+        return sats::Sampler::EpochOptions{
+            .stride = 0, .rank = 0, .worldSize = 1, .worker = 0, .nWorkers = 1};
+      }))
+      .def_readwrite("stride", &sats::Sampler::EpochOptions::stride)
+      .def_readwrite("rank", &sats::Sampler::EpochOptions::rank)
+      .def_readwrite("worldSize", &sats::Sampler::EpochOptions::worldSize)
+      .def_readwrite("worker", &sats::Sampler::EpochOptions::worker)
+      .def_readwrite("nWorkers", &sats::Sampler::EpochOptions::nWorkers)
+      .def(py::pickle(
+          [](const sats::Sampler::EpochOptions &s) {
+            return py::make_tuple(s.stride, s.rank, s.worldSize, s.worker,
+                                  s.nWorkers);
+          },
+          [](py::tuple t) {
+            return sats::Sampler::EpochOptions{
+                t[0].cast<size_t>(), t[1].cast<size_t>(), t[2].cast<size_t>(),
+                t[3].cast<size_t>(), t[4].cast<size_t>(),
+            };
+          }));
+  py::class_<sats::Sampler::ShardExportOptions>(m, "ShardExportOptions")
+      .def(py::init([]() {
+        return sats::Sampler::ShardExportOptions{
+            .stride = 0, .chipsPerShard = 1024, .ndvi = false};
+      }))
+      .def_readwrite("stride", &sats::Sampler::ShardExportOptions::stride)
+      .def_readwrite("chipsPerShard",
+                     &sats::Sampler::ShardExportOptions::chipsPerShard)
+      .def_readwrite("ndvi", &sats::Sampler::ShardExportOptions::ndvi);
+  py::class_<sats::Sampler::EpochCursor>(m, "EpochCursor")
+      .def(py::init([]() { return sats::Sampler::EpochCursor{0, 0}; }))
+      .def_readwrite("product", &sats::Sampler::EpochCursor::product)
+      .def_readwrite("window", &sats::Sampler::EpochCursor::window)
+      .def(py::pickle(
+          [](const sats::Sampler::EpochCursor &s) {
+            return py::make_tuple(s.product, s.window);
+          },
+          [](py::tuple t) {
+            return sats::Sampler::EpochCursor{
+                t[0].cast<size_t>(),
+                t[1].cast<size_t>(),
             };
           }));
 
@@ -176,19 +487,147 @@ PYBIND11_MODULE(satsamplepy, m) {
            py::arg("date_range"), py::arg("should_preproc") = false)
       .def("randomSample", &sats::Sampler::randomSampleV2, "get random samples",
            py::arg("n"))
-      .def("randomSample2", &randomBatch, "get random samples", py::arg("n"))
+      .def_static("buildCache", &sats::Sampler::buildCache,
+                  "fill the cache store ahead of training",
+                  py::call_guard<py::gil_scoped_release>(), py::arg("path"),
+                  py::arg("sample_options"), py::arg("cache_options"),
+                  py::arg("date_range"))
+      .def("randomSample2", &randomBatch, "get random samples", py::arg("n"),
+           py::arg("dtype") = "float32")
+      .def("coverage", &sats::Sampler::getCoverage,
+           "fraction of products with a cache entry to sample from")
+      .def(
+          "waitForCoverage",
+          [](sats::Sampler &sampler, float fraction,
+             std::optional<double> timeout) {
+            std::optional<std::chrono::milliseconds> timeoutMs;
+            if (timeout) {
+              timeoutMs = std::chrono::milliseconds((long)(*timeout * 1000));
+            }
+            return sampler.waitForCoverage(fraction, timeoutMs);
+          },
+          "wait until `fraction` of the products have a cache entry, returns "
+          "whether it was reached",
+          py::call_guard<py::gil_scoped_release>(), py::arg("fraction"),
+          py::arg("timeout") = std::nullopt)
+      .def("setMinQuality", &sats::Sampler::setMinQuality,
+           "change the sampling-time quality threshold", py::arg("min_quality"))
+      .def("epochSample", &sats::Sampler::epochSample,
+           "get the next n windows of an epoch, advancing the cursor",
+           py::arg("cursor"), py::arg("options"), py::arg("n"))
+      .def("epochBatch", &epochBatch,
+           "get the next n windows of an epoch as tensors, advancing the "
+           "cursor",
+           py::arg("cursor"), py::arg("options"), py::arg("n"),
+           py::arg("dtype") = "float32")
+      .def("exportShards", &sats::Sampler::exportShards,
+           "write every valid grid window into pre-tiled chip shards",
+           py::call_guard<py::gil_scoped_release>(), py::arg("out_dir"),
+           py::arg("options"))
       .def(py::pickle(
           [](const sats::Sampler &s) {
             return py::make_tuple(s.dataPath, s.sampleOptions,
                                   s.cacheGenOptions, s.dateRange, s.preproc);
           },
           [](py::tuple t) {
-            return sats::Sampler(
-                t[0].cast<std::filesystem::path>(),
-                t[1].cast<sats::Sampler::SampleOptions>(),
+            // Copies (spawned DataLoader workers) sample what the original
+            // has committed and never generate entries themselves, otherwise
+            // every worker would run its own pass over the same store.
+            auto sampleOptions = t[1].cast<sats::Sampler::SampleOptions>();
+            sampleOptions.backgroundCache = false;
+            sampleOptions.generateMissingCache = false;
+
+            // constructed in place, the Sampler owns connections and locks
+            return new sats::Sampler(
+                t[0].cast<std::filesystem::path>(), sampleOptions,
                 t[2].cast<sats::Sampler::SampleCacheGenOptions>(),
                 t[3].cast<std::optional<sats::DateRange>>(), t[4].cast<bool>());
           }));
+  py::class_<sats::BatchRing, std::shared_ptr<sats::BatchRing>>(m,
+                                                                "BatchRing")
+      .def_static(
+          "create",
+          [](const std::string &name, size_t nSlots, size_t batchSize,
+             size_t nChannels, size_t dim) {
+            return ringOrThrow(sats::BatchRing::create(
+                name, sats::BatchRing::Shape{
+                          .nSlots = nSlots,
+                          .batchSize = batchSize,
+                          .nChannels = nChannels,
+                          .dim = dim,
+                      }));
+          },
+          "create a shared memory batch ring", py::arg("name"),
+          py::arg("n_slots"), py::arg("batch_size"), py::arg("n_channels"),
+          py::arg("dim"))
+      .def_static(
+          "attach",
+          [](const std::string &name) {
+            return ringOrThrow(sats::BatchRing::attach(name));
+          },
+          "attach to an existing batch ring", py::arg("name"))
+      .def("fill", &fillRing, "fill a free slot with a random batch",
+           py::arg("sampler"), py::arg("timeout_ms") = -1)
+      .def("acquire", &acquireRing,
+           "claim a ready slot, returns (slot, bands, labels)",
+           py::arg("slot") = -1, py::arg("timeout_ms") = -1)
+      .def("release", &sats::BatchRing::release, "return a slot to the ring",
+           py::arg("slot"))
+      .def("reclaimDead", &sats::BatchRing::reclaimDead,
+           "free slots held by dead processes")
+      .def_property_readonly("name", &sats::BatchRing::getName)
+      .def_property_readonly(
+          "nSlots", [](const sats::BatchRing &r) { return r.getShape().nSlots; })
+      .def(py::pickle(
+          [](const sats::BatchRing &r) { return py::make_tuple(r.getName()); },
+          [](py::tuple t) {
+            return ringOrThrow(
+                sats::BatchRing::attach(t[0].cast<std::string>()));
+          }));
+
+  py::class_<sats::ShardSampler, std::shared_ptr<sats::ShardSampler>>(
+      m, "ShardSampler")
+      .def(py::init([](const std::filesystem::path &dir, uint64_t seed) {
+             return shardSamplerOrThrow(sats::ShardSampler::open(dir, seed));
+           }),
+           py::arg("path"), py::arg("seed") = 0)
+      .def(
+          "randomBatch",
+          [](sats::ShardSampler &s, size_t n) {
+            return shardBatch(s, {}, n);
+          },
+          "n random chips as (bands, labels)", py::arg("n"))
+      .def(
+          "readChips",
+          [](sats::ShardSampler &s, const std::vector<size_t> &indices) {
+            return shardBatch(s, indices, 0);
+          },
+          "the given chips as (bands, labels)", py::arg("indices"))
+      .def("__len__", &sats::ShardSampler::size)
+      .def_property_readonly("sampleDim", &sats::ShardSampler::getSampleDim)
+      .def_property_readonly("nChannels", &sats::ShardSampler::getNChannels);
+
+  m.def("metrics", &metricsDict,
+        "per-stage latency percentiles and counters summed over all threads");
+  m.def("resetMetrics", &sats::metrics::reset,
+        "zero all metrics, e.g. at the start of an epoch");
+  m.def("setMetricsEnabled", &sats::metrics::setEnabled,
+        "turn metrics collection on or off", py::arg("enabled"));
+  m.def("traceStart", &sats::trace::start,
+        "start recording a per-thread event timeline",
+        py::arg("events_per_thread") = 1 << 14);
+  m.def("traceStop", &sats::trace::stop, "stop recording the timeline");
+  m.def(
+      "traceDump",
+      [](const std::filesystem::path &path) {
+        auto err = sats::trace::dump(path);
+        if (err) {
+          throw std::runtime_error(err.value());
+        }
+      },
+      "write the timeline as Chrome trace JSON (chrome://tracing, Perfetto)",
+      py::call_guard<py::gil_scoped_release>(), py::arg("path"));
+
   m.attr("__version__") = "dev";
   // py::implicitly_convertible<std::string, std::filesystem::path>();
 }
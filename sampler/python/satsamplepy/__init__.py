@@ -5,3 +5,91 @@ import torch
 from .satsamplepy import *
 
 # __all__ = ["__doc__", "__version__", "add", "subtract"]
+
+
+class RingDataset(torch.utils.data.Dataset):
+    """Fills a shared BatchRing from DataLoader workers.
+
+    Items are slot indices; the trainer maps them with ``ring.acquire(slot)``
+    and hands them back with ``ring.release(slot)``. The ring needs more slots
+    than the loader keeps in flight (num_workers * prefetch_factor), otherwise
+    workers stall waiting for a free slot.
+    """
+
+    def __init__(self, sampler: Sampler, ring: BatchRing, batchesPerEpoch: int):
+        self.sampler = sampler
+        self.ring = ring
+        self.batchesPerEpoch = batchesPerEpoch
+
+    def __len__(self):
+        return self.batchesPerEpoch
+
+    def __getitem__(self, index):
+        return self.ring.fill(self.sampler)
+
+
+class EpochDataset(torch.utils.data.IterableDataset):
+    """Yields every valid window of the sampler's shard exactly once.
+
+    Ranks come from the sampler's ``SampleOptions.rank`` / ``worldSize``;
+    each DataLoader worker walks its own part of the rank's products, so the
+    loader must be created with ``batch_size=None``. ``dtype`` ("float32",
+    "float16" or "bfloat16") sets the band tensor type.
+
+    Items are ``(bands, labels, worker, cursor)``, ``cursor`` being that
+    worker's position after the batch. Workers advance copies of the dataset,
+    so the loader process keeps the positions: pass each item's worker and
+    cursor to ``advance`` and save ``cursors``. A dataset created with saved
+    ``cursors`` resumes where every worker left off, given the same number of
+    workers.
+    """
+
+    def __init__(
+        self,
+        sampler: Sampler,
+        n: int,
+        stride: int = 0,
+        cursors: list[EpochCursor] | None = None,
+        dtype: str = "float32",
+    ):
+        self.sampler = sampler
+        self.n = n
+        self.dtype = dtype
+        self.stride = stride
+        self.cursors = [_copyCursor(c) for c in cursors] if cursors else []
+
+    def advance(self, worker: int, cursor: EpochCursor):
+        while len(self.cursors) <= worker:
+            self.cursors.append(EpochCursor())
+        self.cursors[worker] = _copyCursor(cursor)
+
+    def __iter__(self):
+        options = EpochOptions()
+        options.stride = self.stride
+
+        worker = 0
+        info = torch.utils.data.get_worker_info()
+        if info is not None:
+            worker = info.id
+            options.worker = info.id
+            options.nWorkers = info.num_workers
+
+        cursor = (
+            _copyCursor(self.cursors[worker])
+            if worker < len(self.cursors)
+            else EpochCursor()
+        )
+
+        while True:
+            batch = self.sampler.epochBatch(cursor, options, self.n, self.dtype)
+            if batch is None:
+                return
+            bands, labels = batch
+            yield bands, labels, worker, _copyCursor(cursor)
+
+
+def _copyCursor(cursor: EpochCursor) -> EpochCursor:
+    copy = EpochCursor()
+    copy.product = cursor.product
+    copy.window = cursor.window
+    return copy
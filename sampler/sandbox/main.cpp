@@ -31,15 +31,17 @@ int main() {
     auto samples = s.randomSampleV2(nSamples);
     assert(samples.size() == nSamples);
 
-    for (const auto &sample : samples) {
+    for (auto &sample : samples) {
+      sample.decode();
+
       cv::Mat temp;
       cv::Mat r, g, b;
 
-      r = cv::Mat(256, 256, CV_32F, (float *)sample.bands[0].data());
+      r = cv::Mat(256, 256, CV_32F, (float *)sample.band(0));
 
-      g = cv::Mat(256, 256, CV_32F, (float *)sample.bands[1].data());
+      g = cv::Mat(256, 256, CV_32F, (float *)sample.band(1));
 
-      b = cv::Mat(256, 256, CV_32F, (float *)sample.bands[2].data());
+      b = cv::Mat(256, 256, CV_32F, (float *)sample.band(2));
 
       // cv::Mat c =
       //     cv::Mat(256, 256, CV_32FC1,
@@ -48,7 +50,7 @@ int main() {
 
       cv::Mat ndvi =
           cv::Mat(256, 256, CV_32FC1,
-                  (float *)sample.bands[sample.bands.size() - 1].data());
+                  (float *)sample.band(sample.nBands - 1));
       for (int r = 0; r < ndvi.rows; r++) {
         for (int c = 0; c < ndvi.cols; c++) {
           if (ndvi.at<float>(cv::Vec2i{r, c}) < 0.2) {
@@ -0,0 +1,290 @@
+#include "batchRing.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <format>
+#include <thread>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace sats {
+
+static const uint64_t ringMagic = 0x474e495254415353; // "SSATRING"
+static const uint64_t ringVersion = 1;
+static const size_t ringAlignment = 4096;
+
+static size_t alignUp(size_t v, size_t alignment) {
+  return (v + alignment - 1) / alignment * alignment;
+}
+
+static std::string shmName(const std::string &name) {
+  return name.starts_with("/") ? name : "/" + name;
+}
+
+// Calls `attempt` until it succeeds or `timeoutMs` runs out (negative waits
+// forever). Slots are held for whole batches so polling with a capped
+// backoff costs nothing measurable and, unlike std::atomic::wait, works
+// across processes.
+template <typename F> static bool pollUntil(F attempt, int64_t timeoutMs) {
+  auto start = std::chrono::steady_clock::now();
+  auto backoff = std::chrono::microseconds(20);
+
+  while (!attempt()) {
+    if (timeoutMs >= 0 &&
+        std::chrono::steady_clock::now() - start >
+            std::chrono::milliseconds(timeoutMs)) {
+      return false;
+    }
+
+    std::this_thread::sleep_for(backoff);
+    backoff = std::min(backoff * 2, std::chrono::microseconds(1000));
+  }
+
+  return true;
+}
+
+size_t BatchRing::layoutSize(const Shape &shape, size_t *dataOffset,
+                             size_t *slotStride) {
+  size_t controlSize = sizeof(Header) + shape.nSlots * sizeof(SlotControl);
+  *dataOffset = alignUp(controlSize, ringAlignment);
+
+  size_t slotFloats = shape.batchSize * (shape.nChannels + 1) * shape.dim *
+                      shape.dim;
+  *slotStride = alignUp(slotFloats * sizeof(float), ringAlignment);
+
+  return *dataOffset + *slotStride * shape.nSlots;
+}
+
+BatchRing::BatchRing(std::string name, void *map, size_t mapSize, bool owner)
+    : name(std::move(name)), map(map), mapSize(mapSize), owner(owner) {
+  header = (Header *)map;
+  shape = header->shape;
+}
+
+BatchRing::~BatchRing() {
+  munmap(map, mapSize);
+
+  if (owner) {
+    shm_unlink(shmName(name).c_str());
+  }
+}
+
+std::pair<std::unique_ptr<BatchRing>, std::optional<std::string>>
+BatchRing::create(const std::string &name, Shape shape) {
+  if (!shape.nSlots || !shape.batchSize || !shape.nChannels || !shape.dim) {
+    return std::make_pair(nullptr, "batch ring shape must be nonzero");
+  }
+
+  size_t dataOffset, slotStride;
+  size_t size = layoutSize(shape, &dataOffset, &slotStride);
+
+  int fd = shm_open(shmName(name).c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600);
+  if (fd < 0) {
+    return std::make_pair(nullptr, std::format("shm_open {}: {}", name,
+                                               std::strerror(errno)));
+  }
+
+  if (ftruncate(fd, size) != 0) {
+    auto err = std::format("ftruncate {} to {} bytes: {}", name, size,
+                           std::strerror(errno));
+    close(fd);
+    shm_unlink(shmName(name).c_str());
+    return std::make_pair(nullptr, err);
+  }
+
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED) {
+    shm_unlink(shmName(name).c_str());
+    return std::make_pair(nullptr,
+                          std::format("mmap {}: {}", name, std::strerror(errno)));
+  }
+
+  // the segment is zero filled, so every slot starts out SLOT_FREE
+  Header *header = (Header *)map;
+  header->magic = ringMagic;
+  header->version = ringVersion;
+  header->mapSize = size;
+  header->dataOffset = dataOffset;
+  header->slotStride = slotStride;
+  header->shape = shape;
+  header->publishSeq.store(0);
+
+  return std::make_pair(
+      std::unique_ptr<BatchRing>(new BatchRing(name, map, size, true)),
+      std::nullopt);
+}
+
+std::pair<std::unique_ptr<BatchRing>, std::optional<std::string>>
+BatchRing::attach(const std::string &name) {
+  int fd = shm_open(shmName(name).c_str(), O_RDWR, 0600);
+  if (fd < 0) {
+    return std::make_pair(nullptr, std::format("shm_open {}: {}", name,
+                                               std::strerror(errno)));
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+    close(fd);
+    return std::make_pair(nullptr,
+                          std::format("{} is not a batch ring", name));
+  }
+
+  void *map =
+      mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED) {
+    return std::make_pair(nullptr,
+                          std::format("mmap {}: {}", name, std::strerror(errno)));
+  }
+
+  Header *header = (Header *)map;
+  if (header->magic != ringMagic || header->version != ringVersion ||
+      header->mapSize != (uint64_t)st.st_size) {
+    munmap(map, st.st_size);
+    return std::make_pair(
+        nullptr, std::format("{} has an incompatible batch ring layout", name));
+  }
+
+  return std::make_pair(
+      std::unique_ptr<BatchRing>(new BatchRing(name, map, st.st_size, false)),
+      std::nullopt);
+}
+
+BatchRing::SlotControl &BatchRing::control(size_t slot) const {
+  return ((SlotControl *)((char *)map + sizeof(Header)))[slot];
+}
+
+char *BatchRing::slotData(size_t slot) const {
+  return (char *)map + header->dataOffset + header->slotStride * slot;
+}
+
+float *BatchRing::bands(size_t slot) const { return (float *)slotData(slot); }
+
+float *BatchRing::labels(size_t slot) const {
+  return (float *)slotData(slot) + bandsPerSlot();
+}
+
+size_t BatchRing::validCount(size_t slot) const {
+  return control(slot).nValid.load(std::memory_order_acquire);
+}
+
+bool BatchRing::transition(size_t slot, uint32_t from, uint32_t to) {
+  uint32_t expected = from;
+  if (!control(slot).state.compare_exchange_strong(
+          expected, to, std::memory_order_acq_rel)) {
+    return false;
+  }
+
+  control(slot).owner.store(to == SLOT_FREE || to == SLOT_READY ? 0 : getpid(),
+                            std::memory_order_release);
+  return true;
+}
+
+std::optional<size_t> BatchRing::acquireFree(int64_t timeoutMs) {
+  size_t claimed = 0;
+  bool ok = pollUntil(
+      [&]() {
+        for (size_t i = 0; i < shape.nSlots; i++) {
+          if (transition(i, SLOT_FREE, SLOT_FILLING)) {
+            claimed = i;
+            return true;
+          }
+        }
+        return false;
+      },
+      timeoutMs);
+
+  if (!ok) {
+    return std::nullopt;
+  }
+
+  return claimed;
+}
+
+void BatchRing::publish(size_t slot, size_t nValid) {
+  SlotControl &c = control(slot);
+  c.nValid.store(nValid, std::memory_order_relaxed);
+  c.seq.store(header->publishSeq.fetch_add(1, std::memory_order_relaxed),
+              std::memory_order_relaxed);
+  transition(slot, SLOT_FILLING, SLOT_READY);
+}
+
+void BatchRing::abandon(size_t slot) {
+  transition(slot, SLOT_FILLING, SLOT_FREE);
+}
+
+std::optional<size_t> BatchRing::acquireReady(int64_t timeoutMs) {
+  size_t claimed = 0;
+  bool ok = pollUntil(
+      [&]() {
+        // oldest first so batches come out in publish order
+        std::optional<size_t> oldest;
+        uint64_t oldestSeq = 0;
+        for (size_t i = 0; i < shape.nSlots; i++) {
+          if (control(i).state.load(std::memory_order_acquire) != SLOT_READY) {
+            continue;
+          }
+
+          uint64_t seq = control(i).seq.load(std::memory_order_relaxed);
+          if (!oldest || seq < oldestSeq) {
+            oldest = i;
+            oldestSeq = seq;
+          }
+        }
+
+        if (oldest && transition(*oldest, SLOT_READY, SLOT_CONSUMING)) {
+          claimed = *oldest;
+          return true;
+        }
+        return false;
+      },
+      timeoutMs);
+
+  if (!ok) {
+    return std::nullopt;
+  }
+
+  return claimed;
+}
+
+bool BatchRing::acquire(size_t slot, int64_t timeoutMs) {
+  if (slot >= shape.nSlots) {
+    return false;
+  }
+
+  return pollUntil(
+      [&]() { return transition(slot, SLOT_READY, SLOT_CONSUMING); },
+      timeoutMs);
+}
+
+void BatchRing::release(size_t slot) {
+  transition(slot, SLOT_CONSUMING, SLOT_FREE);
+}
+
+size_t BatchRing::reclaimDead() {
+  size_t nReclaimed = 0;
+  for (size_t i = 0; i < shape.nSlots; i++) {
+    int32_t pid = control(i).owner.load(std::memory_order_acquire);
+    if (pid <= 0 || kill(pid, 0) == 0 || errno != ESRCH) {
+      continue;
+    }
+
+    uint32_t state = control(i).state.load(std::memory_order_acquire);
+    if ((state == SLOT_FILLING || state == SLOT_CONSUMING) &&
+        transition(i, state, SLOT_FREE)) {
+      nReclaimed++;
+    }
+  }
+
+  return nReclaimed;
+}
+
+} // namespace sats
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+
+namespace sats {
+
+// A ring of fixed-shape batch slots living in POSIX shared memory. DataLoader
+// workers fill slots in place and only hand the slot index back to the
+// trainer, which maps the slot as tensors without copying.
+//
+// Slot ownership: FREE -> FILLING (producer) -> READY -> CONSUMING (consumer)
+// -> FREE. Every transition is a CAS on the slot state so any number of
+// producer and consumer processes can share one ring.
+class BatchRing {
+public:
+  struct Shape {
+    size_t nSlots;
+    size_t batchSize;
+    size_t nChannels;
+    size_t dim;
+  };
+
+  enum SlotState : uint32_t {
+    SLOT_FREE = 0,
+    SLOT_FILLING = 1,
+    SLOT_READY = 2,
+    SLOT_CONSUMING = 3,
+  };
+
+  BatchRing() = delete;
+  BatchRing(const BatchRing &) = delete;
+  BatchRing &operator=(const BatchRing &) = delete;
+
+  virtual ~BatchRing();
+
+  // Creates (or truncates) the shared memory segment `name`. The creator
+  // unlinks the segment on destruction.
+  static std::pair<std::unique_ptr<BatchRing>, std::optional<std::string>>
+  create(const std::string &name, Shape shape);
+
+  // Maps an existing segment created by another process.
+  static std::pair<std::unique_ptr<BatchRing>, std::optional<std::string>>
+  attach(const std::string &name);
+
+  // Claims a FREE slot for filling. Returns std::nullopt on timeout.
+  std::optional<size_t> acquireFree(int64_t timeoutMs = -1);
+
+  // Marks a FILLING slot READY, `nValid` is the number of samples written.
+  void publish(size_t slot, size_t nValid);
+
+  // Gives a FILLING slot back without publishing it.
+  void abandon(size_t slot);
+
+  // Claims the oldest READY slot. Returns std::nullopt on timeout.
+  std::optional<size_t> acquireReady(int64_t timeoutMs = -1);
+
+  // Claims a specific READY slot, e.g. one whose index was handed over by a
+  // DataLoader worker.
+  bool acquire(size_t slot, int64_t timeoutMs = -1);
+
+  // Returns a CONSUMING slot to the free list.
+  void release(size_t slot);
+
+  // Frees slots held by processes that no longer exist.
+  size_t reclaimDead();
+
+  float *bands(size_t slot) const;
+  float *labels(size_t slot) const;
+  size_t validCount(size_t slot) const;
+
+  const Shape &getShape() const { return shape; }
+  const std::string &getName() const { return name; }
+
+  size_t bandsPerSlot() const {
+    return shape.batchSize * shape.nChannels * shape.dim * shape.dim;
+  }
+  size_t labelsPerSlot() const {
+    return shape.batchSize * shape.dim * shape.dim;
+  }
+
+private:
+  struct SlotControl {
+    std::atomic<uint32_t> state;
+    std::atomic<int32_t> owner;
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> nValid;
+  };
+
+  struct Header {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t mapSize;
+    uint64_t dataOffset;
+    uint64_t slotStride;
+    Shape shape;
+    std::atomic<uint64_t> publishSeq;
+  };
+
+  BatchRing(std::string name, void *map, size_t mapSize, bool owner);
+
+  SlotControl &control(size_t slot) const;
+  char *slotData(size_t slot) const;
+
+  bool transition(size_t slot, uint32_t from, uint32_t to);
+
+  static size_t layoutSize(const Shape &shape, size_t *dataOffset,
+                           size_t *slotStride);
+
+  std::string name;
+  void *map;
+  size_t mapSize;
+  bool owner;
+
+  Header *header;
+  Shape shape;
+};
+
+} // namespace sats
@@ -0,0 +1,114 @@
+#include "cacheWriter.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <format>
+#include <utility>
+
+namespace sats {
+
+CacheWriter::CacheWriter(sqlite3 *conn, size_t maxBatch)
+    : conn(conn), maxBatch(std::max(maxBatch, (size_t)1)) {
+  thread = std::thread(&CacheWriter::run, this);
+}
+
+CacheWriter::~CacheWriter() {
+  {
+    std::lock_guard guard(lock);
+    closing = true;
+  }
+  pendingCv.notify_all();
+  thread.join();
+}
+
+void CacheWriter::submit(Write write, Committed onCommit) {
+  {
+    std::lock_guard guard(lock);
+    pending.push_back({std::move(write), std::move(onCommit)});
+    nSubmitted++;
+  }
+  pendingCv.notify_one();
+}
+
+std::optional<std::string> CacheWriter::flush() {
+  std::unique_lock guard(lock);
+  size_t target = nSubmitted;
+  committedCv.wait(guard, [&]() { return nCommitted >= target; });
+
+  if (errors.empty()) {
+    return std::nullopt;
+  }
+
+  return std::exchange(errors, "");
+}
+
+static std::optional<std::string> exec(sqlite3 *conn, const char *sql) {
+  char *errmsg = nullptr;
+  if (sqlite3_exec(conn, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+    std::string err = std::format("{}: {}", sql, errmsg ? errmsg : "?");
+    sqlite3_free(errmsg);
+    return err;
+  }
+
+  return std::nullopt;
+}
+
+void CacheWriter::run() {
+  while (true) {
+    std::vector<Entry> batch;
+    {
+      std::unique_lock guard(lock);
+      pendingCv.wait(guard, [&]() { return !pending.empty() || closing; });
+
+      if (pending.empty()) {
+        return;
+      }
+
+      // everything that piled up while the last batch committed
+      while (!pending.empty() && batch.size() < maxBatch) {
+        batch.push_back(std::move(pending.front()));
+        pending.pop_front();
+      }
+    }
+
+    std::string batchErrors;
+    auto appendError = [&](const std::string &err) {
+      batchErrors += err + "\n";
+    };
+
+    // writes that succeeded, their callbacks only run if COMMIT does too
+    std::vector<Committed> written;
+    trace::Scope scope("commit", "cache", batch.size());
+
+    if (auto err = exec(conn, "BEGIN IMMEDIATE;")) {
+      appendError(err.value());
+    } else {
+      for (auto &entry : batch) {
+        if (auto err = entry.write(conn)) {
+          appendError(err.value());
+        } else if (entry.onCommit) {
+          written.push_back(std::move(entry.onCommit));
+        }
+      }
+
+      if (auto err = exec(conn, "COMMIT;")) {
+        appendError(err.value());
+        exec(conn, "ROLLBACK;");
+        written.clear();
+      }
+    }
+
+    for (auto &onCommit : written) {
+      onCommit();
+    }
+
+    {
+      std::lock_guard guard(lock);
+      errors += batchErrors;
+      nCommitted += batch.size();
+    }
+    committedCv.notify_all();
+  }
+}
+
+} // namespace sats
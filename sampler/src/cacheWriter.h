@@ -0,0 +1,68 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sqlite3.h>
+
+namespace sats {
+
+// Single writer thread for the cache store. Writes are queued as closures
+// and committed in batched transactions on the writer's own connection, so
+// cache generation workers never wait on SQLite (or on each other for the
+// write lock).
+class CacheWriter {
+public:
+  using Write = std::function<std::optional<std::string>(sqlite3 *)>;
+  using Committed = std::function<void()>;
+
+  CacheWriter() = delete;
+  CacheWriter(const CacheWriter &) = delete;
+  CacheWriter &operator=(const CacheWriter &) = delete;
+
+  // `conn` stays owned by the caller and must only be used by the writer
+  // while it runs. At most `maxBatch` writes share a transaction.
+  CacheWriter(sqlite3 *conn, size_t maxBatch = 64);
+
+  // Drains the queue and stops the thread
+  virtual ~CacheWriter();
+
+  // `onCommit` runs on the writer thread once `write` succeeded and its
+  // transaction committed, i.e. once other connections can read the entry.
+  void submit(Write write, Committed onCommit = {});
+
+  // Blocks until every write submitted so far is committed and returns the
+  // errors collected since the last flush.
+  std::optional<std::string> flush();
+
+private:
+  struct Entry {
+    Write write;
+    Committed onCommit;
+  };
+
+  void run();
+
+  sqlite3 *conn;
+  size_t maxBatch;
+
+  std::mutex lock;
+  std::condition_variable pendingCv;
+  std::condition_variable committedCv;
+  std::deque<Entry> pending;
+  size_t nSubmitted = 0;
+  size_t nCommitted = 0;
+  bool closing = false;
+  std::string errors;
+
+  std::thread thread;
+};
+
+} // namespace sats
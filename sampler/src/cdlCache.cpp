@@ -10,8 +10,8 @@
 
 namespace sats::cdl {
 
-std::vector<float> read(const std::string &openPath, const char *crs,
-                        ProjWin projWin, size_t dimX, size_t dimY) {
+bool read(const std::string &openPath, const char *crs, ProjWin projWin,
+          size_t dimX, size_t dimY, float *out) {
 
   // https://gdal.org/en/stable/drivers/raster/vrt.html#processed-dataset-vrt
   // std::string openPath =
@@ -32,7 +32,7 @@ std::vector<float> read(const std::string &openPath, const char *crs,
   double dstGeoTransform[6];
   if (GDALGetGeoTransform(warpedDS, dstGeoTransform) != CE_None) {
     std::cout << "Failed on GeoTransform" << std::endl;
-    return std::vector<float>();
+    return false;
   }
   // std::cout << "warped resolution: " << dstGeoTransform[1] << ", "
   //           << dstGeoTransform[5] << std::endl;
@@ -40,7 +40,7 @@ std::vector<float> read(const std::string &openPath, const char *crs,
   double dstInvGeoTransform[6];
   if (!GDALInvGeoTransform(dstGeoTransform, dstInvGeoTransform)) {
     std::cout << "Failed on inverse GeoTransform" << std::endl;
-    return std::vector<float>();
+    return false;
   }
 
   double x1, y1;
@@ -89,7 +89,7 @@ std::vector<float> read(const std::string &openPath, const char *crs,
     GDALReleaseDataset(warpedDS);
     GDALReleaseDataset(srcDS);
 
-    return std::vector<float>();
+    return false;
   }
 
   if (startX > endX || startY > endY) {
@@ -98,7 +98,7 @@ std::vector<float> read(const std::string &openPath, const char *crs,
     GDALReleaseDataset(warpedDS);
     GDALReleaseDataset(srcDS);
 
-    return std::vector<float>();
+    return false;
   }
 
   size_t readDimX = endX - startX;
@@ -113,26 +113,33 @@ std::vector<float> read(const std::string &openPath, const char *crs,
     GDALReleaseDataset(warpedDS);
     GDALReleaseDataset(srcDS);
 
-    return std::vector<float>();
+    return false;
   }
 
-  // float *mem = (float *)malloc(dimX * dimY * sizeof(float));
-  std::vector<float> mem(dimX * dimY);
-
   CPLErr err = GDALRasterIO(band, GF_Read, startX, startY, readDimX, readDimY,
-                            mem.data(), dimX, dimY, GDT_Float32, 0, 0);
+                            out, dimX, dimY, GDT_Float32, 0, 0);
   if (err) {
     std::cout << "Raster IO failed!" << std::endl;
 
     GDALReleaseDataset(warpedDS);
     GDALReleaseDataset(srcDS);
 
-    return std::vector<float>();
+    return false;
   }
 
   GDALReleaseDataset(warpedDS);
   GDALReleaseDataset(srcDS);
 
+  return true;
+}
+
+std::vector<float> read(const std::string &openPath, const char *crs,
+                        ProjWin projWin, size_t dimX, size_t dimY) {
+  std::vector<float> mem(dimX * dimY);
+  if (!read(openPath, crs, projWin, dimX, dimY, mem.data())) {
+    return std::vector<float>();
+  }
+
   return mem;
 }
 
@@ -15,6 +15,11 @@ struct ProjWin {
   double xmin, xmax, ymin, ymax;
 };
 
+// Reads the CDL under `projWin` (in `crs`), resampled to dimX x dimY, into
+// `out`. False on failure.
+bool read(const std::string &openPath, const char *crs, ProjWin projWin,
+          size_t dimX, size_t dimY, float *out);
+
 std::vector<float> read(const std::string &openPath, const char *crs,
                         ProjWin projWin, size_t dimX, size_t dimY);
 
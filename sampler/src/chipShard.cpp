@@ -0,0 +1,377 @@
+#include "chipShard.h"
+#include "cpu/normalize.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <format>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace sats {
+
+using namespace shard;
+
+static const uint64_t shardMagic = 0x4452485354415353; // "SSATSHRD"
+static const uint64_t shardVersion = 1;
+
+static size_t alignUp(size_t v, size_t alignment) {
+  return (v + alignment - 1) / alignment * alignment;
+}
+
+static size_t chipBytes(size_t nBands, size_t dim, bool ndvi) {
+  size_t pixels = dim * dim;
+  return pixels * (nBands * sizeof(uint16_t) + (ndvi ? sizeof(int16_t) : 0) +
+                   sizeof(uint8_t));
+}
+
+ShardWriter::ShardWriter(std::filesystem::path dir, Shape shape,
+                         size_t chipsPerShard)
+    : dir(std::move(dir)), shape(shape), chipsPerShard(chipsPerShard) {
+  chipStride = alignUp(chipBytes(shape.nBands, shape.dim, shape.ndvi),
+                       shardAlignment);
+  chipBuffer.resize(chipStride);
+}
+
+ShardWriter::~ShardWriter() {
+  if (file) {
+    // never finished, leave no half written shard behind
+    std::fclose(file);
+    std::filesystem::remove(filePath);
+  }
+}
+
+std::pair<std::unique_ptr<ShardWriter>, std::optional<std::string>>
+ShardWriter::create(const std::filesystem::path &dir, Shape shape,
+                    size_t chipsPerShard) {
+  if (!shape.nBands || shape.nBands > maxBands || !shape.dim ||
+      !chipsPerShard) {
+    return std::make_pair(
+        nullptr, std::format("invalid shard shape ({} bands, dim {}, {} chips "
+                             "per shard)",
+                             shape.nBands, shape.dim, chipsPerShard));
+  }
+
+  if (shape.ndvi && shape.nBands <= nirBand) {
+    return std::make_pair(nullptr, "ndvi needs the B4 and B8 bands");
+  }
+
+  std::error_code ec;
+  std::filesystem::create_directories(dir, ec);
+  if (ec) {
+    return std::make_pair(nullptr, std::format("create {}: {}", dir.string(),
+                                               ec.message()));
+  }
+
+  return std::make_pair(std::unique_ptr<ShardWriter>(
+                            new ShardWriter(dir, shape, chipsPerShard)),
+                        std::nullopt);
+}
+
+std::optional<std::string> ShardWriter::openShard() {
+  filePath = dir / std::format("shard-{:05}.sats", nShards);
+
+  file = std::fopen(filePath.c_str(), "wb");
+  if (!file) {
+    return std::format("open {}: {}", filePath.string(), std::strerror(errno));
+  }
+
+  // zeroed header (magic 0 = incomplete) until finishShard
+  std::vector<char> pad(shardAlignment, 0);
+  if (std::fwrite(pad.data(), 1, pad.size(), file) != pad.size()) {
+    return std::format("write {}: {}", filePath.string(), std::strerror(errno));
+  }
+
+  products.clear();
+  productIndex.clear();
+  chips.clear();
+
+  return std::nullopt;
+}
+
+std::optional<std::string> ShardWriter::finishShard() {
+  ShardHeader header = {
+      .magic = shardMagic,
+      .version = shardVersion,
+      .nBands = (uint32_t)shape.nBands,
+      .dim = (uint32_t)shape.dim,
+      .hasNdvi = shape.ndvi,
+      .reserved = 0,
+      .nChips = chips.size(),
+      .chipStride = chipStride,
+      .dataOffset = shardAlignment,
+      .nProducts = products.size(),
+      .productsOffset = shardAlignment + chips.size() * chipStride,
+      .indexOffset = 0,
+  };
+  header.indexOffset =
+      header.productsOffset + products.size() * sizeof(ShardProduct);
+
+  bool ok =
+      std::fwrite(products.data(), sizeof(ShardProduct), products.size(),
+                  file) == products.size() &&
+      std::fwrite(chips.data(), sizeof(ShardChip), chips.size(), file) ==
+          chips.size() &&
+      std::fseek(file, 0, SEEK_SET) == 0 &&
+      std::fwrite(&header, sizeof(header), 1, file) == 1;
+
+  ok = std::fclose(file) == 0 && ok;
+  file = nullptr;
+
+  if (!ok) {
+    return std::format("finish {}: {}", filePath.string(),
+                       std::strerror(errno));
+  }
+
+  nShards++;
+  return std::nullopt;
+}
+
+std::optional<std::string>
+ShardWriter::addChip(const ShardProduct &product, uint32_t x, uint32_t y,
+                     const uint16_t *bands, const uint8_t *labels) {
+  if (product.nBands != shape.nBands) {
+    return std::format("{} has {} bands, shards hold {}", product.name,
+                       product.nBands, shape.nBands);
+  }
+
+  if (!file) {
+    if (auto err = openShard()) {
+      return err;
+    }
+  }
+
+  auto it = productIndex.find(product.name);
+  if (it == productIndex.end()) {
+    it = productIndex.emplace(product.name, products.size()).first;
+    products.push_back(product);
+  }
+
+  const size_t pixels = shape.dim * shape.dim;
+  char *out = chipBuffer.data();
+
+  memcpy(out, bands, shape.nBands * pixels * sizeof(uint16_t));
+  out += shape.nBands * pixels * sizeof(uint16_t);
+
+  if (shape.ndvi) {
+    // (B8 - B4) / (B8 + B4), same as Sampler::readSample before scaling
+    const uint16_t *b4 = bands + redBand * pixels;
+    const uint16_t *b8 = bands + nirBand * pixels;
+    int16_t *ndvi = (int16_t *)out;
+
+    for (size_t i = 0; i < pixels; i++) {
+      float sum = (float)b4[i] + (float)b8[i];
+      ndvi[i] = sum == 0 ? ndviMissing
+                         : (int16_t)std::lround(((float)b8[i] - (float)b4[i]) /
+                                                sum * ndviScale);
+    }
+    out += pixels * sizeof(int16_t);
+  }
+
+  memcpy(out, labels, pixels);
+
+  if (std::fwrite(chipBuffer.data(), 1, chipStride, file) != chipStride) {
+    return std::format("write {}: {}", filePath.string(), std::strerror(errno));
+  }
+
+  chips.push_back({.product = it->second, .x = x, .y = y, .reserved = 0});
+  nWritten++;
+
+  if (chips.size() >= chipsPerShard) {
+    return finishShard();
+  }
+
+  return std::nullopt;
+}
+
+std::optional<std::string> ShardWriter::close() {
+  if (!file) {
+    return std::nullopt;
+  }
+
+  return finishShard();
+}
+
+ShardSampler::ShardSampler(std::vector<Mapping> shards, uint64_t seed)
+    : shards(std::move(shards)), rng(seed) {
+  firstChip.push_back(0);
+  for (const auto &shard : this->shards) {
+    firstChip.push_back(firstChip.back() + shard.header->nChips);
+  }
+
+  nChips = firstChip.back();
+  nBands = this->shards[0].header->nBands;
+  dim = this->shards[0].header->dim;
+}
+
+ShardSampler::~ShardSampler() {
+  for (auto &shard : shards) {
+    munmap(shard.map, shard.mapSize);
+  }
+}
+
+std::pair<std::unique_ptr<ShardSampler>, std::optional<std::string>>
+ShardSampler::open(const std::filesystem::path &dir, uint64_t seed) {
+  std::vector<std::filesystem::path> paths;
+  std::error_code ec;
+  for (const auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+    if (entry.is_regular_file() && entry.path().extension() == ".sats") {
+      paths.push_back(entry.path());
+    }
+  }
+
+  if (ec) {
+    return std::make_pair(nullptr,
+                          std::format("list {}: {}", dir.string(), ec.message()));
+  }
+
+  std::sort(paths.begin(), paths.end());
+
+  std::vector<Mapping> shards;
+  auto fail = [&](std::string err) {
+    for (auto &shard : shards) {
+      munmap(shard.map, shard.mapSize);
+    }
+    return std::make_pair(std::unique_ptr<ShardSampler>(), std::move(err));
+  };
+
+  for (const auto &path : paths) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return fail(std::format("open {}: {}", path.string(),
+                              std::strerror(errno)));
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < shardAlignment) {
+      ::close(fd);
+      return fail(std::format("{} is not a chip shard", path.string()));
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (map == MAP_FAILED) {
+      return fail(std::format("mmap {}: {}", path.string(),
+                              std::strerror(errno)));
+    }
+
+    const ShardHeader *header = (const ShardHeader *)map;
+    size_t expectedSize = header->indexOffset + header->nChips * sizeof(ShardChip);
+    if (header->magic != shardMagic || header->version != shardVersion ||
+        expectedSize != (size_t)st.st_size) {
+      munmap(map, st.st_size);
+      return fail(std::format("{} is incomplete or has an incompatible shard "
+                              "layout",
+                              path.string()));
+    }
+
+    shards.push_back({
+        .path = path,
+        .map = map,
+        .mapSize = (size_t)st.st_size,
+        .header = header,
+        .products =
+            (const ShardProduct *)((char *)map + header->productsOffset),
+        .chips = (const ShardChip *)((char *)map + header->indexOffset),
+    });
+
+    if (header->nBands != shards[0].header->nBands ||
+        header->dim != shards[0].header->dim) {
+      return fail(std::format("{} holds ({}, {}, {}) chips, {} holds ({}, {}, "
+                              "{})",
+                              path.string(), header->nBands, header->dim,
+                              header->dim, shards[0].path.string(),
+                              shards[0].header->nBands, shards[0].header->dim,
+                              shards[0].header->dim));
+    }
+  }
+
+  if (shards.empty()) {
+    return fail(std::format("no chip shards in {}", dir.string()));
+  }
+
+  return std::make_pair(
+      std::unique_ptr<ShardSampler>(new ShardSampler(std::move(shards), seed)),
+      std::nullopt);
+}
+
+void ShardSampler::decodeChip(size_t index, float *bandsOut,
+                              float *labelsOut) const {
+  size_t s = std::upper_bound(firstChip.begin(), firstChip.end(), index) -
+             firstChip.begin() - 1;
+  const Mapping &shard = shards[s];
+  const ShardHeader &header = *shard.header;
+  const ShardChip &chip = shard.chips[index - firstChip[s]];
+  const ShardProduct &product = shard.products[chip.product];
+
+  const size_t pixels = dim * dim;
+  const char *data = (const char *)shard.map + header.dataOffset +
+                     (index - firstChip[s]) * header.chipStride;
+
+  const uint16_t *bands = (const uint16_t *)data;
+  for (size_t b = 0; b < nBands; b++) {
+    cpuproc::normalizeBand(bands + b * pixels, pixels, product.lower[b],
+                           1.0 / (product.upper[b] - product.lower[b]),
+                           bandsOut + b * pixels);
+  }
+  data += nBands * pixels * sizeof(uint16_t);
+
+  float *ndviOut = bandsOut + nBands * pixels;
+  if (header.hasNdvi) {
+    const int16_t *ndvi = (const int16_t *)data;
+    for (size_t i = 0; i < pixels; i++) {
+      ndviOut[i] =
+          ndvi[i] == ndviMissing ? NAN : (float)ndvi[i] * (1.0f / ndviScale);
+    }
+    data += pixels * sizeof(int16_t);
+  } else {
+    cpuproc::ndvi(bands + redBand * pixels, bands + nirBand * pixels, pixels,
+                  ndviOut);
+  }
+
+  const uint8_t *labels = (const uint8_t *)data;
+  for (size_t i = 0; i < pixels; i++) {
+    labelsOut[i] = labels[i];
+  }
+}
+
+std::optional<std::string>
+ShardSampler::readChips(const std::vector<size_t> &indices, float *bandsOut,
+                        float *labelsOut) {
+  for (size_t index : indices) {
+    if (index >= nChips) {
+      return std::format("chip {} out of range ({} chips)", index, nChips);
+    }
+  }
+
+  const size_t pixels = dim * dim;
+
+#pragma omp parallel for
+  for (size_t i = 0; i < indices.size(); i++) {
+    decodeChip(indices[i], bandsOut + i * getNChannels() * pixels,
+               labelsOut + i * pixels);
+  }
+
+  return std::nullopt;
+}
+
+std::optional<std::string> ShardSampler::sampleBatch(size_t n, float *bandsOut,
+                                                     float *labelsOut) {
+  std::vector<size_t> indices(n);
+  {
+    std::lock_guard lock(rngLock);
+    std::uniform_int_distribution<size_t> dist(0, nChips - 1);
+    for (auto &index : indices) {
+      index = dist(rng);
+    }
+  }
+
+  return readChips(indices, bandsOut, labelsOut);
+}
+
+} // namespace sats
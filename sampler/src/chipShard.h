@@ -0,0 +1,190 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace sats {
+
+// Pre-tiled chip shards. Exporting walks each product's sample map on a grid
+// and materializes every valid window once, so later epochs read fixed-size
+// chips out of a memory map instead of decoding windows of the full tiles.
+//
+// File layout (all offsets absolute, little endian):
+//   ShardHeader, padded to shardAlignment
+//   nChips chips, chipStride apart. A chip is
+//     uint16 bands[nBands][dim][dim]
+//     int16  ndvi[dim][dim]        (hasNdvi only, see ndviScale)
+//     uint8  labels[dim][dim]      (CDL class codes)
+//   ShardProduct table (nProducts entries)
+//   ShardChip index (nChips entries)
+//
+// The header is written last, a shard with a zero magic is incomplete.
+namespace shard {
+
+static constexpr size_t maxBands = 16;
+static constexpr size_t shardAlignment = 4096;
+
+// NDVI is stored as round(ndvi * ndviScale); ndviMissing marks 0/0 pixels
+static constexpr float ndviScale = 10000.0f;
+static constexpr int16_t ndviMissing = INT16_MIN;
+
+// B4 and B8 within the stored bands (HIRES is B2, B3, B4, B8)
+static constexpr size_t redBand = 2;
+static constexpr size_t nirBand = 3;
+
+struct ShardHeader {
+  uint64_t magic;
+  uint64_t version;
+
+  uint32_t nBands; // stored bands, not counting ndvi
+  uint32_t dim;
+  uint32_t hasNdvi;
+  uint32_t reserved;
+
+  uint64_t nChips;
+  uint64_t chipStride;
+  uint64_t dataOffset;
+
+  uint64_t nProducts;
+  uint64_t productsOffset;
+  uint64_t indexOffset;
+};
+
+// Per-product metadata shared by that product's chips
+struct ShardProduct {
+  char name[112];
+  uint32_t year, month, day;
+  uint32_t nBands;
+
+  // 1st / 99th percentile normalization, as used by Sampler::readSample
+  float lower[maxBands];
+  float upper[maxBands];
+};
+
+struct ShardChip {
+  uint32_t product; // index into the shard's product table
+  uint32_t x, y;    // window origin in full resolution product pixels
+  uint32_t reserved;
+};
+
+} // namespace shard
+
+// Writes chips into numbered shard files under one directory, starting a new
+// file every `chipsPerShard` chips.
+class ShardWriter {
+public:
+  struct Shape {
+    size_t nBands;
+    size_t dim;
+    bool ndvi;
+  };
+
+  ShardWriter() = delete;
+  ShardWriter(const ShardWriter &) = delete;
+  ShardWriter &operator=(const ShardWriter &) = delete;
+
+  virtual ~ShardWriter();
+
+  static std::pair<std::unique_ptr<ShardWriter>, std::optional<std::string>>
+  create(const std::filesystem::path &dir, Shape shape, size_t chipsPerShard);
+
+  // `bands` is (nBands, dim, dim) raw reflectance, `labels` is (dim, dim)
+  std::optional<std::string> addChip(const shard::ShardProduct &product,
+                                     uint32_t x, uint32_t y,
+                                     const uint16_t *bands,
+                                     const uint8_t *labels);
+
+  // Finishes the open shard. Must be called, shards that were never closed
+  // are rejected by ShardSampler.
+  std::optional<std::string> close();
+
+  size_t chipsWritten() const { return nWritten; }
+  size_t shardsWritten() const { return nShards; }
+
+private:
+  ShardWriter(std::filesystem::path dir, Shape shape, size_t chipsPerShard);
+
+  std::optional<std::string> openShard();
+  std::optional<std::string> finishShard();
+
+  std::filesystem::path dir;
+  Shape shape;
+  size_t chipsPerShard;
+  size_t chipStride;
+
+  std::FILE *file = nullptr;
+  std::filesystem::path filePath;
+  std::vector<shard::ShardProduct> products;
+  std::unordered_map<std::string, uint32_t> productIndex;
+  std::vector<shard::ShardChip> chips;
+  std::vector<char> chipBuffer;
+
+  size_t nWritten = 0;
+  size_t nShards = 0;
+};
+
+// Serves batches out of memory mapped chip shards. Output matches
+// Sampler::fillBatch: (n, nBands + 1, dim, dim) normalized bands with ndvi
+// last, and (n, 1, dim, dim) labels.
+class ShardSampler {
+public:
+  ShardSampler() = delete;
+  ShardSampler(const ShardSampler &) = delete;
+  ShardSampler &operator=(const ShardSampler &) = delete;
+
+  virtual ~ShardSampler();
+
+  // Maps every *.sats file in `dir`. All shards must share one chip shape.
+  static std::pair<std::unique_ptr<ShardSampler>, std::optional<std::string>>
+  open(const std::filesystem::path &dir, uint64_t seed = 0);
+
+  size_t size() const { return nChips; }
+  size_t getSampleDim() const { return dim; }
+  size_t getNChannels() const { return nBands + 1; }
+
+  // Decodes chips `indices` (global, in shard then chip order)
+  std::optional<std::string> readChips(const std::vector<size_t> &indices,
+                                       float *bandsOut, float *labelsOut);
+
+  // Decodes n chips drawn uniformly with replacement
+  std::optional<std::string> sampleBatch(size_t n, float *bandsOut,
+                                         float *labelsOut);
+
+private:
+  struct Mapping {
+    std::filesystem::path path;
+    void *map;
+    size_t mapSize;
+
+    const shard::ShardHeader *header;
+    const shard::ShardProduct *products;
+    const shard::ShardChip *chips;
+  };
+
+  ShardSampler(std::vector<Mapping> shards, uint64_t seed);
+
+  void decodeChip(size_t index, float *bandsOut, float *labelsOut) const;
+
+  std::vector<Mapping> shards;
+  // first global chip index of each shard, plus the total at the end
+  std::vector<size_t> firstChip;
+
+  size_t nChips;
+  size_t nBands;
+  size_t dim;
+
+  std::mutex rngLock;
+  std::mt19937_64 rng;
+};
+
+} // namespace sats
@@ -6,32 +6,40 @@
 
 namespace sats::cpuproc {
 
+// Clears outMask where a mask is outside [boundMin, boundMax]. Compares
+// through a signed char like satsample_mapgen's join (and the CUDA kernels), so
+// values above 127 are always out of range and a precomputed MSK_OK plane
+// matches the map joined here.
 void joinUCharMasks(uint8_t *masks, uint8_t *outMask, size_t bandDimX,
-                    size_t bandDimY, size_t nMasks, unsigned char boundMin = 1,
-                    unsigned char boundMax = 255) {
-  for (int maskIdx = 0; maskIdx < nMasks; maskIdx++) {
-    uint8_t *mask = masks + bandDimX * bandDimY * maskIdx;
-
-    for (int x = 0; x < bandDimX; x++) {
-      for (int y = 0; y < bandDimY; y++) {
-        uint8_t maskVal = mask[y * bandDimX + x];
-        if (maskVal < boundMin || maskVal > boundMax) {
-          outMask[y * bandDimX + x] = 0;
-        }
+                    size_t bandDimY, size_t nMasks, int boundMin = 1,
+                    int boundMax = 255) {
+  const size_t nPixels = bandDimX * bandDimY;
+
+  for (size_t maskIdx = 0; maskIdx < nMasks; maskIdx++) {
+    uint8_t *mask = masks + nPixels * maskIdx;
+
+    for (size_t i = 0; i < nPixels; i++) {
+      int maskVal = (int8_t)mask[i];
+      if (maskVal < boundMin || maskVal > boundMax) {
+        outMask[i] = 0;
       }
     }
   }
 }
 
+// Quality is the window's valid fraction scaled to 0-255, rounded down so a
+// threshold on it never admits a window below the real fraction.
 void mapgen(uint8_t *mask, size_t bandDimX, size_t bandDimY, size_t sampleSize,
-            float minNonzeroPercentage) {
+            float minNonzeroPercentage, uint8_t *quality) {
 
   int *rowSums = (int *)malloc(sizeof(int) * bandDimY * bandDimX);
 
   for (size_t r = 0; r < bandDimY; r++) {
     for (size_t c = 0; c < bandDimX; c++) {
 
-      if (c >= bandDimX - sampleSize) {
+      // windows must fit entirely, c + sampleSize <= bandDimX (as in the
+      // CUDA kernels)
+      if (c + sampleSize > bandDimX) {
         rowSums[r * bandDimX + c] = 0;
         continue;
       }
@@ -59,8 +67,11 @@ void mapgen(uint8_t *mask, size_t bandDimX, size_t bandDimY, size_t sampleSize,
     int prevTotal = 0;
     for (size_t r = 0; r < bandDimY; r++) {
 
-      if (r >= bandDimY - sampleSize || c >= bandDimX - sampleSize) {
+      if (r + sampleSize > bandDimY || c + sampleSize > bandDimX) {
         mask[r * bandDimX + c] = 0;
+        if (quality) {
+          quality[r * bandDimX + c] = 0;
+        }
         // rowSums[r * bandDimX + c] = 0;
         continue;
       }
@@ -81,6 +92,10 @@ void mapgen(uint8_t *mask, size_t bandDimX, size_t bandDimY, size_t sampleSize,
 
       mask[r * bandDimX + c] =
           (((float)total / sampleSize / sampleSize) > minNonzeroPercentage);
+      if (quality) {
+        quality[r * bandDimX + c] =
+            (uint8_t)((size_t)total * 255 / (sampleSize * sampleSize));
+      }
       nOK += mask[r * bandDimX + c];
     }
 
@@ -94,7 +109,7 @@ void generateSampleMap(unsigned char *detfooMasks, size_t nDetfooMasks,
                        unsigned char *snwMask, unsigned char maxSnwPercentage,
                        unsigned char *sclMask, unsigned char *outMask,
                        size_t bandDimX, size_t bandDimY, size_t sampleSize,
-                       float minNonzeroPercentage) {
+                       float minNonzeroPercentage, unsigned char *outQuality) {
 
   std::memset(outMask, 1, bandDimX * bandDimY * sizeof(uint8_t));
 
@@ -103,7 +118,8 @@ void generateSampleMap(unsigned char *detfooMasks, size_t nDetfooMasks,
   joinUCharMasks(snwMask, outMask, bandDimX, bandDimY, 1, 0, maxSnwPercentage);
   joinUCharMasks(sclMask, outMask, bandDimX, bandDimY, 1, 4, 6);
 
-  mapgen(outMask, bandDimX, bandDimY, sampleSize, minNonzeroPercentage);
+  mapgen(outMask, bandDimX, bandDimY, sampleSize, minNonzeroPercentage,
+         outQuality);
 }
 
 } // namespace sats::cpuproc
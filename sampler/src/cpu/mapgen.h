@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 
 namespace sats::cpuproc {
 
@@ -9,5 +10,12 @@ void generateSampleMap(unsigned char *detfooMasks, size_t nDetfooMasks,
                        unsigned char *snwMask, unsigned char maxSnwPercentage,
                        unsigned char *sclMask, unsigned char *outMask,
                        size_t bandDimX, size_t bandDimY, size_t sampleSize,
-                       float minNonzeroPercentage);
+                       float minNonzeroPercentage,
+                       unsigned char *outQuality = nullptr);
+
+// Turns an already joined 0/1 mask into the sample map in place, i.e. the
+// second half of generateSampleMap. Used for maps precomputed by
+// satsample_mapgen.
+void mapgen(uint8_t *mask, size_t bandDimX, size_t bandDimY, size_t sampleSize,
+            float minNonzeroPercentage, uint8_t *quality = nullptr);
 }
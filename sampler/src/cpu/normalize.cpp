@@ -0,0 +1,109 @@
+#include "normalize.h"
+
+#include <algorithm>
+#include <bit>
+#include <type_traits>
+
+namespace sats::cpuproc {
+
+Half toHalf(float v) {
+  uint32_t x = std::bit_cast<uint32_t>(v);
+  uint32_t sign = (x >> 16) & 0x8000;
+  x &= 0x7fffffff;
+
+  uint32_t h;
+  if (x >= 0x47800000) {
+    // too large for half (or inf / NaN)
+    h = x > 0x7f800000 ? 0x7e00 : 0x7c00;
+  } else if (x < 0x38800000) {
+    // half subnormal, let the float adder do the rounding
+    float f = std::bit_cast<float>(x) + 0.5f;
+    h = std::bit_cast<uint32_t>(f) - 0x3f000000;
+  } else {
+    uint32_t mantOdd = (x >> 13) & 1;
+    x += 0xc8000fff + mantOdd; // rebias exponent, round
+    h = x >> 13;
+  }
+
+  return Half{(uint16_t)(sign | h)};
+}
+
+BFloat16 toBFloat16(float v) {
+  uint32_t x = std::bit_cast<uint32_t>(v);
+  if ((x & 0x7fffffff) > 0x7f800000) {
+    return BFloat16{(uint16_t)((x >> 16) | 0x40)}; // keep NaN quiet
+  }
+
+  x += 0x7fff + ((x >> 16) & 1);
+  return BFloat16{(uint16_t)(x >> 16)};
+}
+
+template <typename T> static inline T convert(float v) {
+  if constexpr (std::is_same_v<T, Half>) {
+    return toHalf(v);
+  } else if constexpr (std::is_same_v<T, BFloat16>) {
+    return toBFloat16(v);
+  } else {
+    return v;
+  }
+}
+
+template <typename T>
+void normalizeBand(const uint16_t *in, size_t n, float lower, float scale,
+                   T *out) {
+#pragma omp simd
+  for (size_t i = 0; i < n; i++) {
+    out[i] = convert<T>(((float)in[i] - lower) * scale);
+  }
+}
+
+template <typename T>
+void ndvi(const uint16_t *red, const uint16_t *nir, size_t n, T *out) {
+#pragma omp simd
+  for (size_t i = 0; i < n; i++) {
+    float r = red[i];
+    float ni = nir[i];
+    out[i] = convert<T>((ni - r) / (ni + r));
+  }
+}
+
+template void normalizeBand<float>(const uint16_t *, size_t, float, float,
+                                   float *);
+template void normalizeBand<Half>(const uint16_t *, size_t, float, float,
+                                  Half *);
+template void normalizeBand<BFloat16>(const uint16_t *, size_t, float, float,
+                                      BFloat16 *);
+template void ndvi<float>(const uint16_t *, const uint16_t *, size_t, float *);
+template void ndvi<Half>(const uint16_t *, const uint16_t *, size_t, Half *);
+template void ndvi<BFloat16>(const uint16_t *, const uint16_t *, size_t,
+                             BFloat16 *);
+
+std::vector<float> percentilesU16(const uint16_t *data, size_t len,
+                                  const std::vector<size_t> &percentiles) {
+  std::vector<size_t> histogram(UINT16_MAX + 1, 0);
+  for (size_t i = 0; i < len; i++) {
+    histogram[data[i]]++;
+  }
+
+  std::vector<float> out;
+  out.reserve(percentiles.size());
+
+  for (const auto &percentile : percentiles) {
+    size_t index = ((float)percentile / 100.0) * len;
+
+    size_t seen = 0;
+    size_t value = 0;
+    for (; value < histogram.size(); value++) {
+      seen += histogram[value];
+      if (seen > index) {
+        break;
+      }
+    }
+
+    out.push_back(std::min(value, (size_t)UINT16_MAX));
+  }
+
+  return out;
+}
+
+} // namespace sats::cpuproc
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace sats::cpuproc {
+
+// Reduced precision output element types, stored as their raw bit patterns
+struct Half {
+  uint16_t bits;
+};
+struct BFloat16 {
+  uint16_t bits;
+};
+
+// Round to nearest even, NaN and infinity preserved
+Half toHalf(float v);
+BFloat16 toBFloat16(float v);
+
+// Fused convert + normalize of one raw band: out[i] = (in[i] - lower) * scale.
+// T is float, Half or BFloat16.
+template <typename T>
+void normalizeBand(const uint16_t *in, size_t n, float lower, float scale,
+                   T *out);
+
+// (nir - red) / (nir + red) straight from raw reflectance, 0/0 gives NaN
+template <typename T>
+void ndvi(const uint16_t *red, const uint16_t *nir, size_t n, T *out);
+
+// Histogram percentiles of raw reflectance, identical to sorting the data
+// and taking sorted[percentile / 100 * len] like percentiles() does.
+std::vector<float> percentilesU16(const uint16_t *data, size_t len,
+                                  const std::vector<size_t> &percentiles);
+
+} // namespace sats::cpuproc
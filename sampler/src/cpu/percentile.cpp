@@ -5,7 +5,7 @@ std::vector<float>
 sats::cpuproc::percentiles(const float *data, size_t len,
                            const std::vector<size_t> percentiles) {
   std::vector<float> sorted(len);
-  memcpy(&sorted[0], data, len);
+  memcpy(&sorted[0], data, sizeof(float) * len);
 
   std::sort(sorted.begin(), sorted.end());
 
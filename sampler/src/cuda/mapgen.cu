@@ -157,7 +157,8 @@ __global__ void BuildSampleMap_RowSums(const cudaPitchedPtr in,
 }
 
 __global__ void BuildSampleMap_ColSums(const cudaPitchedPtr in,
-                                       cudaPitchedPtr out, int bandDimX,
+                                       cudaPitchedPtr out,
+                                       cudaPitchedPtr quality, int bandDimX,
                                        int bandDimY, int sampleSize,
                                        float minNonzeroPercentage) {
   size_t c = blockDim.x * blockIdx.x + threadIdx.x;
@@ -175,6 +176,10 @@ __global__ void BuildSampleMap_ColSums(const cudaPitchedPtr in,
 
   writeRow[c] =
       (((float)total / sampleSize / sampleSize) > minNonzeroPercentage);
+  if (quality.ptr) {
+    ((unsigned char *)quality.ptr)[c] =
+        (unsigned char)(total * 255 / (sampleSize * sampleSize));
+  }
 
   for (int i = 1; i < bandDimY - sampleSize; i++) {
     const uint32_t *prevReadRow =
@@ -189,6 +194,10 @@ __global__ void BuildSampleMap_ColSums(const cudaPitchedPtr in,
 
     writeRow[c] =
         (((float)total / sampleSize / sampleSize) > minNonzeroPercentage);
+    if (quality.ptr) {
+      ((unsigned char *)quality.ptr + quality.pitch * i)[c] =
+          (unsigned char)(total * 255 / (sampleSize * sampleSize));
+    }
   }
 
   // for (int i = bandDimY - sampleSize; i < bandDimY; i++) {
@@ -265,7 +274,7 @@ void generateSampleMap(unsigned char *detfooMasks, size_t nDetfooMasks,
                        unsigned char *snwMask, unsigned char maxSnwPercentage,
                        unsigned char *sclMask, unsigned char *outMask,
                        size_t bandDimX, size_t bandDimY, size_t sampleSize,
-                       float minNonzeroPercentage) {
+                       float minNonzeroPercentage, unsigned char *outQuality) {
 
   // join detfoo masks
   cudaPitchedPtr d_detfooMasksPtr;
@@ -398,12 +407,29 @@ void generateSampleMap(unsigned char *detfooMasks, size_t nDetfooMasks,
   linearNBlocks = (size_t)ceil((float)bandDimX / linearThreadsPerBlock);
   gpuErrchk(cudaMemset2D(d_outPtr.ptr, d_outPtr.pitch, 0,
                          bandDimX * sizeof(unsigned char), bandDimY));
+
+  cudaPitchedPtr d_qualityPtr = {};
+  if (outQuality) {
+    gpuErrchk(cudaMallocPitch(&d_qualityPtr.ptr, &d_qualityPtr.pitch,
+                              bandDimX * sizeof(unsigned char), bandDimY));
+    gpuErrchk(cudaMemset2D(d_qualityPtr.ptr, d_qualityPtr.pitch, 0,
+                           bandDimX * sizeof(unsigned char), bandDimY));
+  }
+
   BuildSampleMap_ColSums<<<linearNBlocks, linearThreadsPerBlock>>>(
-      d_intermediatePtr, d_outPtr, bandDimX, bandDimY, sampleSize,
-      minNonzeroPercentage);
+      d_intermediatePtr, d_outPtr, d_qualityPtr, bandDimX, bandDimY,
+      sampleSize, minNonzeroPercentage);
   cudaStreamSynchronize(0);
   gpuErrchk(cudaPeekAtLastError());
 
+  if (outQuality) {
+    gpuErrchk(cudaMemcpy2D((void *)outQuality,
+                           sizeof(unsigned char) * bandDimX, d_qualityPtr.ptr,
+                           d_qualityPtr.pitch, bandDimX * sizeof(unsigned char),
+                           bandDimY, cudaMemcpyKind::cudaMemcpyDeviceToHost));
+    gpuErrchkPassthrough(cudaFree(d_qualityPtr.ptr));
+  }
+
   // copy result to host
   gpuErrchk(cudaMemcpy2D((void *)outMask, sizeof(unsigned char) * bandDimX,
                          d_outPtr.ptr, d_outPtr.pitch,
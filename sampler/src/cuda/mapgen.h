@@ -11,5 +11,6 @@ void generateSampleMap(unsigned char *detfooMasks, size_t nDetfooMasks,
                        unsigned char *snwMask, unsigned char maxSnwPercentage,
                        unsigned char *sclMask, unsigned char *outMask,
                        size_t bandDimX, size_t bandDimY, size_t sampleSize,
-                       float minNonzeroPercentage);
+                       float minNonzeroPercentage,
+                       unsigned char *outQuality = nullptr);
 }
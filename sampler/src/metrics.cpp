@@ -0,0 +1,268 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace sats::metrics {
+
+// HDR style log-linear buckets: values below 2^subBits get a bucket each,
+// above that every power of two is split into 2^subBits buckets, so a
+// bucket is never wider than 1/16 of its values. 2^maxExponent ns is ~39h.
+static constexpr size_t subBits = 4;
+static constexpr size_t subBuckets = 1 << subBits;
+static constexpr size_t maxExponent = 47;
+static constexpr size_t nBuckets =
+    subBuckets + (maxExponent - subBits + 1) * subBuckets;
+
+static size_t bucketOf(uint64_t ns) {
+  if (ns < subBuckets) {
+    return ns;
+  }
+
+  size_t exponent = 63 - __builtin_clzll(ns);
+  if (exponent > maxExponent) {
+    return nBuckets - 1;
+  }
+
+  size_t sub = (ns >> (exponent - subBits)) - subBuckets;
+  return subBuckets + (exponent - subBits) * subBuckets + sub;
+}
+
+// midpoint of the values falling into `bucket`
+static uint64_t bucketValue(size_t bucket) {
+  if (bucket < subBuckets) {
+    return bucket;
+  }
+
+  size_t exponent = (bucket - subBuckets) / subBuckets + subBits;
+  size_t sub = (bucket - subBuckets) % subBuckets;
+  uint64_t width = (uint64_t)1 << (exponent - subBits);
+
+  return (subBuckets + sub) * width + width / 2;
+}
+
+// One per thread, only written by its owner. Atomics so snapshot and reset
+// can read and clear them from other threads.
+struct ThreadMetrics {
+  struct StageMetrics {
+    std::atomic<uint64_t> buckets[nBuckets];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> totalNs;
+    std::atomic<uint64_t> maxNs;
+  };
+
+  StageMetrics stages[nStages];
+  std::atomic<uint64_t> counters[nCounters];
+
+  ThreadMetrics() { clear(); }
+
+  void clear() {
+    for (auto &stage : stages) {
+      for (auto &bucket : stage.buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+      }
+      stage.count.store(0, std::memory_order_relaxed);
+      stage.totalNs.store(0, std::memory_order_relaxed);
+      stage.maxNs.store(0, std::memory_order_relaxed);
+    }
+
+    for (auto &counter : counters) {
+      counter.store(0, std::memory_order_relaxed);
+    }
+  }
+};
+
+// Every slot ever handed out. Slots of exited threads keep their counts and
+// are handed to the next new thread, so short lived pools (ensureCache,
+// TaskPool) don't grow the registry.
+static std::mutex registryLock;
+static std::vector<std::unique_ptr<ThreadMetrics>> slots;
+static std::vector<ThreadMetrics *> freeSlots;
+
+static std::atomic<bool> collecting = true;
+
+static ThreadMetrics *acquireSlot() {
+  std::lock_guard<std::mutex> guard(registryLock);
+
+  if (!freeSlots.empty()) {
+    ThreadMetrics *slot = freeSlots.back();
+    freeSlots.pop_back();
+    return slot;
+  }
+
+  return slots.emplace_back(std::make_unique<ThreadMetrics>()).get();
+}
+
+static void releaseSlot(ThreadMetrics *slot) {
+  std::lock_guard<std::mutex> guard(registryLock);
+  freeSlots.push_back(slot);
+}
+
+static ThreadMetrics &local() {
+  struct Handle {
+    ThreadMetrics *slot = acquireSlot();
+    ~Handle() { releaseSlot(slot); }
+  };
+
+  thread_local Handle handle;
+  return *handle.slot;
+}
+
+const char *name(Stage stage) {
+  switch (stage) {
+  case Stage::INDEX_DRAW:
+    return "index_draw";
+  case Stage::CACHE_LOAD:
+    return "cache_load";
+  case Stage::DATASET_OPEN:
+    return "dataset_open";
+  case Stage::RASTERIO_HIRES:
+    return "rasterio_hires";
+  case Stage::RASTERIO_LOWRES:
+    return "rasterio_lowres";
+  case Stage::GEOREF:
+    return "georef";
+  case Stage::NORMALIZE:
+    return "normalize";
+  case Stage::CDL_READ:
+    return "cdl_read";
+  case Stage::TENSOR_COPY:
+    return "tensor_copy";
+  case Stage::COUNT:
+    break;
+  }
+
+  return "unknown";
+}
+
+const char *name(Counter counter) {
+  switch (counter) {
+  case Counter::SAMPLES_READ:
+    return "samples_read";
+  case Counter::BYTES_READ:
+    return "bytes_read";
+  case Counter::READ_FAILURES:
+    return "read_failures";
+  case Counter::CACHE_LOADS:
+    return "cache_loads";
+  case Counter::CACHE_REUSES:
+    return "cache_reuses";
+  case Counter::QUALITY_MAP_HITS:
+    return "quality_map_hits";
+  case Counter::QUALITY_MAP_MISSES:
+    return "quality_map_misses";
+  case Counter::CDL_READS:
+    return "cdl_reads";
+  case Counter::CDL_EMPTY:
+    return "cdl_empty";
+  case Counter::COUNT:
+    break;
+  }
+
+  return "unknown";
+}
+
+void record(Stage stage, uint64_t ns) {
+  if (!enabled()) {
+    return;
+  }
+
+  auto &metrics = local().stages[(size_t)stage];
+  metrics.buckets[bucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+  metrics.count.fetch_add(1, std::memory_order_relaxed);
+  metrics.totalNs.fetch_add(ns, std::memory_order_relaxed);
+
+  // only the owner raises it, a plain compare is enough
+  if (ns > metrics.maxNs.load(std::memory_order_relaxed)) {
+    metrics.maxNs.store(ns, std::memory_order_relaxed);
+  }
+}
+
+void add(Counter counter, uint64_t n) {
+  if (!enabled()) {
+    return;
+  }
+
+  local().counters[(size_t)counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+void setEnabled(bool enabled) {
+  collecting.store(enabled, std::memory_order_relaxed);
+}
+
+bool enabled() { return collecting.load(std::memory_order_relaxed); }
+
+static uint64_t percentile(const std::vector<uint64_t> &buckets,
+                           uint64_t count, double p) {
+  if (count == 0) {
+    return 0;
+  }
+
+  // rank of the p-th percentile sample, 1-based
+  uint64_t target = std::max((uint64_t)(p / 100.0 * count + 0.5), (uint64_t)1);
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < buckets.size(); i++) {
+    seen += buckets[i];
+    if (seen >= target) {
+      return bucketValue(i);
+    }
+  }
+
+  return bucketValue(buckets.size() - 1);
+}
+
+Snapshot snapshot() {
+  std::vector<std::vector<uint64_t>> buckets(nStages,
+                                             std::vector<uint64_t>(nBuckets));
+  Snapshot out = {};
+
+  {
+    std::lock_guard<std::mutex> guard(registryLock);
+    for (const auto &slot : slots) {
+      for (size_t s = 0; s < nStages; s++) {
+        const auto &stage = slot->stages[s];
+        for (size_t b = 0; b < nBuckets; b++) {
+          buckets[s][b] += stage.buckets[b].load(std::memory_order_relaxed);
+        }
+
+        out.stages[s].count += stage.count.load(std::memory_order_relaxed);
+        out.stages[s].totalNs += stage.totalNs.load(std::memory_order_relaxed);
+        out.stages[s].maxNs = std::max(
+            out.stages[s].maxNs, stage.maxNs.load(std::memory_order_relaxed));
+      }
+
+      for (size_t c = 0; c < nCounters; c++) {
+        out.counters[c] += slot->counters[c].load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  for (size_t s = 0; s < nStages; s++) {
+    // the bucket sum, not count, in case a record landed in between
+    uint64_t count = 0;
+    for (uint64_t n : buckets[s]) {
+      count += n;
+    }
+
+    // bucket midpoints can overshoot the largest sample
+    uint64_t maxNs = out.stages[s].maxNs;
+    out.stages[s].p50Ns = std::min(percentile(buckets[s], count, 50), maxNs);
+    out.stages[s].p90Ns = std::min(percentile(buckets[s], count, 90), maxNs);
+    out.stages[s].p99Ns = std::min(percentile(buckets[s], count, 99), maxNs);
+  }
+
+  return out;
+}
+
+void reset() {
+  std::lock_guard<std::mutex> guard(registryLock);
+  for (const auto &slot : slots) {
+    slot->clear();
+  }
+}
+
+} // namespace sats::metrics
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace sats::metrics {
+
+// Sampling pipeline stages with a latency histogram each. Stages nest:
+// INDEX_DRAW includes CACHE_LOAD, TENSOR_COPY includes NORMALIZE and
+// CDL_READ.
+enum class Stage : size_t {
+  INDEX_DRAW,      // randomSampleV2 window selection
+  CACHE_LOAD,      // cache entry read + quality threshold, per product
+  DATASET_OPEN,    // GDALOpenShared of one flavor
+  RASTERIO_HIRES,  // window read of every HIRES band
+  RASTERIO_LOWRES, // window read of every LOWRES band
+  GEOREF,          // CRS and corner coordinates of a window
+  NORMALIZE,       // decode of one sample
+  CDL_READ,        // warped CDL label read of one sample
+  TENSOR_COPY,     // fillBatch into the caller's band and label buffers
+  COUNT,
+};
+
+enum class Counter : size_t {
+  SAMPLES_READ,
+  BYTES_READ, // raw reflectance bytes
+  READ_FAILURES,
+  CACHE_LOADS,  // cache entries fetched from the store
+  CACHE_REUSES, // draws served by an entry already loaded for the batch
+  QUALITY_MAP_HITS,
+  QUALITY_MAP_MISSES,
+  CDL_READS,
+  CDL_EMPTY,
+  COUNT,
+};
+
+static constexpr size_t nStages = (size_t)Stage::COUNT;
+static constexpr size_t nCounters = (size_t)Counter::COUNT;
+
+// snake_case names, as reported to Python
+const char *name(Stage stage);
+const char *name(Counter counter);
+
+// Both only touch the calling thread's slot (relaxed atomics, no locks)
+void record(Stage stage, uint64_t ns);
+void add(Counter counter, uint64_t n = 1);
+
+// Collection is on by default, disabled calls return right away
+void setEnabled(bool enabled);
+bool enabled();
+
+struct StageSummary {
+  uint64_t count;
+  uint64_t totalNs;
+  uint64_t maxNs;
+
+  // from the histogram, within 1/16 of the true value
+  uint64_t p50Ns, p90Ns, p99Ns;
+};
+
+struct Snapshot {
+  std::array<StageSummary, nStages> stages;
+  std::array<uint64_t, nCounters> counters;
+};
+
+// Sums every thread's slot. Threads keep recording while this runs, so the
+// result may include part of a concurrent update.
+Snapshot snapshot();
+
+// Zeroes every thread's slot, e.g. at the start of an epoch
+void reset();
+
+// Records the lifetime of the scope as one `stage` sample
+class ScopedTimer {
+public:
+  explicit ScopedTimer(Stage stage) : stage(stage), active(enabled()) {
+    if (active) {
+      start = std::chrono::steady_clock::now();
+    }
+  }
+
+  ScopedTimer(const ScopedTimer &) = delete;
+  ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+  ~ScopedTimer() {
+    if (active) {
+      record(stage, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start)
+                        .count());
+    }
+  }
+
+private:
+  Stage stage;
+  bool active;
+  std::chrono::steady_clock::time_point start;
+};
+
+} // namespace sats::metrics
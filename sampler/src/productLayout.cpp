@@ -0,0 +1,196 @@
+#include "productLayout.h"
+
+#include <algorithm>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <vector>
+
+#include <sys/stat.h>
+
+namespace sats {
+
+static const uint32_t zipEndOfCentralDirSig = 0x06054b50;
+static const uint32_t zipCentralDirSig = 0x02014b50;
+static const uint32_t zipLocalHeaderSig = 0x04034b50;
+static const uint32_t zip64Marker = 0xffffffff;
+
+static uint16_t le16(const char *p) {
+  return (uint8_t)p[0] | (uint16_t)(uint8_t)p[1] << 8;
+}
+
+static uint32_t le32(const char *p) {
+  return le16(p) | (uint32_t)le16(p + 2) << 16;
+}
+
+static uint64_t mtimeOf(const std::filesystem::path &path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    return 0;
+  }
+  return st.st_mtim.tv_sec;
+}
+
+// "<productName>-HIRES.tif" -> "HIRES"
+static std::optional<std::string> bundleName(const std::string &fname,
+                                             const std::string &productName) {
+  std::string prefix = productName + "-";
+  std::string suffix = ".tif";
+
+  if (fname.size() <= prefix.size() + suffix.size() ||
+      !fname.starts_with(prefix) || !fname.ends_with(suffix)) {
+    return std::nullopt;
+  }
+
+  return fname.substr(prefix.size(),
+                      fname.size() - prefix.size() - suffix.size());
+}
+
+static std::pair<std::optional<ProductFiles>, std::string>
+resolveDirectory(const std::filesystem::path &path,
+                 const std::string &productName) {
+  ProductFiles files = {.layout = ProductLayout::DIRECTORY,
+                        .size = 0,
+                        .modTime = mtimeOf(path)};
+
+  std::error_code ec;
+  for (const auto &entry : std::filesystem::directory_iterator(path, ec)) {
+    auto bundle = bundleName(entry.path().filename().string(), productName);
+    if (!bundle || !entry.is_regular_file()) {
+      continue;
+    }
+
+    files.bundles[*bundle] = entry.path().string();
+    files.size += entry.file_size();
+    files.modTime = std::max(files.modTime, mtimeOf(entry.path()));
+  }
+
+  if (ec) {
+    return std::make_pair(std::nullopt,
+                          std::format("failed to list {}: {}", path.string(),
+                                      ec.message()));
+  }
+
+  return std::make_pair(files, "");
+}
+
+// Walks the central directory of a (non zip64) zip. Members that are stored
+// uncompressed become /vsisubfile/ ranges of the zip itself; anything else is
+// left to /vsizip/.
+static std::pair<std::optional<ProductFiles>, std::string>
+resolveZip(const std::filesystem::path &path, const std::string &productName) {
+  std::ifstream zip(path, std::ios::binary);
+  if (!zip) {
+    return std::make_pair(std::nullopt,
+                          std::format("failed to open {}", path.string()));
+  }
+
+  ProductFiles files = {.layout = ProductLayout::STORED_ZIP,
+                        .size = std::filesystem::file_size(path),
+                        .modTime = mtimeOf(path)};
+
+  // the end of central directory record is 22 bytes plus a comment of up to
+  // 64k at the very end of the file
+  if (files.size < 22) {
+    return std::make_pair(std::nullopt,
+                          std::format("{} is not a zip file", path.string()));
+  }
+
+  size_t tailSize = std::min<uintmax_t>(files.size, 22 + 0xffff);
+  std::vector<char> tail(tailSize);
+  zip.seekg(files.size - tailSize);
+  zip.read(tail.data(), tailSize);
+
+  std::optional<size_t> eocd;
+  for (size_t i = tailSize - 22 + 1; i-- > 0;) {
+    // the record's comment has to run exactly to the end of the file, which
+    // skips signature bytes that happen to appear inside the comment
+    if (le32(&tail[i]) == zipEndOfCentralDirSig &&
+        i + 22 + le16(&tail[i + 20]) == tailSize) {
+      eocd = i;
+      break;
+    }
+  }
+
+  if (!zip || !eocd) {
+    return std::make_pair(std::nullopt,
+                          std::format("{} is not a zip file", path.string()));
+  }
+
+  uint32_t cdSize = le32(&tail[*eocd + 12]);
+  uint32_t cdOffset = le32(&tail[*eocd + 16]);
+  if (cdOffset == zip64Marker || (uintmax_t)cdOffset + cdSize > files.size) {
+    return std::make_pair(
+        std::nullopt,
+        std::format("{} has an unsupported central directory", path.string()));
+  }
+
+  std::vector<char> cd(cdSize);
+  zip.seekg(cdOffset);
+  zip.read(cd.data(), cdSize);
+
+  std::string zipPath = std::filesystem::canonical(path).string();
+
+  for (size_t pos = 0; zip && pos + 46 <= cd.size();) {
+    const char *entry = &cd[pos];
+    if (le32(entry) != zipCentralDirSig) {
+      break;
+    }
+
+    uint16_t method = le16(entry + 10);
+    uint32_t compressedSize = le32(entry + 20);
+    uint32_t size = le32(entry + 24);
+    uint16_t nameLen = le16(entry + 28);
+    uint16_t extraLen = le16(entry + 30);
+    uint16_t commentLen = le16(entry + 32);
+    uint32_t localHeaderOffset = le32(entry + 42);
+    std::string name(entry + 46, std::min<size_t>(nameLen, cd.size() - pos - 46));
+
+    pos += 46 + nameLen + extraLen + commentLen;
+
+    auto bundle =
+        bundleName(std::filesystem::path(name).filename().string(), productName);
+    if (!bundle) {
+      continue;
+    }
+
+    bool stored = method == 0 && compressedSize == size &&
+                  size != zip64Marker && localHeaderOffset != zip64Marker;
+
+    if (stored) {
+      // the local header repeats the name and may carry a different extra
+      // field, so the data offset has to come from it
+      char local[30];
+      zip.seekg(localHeaderOffset);
+      zip.read(local, sizeof(local));
+      stored = zip && le32(local) == zipLocalHeaderSig;
+
+      if (stored) {
+        uint64_t dataOffset = (uint64_t)localHeaderOffset + 30 +
+                              le16(local + 26) + le16(local + 28);
+        files.bundles[*bundle] =
+            std::format("/vsisubfile/{}_{},{}", dataOffset, size, zipPath);
+        continue;
+      }
+
+      zip.clear();
+    }
+
+    files.layout = ProductLayout::ZIP;
+    files.bundles[*bundle] = "/vsizip/" + zipPath + "/" + name;
+  }
+
+  return std::make_pair(files, "");
+}
+
+std::pair<std::optional<ProductFiles>, std::string>
+resolveProductFiles(const std::filesystem::path &path,
+                    const std::string &productName) {
+  if (std::filesystem::is_directory(path)) {
+    return resolveDirectory(path, productName);
+  }
+
+  return resolveZip(path, productName);
+}
+
+} // namespace sats
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace sats {
+
+enum class ProductLayout {
+  ZIP,        // deflated members, read through /vsizip/
+  STORED_ZIP, // zip -0, members read in place through /vsisubfile/
+  DIRECTORY,  // plain directory of GeoTIFFs
+};
+
+// Where the GeoTIFFs of one repacked product live, resolved once at
+// discovery so opening a bundle never has to go through the zip reader again.
+struct ProductFiles {
+  ProductLayout layout;
+
+  // GDAL open path per bundle ("HIRES", "LOWRES", "MSK", "MSK_OK", ...)
+  std::unordered_map<std::string, std::string> bundles;
+
+  uintmax_t size;   // bytes on disk
+  uint64_t modTime; // newest mtime, seconds
+
+  std::optional<std::string> bundle(const std::string &name) const {
+    auto it = bundles.find(name);
+    if (it == bundles.end()) {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+};
+
+// Resolves the <productName>-<bundle>.tif members of `path`, which is either
+// a zip or a directory.
+std::pair<std::optional<ProductFiles>, std::string>
+resolveProductFiles(const std::filesystem::path &path,
+                    const std::string &productName);
+
+} // namespace sats
@@ -0,0 +1,149 @@
+#include "sampleMap.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace sats {
+
+void SampleMap::append(size_t start, size_t length) {
+  runs.push_back(Run{
+      .start = (uint32_t)start,
+      .length = (uint32_t)length,
+      .before = (uint32_t)count(),
+  });
+}
+
+SampleMap SampleMap::fromBytes(const uint8_t *stage, size_t nPixels) {
+  SampleMap map;
+
+  size_t i = 0;
+  while (i < nPixels) {
+    if (!stage[i]) {
+      i++;
+      continue;
+    }
+
+    size_t start = i;
+    while (i < nPixels && stage[i]) {
+      i++;
+    }
+    map.append(start, i - start);
+  }
+
+  return map;
+}
+
+static void putVarint(std::vector<uint8_t> &out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back((uint8_t)(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back((uint8_t)v);
+}
+
+static bool getVarint(const uint8_t *&data, const uint8_t *end,
+                      uint64_t *v) {
+  *v = 0;
+  for (int shift = 0; data < end && shift < 64; shift += 7) {
+    uint8_t byte = *data++;
+    *v |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Layout: nRuns, then per run (gap since the previous run's end, length)
+std::vector<uint8_t> SampleMap::serialize() const {
+  std::vector<uint8_t> out;
+  out.reserve(runs.size() * 4 + 8);
+
+  putVarint(out, runs.size());
+
+  size_t prevEnd = 0;
+  for (const auto &run : runs) {
+    putVarint(out, run.start - prevEnd);
+    putVarint(out, run.length);
+    prevEnd = (size_t)run.start + run.length;
+  }
+
+  return out;
+}
+
+std::optional<SampleMap> SampleMap::deserialize(const uint8_t *data,
+                                                size_t size) {
+  const uint8_t *end = data + size;
+
+  uint64_t nRuns;
+  if (!getVarint(data, end, &nRuns)) {
+    return std::nullopt;
+  }
+
+  // every run takes at least two bytes, so a corrupt count can't make the
+  // reserve below blow up
+  if (nRuns > (uint64_t)(end - data) / 2) {
+    return std::nullopt;
+  }
+
+  SampleMap map;
+  map.runs.reserve(nRuns);
+
+  uint64_t prevEnd = 0;
+  for (uint64_t i = 0; i < nRuns; i++) {
+    uint64_t gap, length;
+    if (!getVarint(data, end, &gap) || !getVarint(data, end, &length) ||
+        !length || prevEnd + gap + length > UINT32_MAX ||
+        map.count() + length > UINT32_MAX) {
+      return std::nullopt;
+    }
+
+    map.append(prevEnd + gap, length);
+    prevEnd += gap + length;
+  }
+
+  if (data != end) {
+    return std::nullopt;
+  }
+
+  return map;
+}
+
+bool SampleMap::test(size_t index) const {
+  // last run starting at or before index
+  auto it = std::upper_bound(
+      runs.begin(), runs.end(), index,
+      [](size_t index, const Run &run) { return index < run.start; });
+  if (it == runs.begin()) {
+    return false;
+  }
+
+  --it;
+  return index < (size_t)it->start + it->length;
+}
+
+size_t SampleMap::rank(size_t index) const {
+  auto it = std::upper_bound(
+      runs.begin(), runs.end(), index,
+      [](size_t index, const Run &run) { return index < run.start; });
+  if (it == runs.begin()) {
+    return 0;
+  }
+
+  --it;
+  return it->before + std::min(index - it->start, (size_t)it->length);
+}
+
+size_t SampleMap::select(size_t k) const {
+  assert(k < count());
+
+  // first run whose set bits extend past k
+  auto it = std::upper_bound(
+      runs.begin(), runs.end(), k,
+      [](size_t k, const Run &run) { return k < run.end(); });
+
+  return it->start + (k - it->before);
+}
+
+} // namespace sats
@@ -1,11 +1,20 @@
 #include "sampler.h"
+#include "cacheWriter.h"
+#include "cdlCache.h"
+#include "chipShard.h"
 #include "cpu/mapgen.h"
+#include "cpu/normalize.h"
 #include "cpu/percentile.h"
 #include "cuda/mapgen.h"
 #include "cuda/percentile.h"
+#include "metrics.h"
+#include "taskPool.h"
+#include "trace.h"
 #include <algorithm>
-#include <bit>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
@@ -15,14 +24,22 @@
 #include <format>
 #include <optional>
 #include <regex>
+#include <semaphore>
 #include <sqlite3.h>
+#include <stdexcept>
+#include <thread>
 #include <unistd.h>
 
 #include <gdal.h>
 #include <gdal_priv.h>
 
+#include <cpl_conv.h>
+#include <cpl_error.h>
 #include <iostream>
+#include <mutex>
+#include <numeric>
 #include <omp.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <unordered_map>
 #include <unordered_set>
@@ -45,38 +62,50 @@ getProductName(const std::filesystem::path &path) {
   return subMatch.str();
 }
 
-static std::optional<std::string>
-getSubProduct(const std::filesystem::path &path, const std::string &flavor) {
-  const auto &productName = getProductName(path);
+// Reads the joined mask satsample_mapgen stores in the product as
+// <product>-MSK_OK.tif, resampled onto the xSize x ySize MSK grid. Returns
+// false when the product has none, or when it was joined with other cloud /
+// snow thresholds than cldMax / snwMax (SATS_CLD_MAX / SATS_SNW_MAX band
+// metadata, planes without them are from before it was recorded).
+static bool readPrecomputedMask(const ProductFiles &files, uint8_t cldMax,
+                                uint8_t snwMax, uint8_t *out, size_t xSize,
+                                size_t ySize) {
+  const auto mapPath = files.bundle("MSK_OK");
+  if (!mapPath) {
+    return false;
+  }
 
-  if (!productName) {
-    return std::nullopt;
+  auto ds = GDALDatasetUniquePtr(
+      GDALDataset::Open(mapPath.value().c_str(), GA_ReadOnly));
+
+  if (!ds) {
+    return false;
   }
 
-  std::string dsPath =
-      "/vsizip/" + (std::filesystem::canonical(path) /
-                    (productName.value() + "-" + flavor + ".tif"))
-                       .string();
+  GDALRasterBand *band = ds->GetRasterBand(1);
+  const char *storedCldMax = band->GetMetadataItem("SATS_CLD_MAX");
+  const char *storedSnwMax = band->GetMetadataItem("SATS_SNW_MAX");
+  if (!storedCldMax || !storedSnwMax || atoi(storedCldMax) != cldMax ||
+      atoi(storedSnwMax) != snwMax) {
+    return false;
+  }
 
-  return dsPath;
+  CPLErr err = band->RasterIO(
+      GDALRWFlag::GF_Read, 0, 0, ds->GetRasterXSize(), ds->GetRasterYSize(),
+      out, xSize, ySize, GDT_Byte, 0, 0);
+
+  return err == CE_None;
 }
 
-static bool getProductDims(const std::filesystem::path &path,
+static bool getProductDims(const ProductFiles &files,
                            const std::string &flavor, size_t *xDim,
                            size_t *yDim) {
-  const auto &productName = getProductName(path);
-
-  if (!productName) {
-    std::cout << "could not get product dims: could not get product name"
-              << std::endl;
-    return false;
-  }
-
-  const auto productPath = getSubProduct(path, flavor);
+  const auto productPath = files.bundle(flavor);
 
   if (!productPath) {
-    std::cout << "failed to get product dims: could not determine product path"
-              << std::endl;
+    std::cout << "failed to get product dims: product has no " << flavor
+              << " bundle" << std::endl;
+    return false;
   }
 
   GDALDataset *ds = GDALDataset::FromHandle(
@@ -97,12 +126,12 @@ static bool getProductDims(const std::filesystem::path &path,
 }
 
 static std::optional<std::pair<size_t, size_t>>
-getMaxResolution(const std::filesystem::path &path) {
+getMaxResolution(const ProductFiles &files) {
   size_t maxDimX = 0, maxDimY = 0;
   bool cont = false;
   for (const auto &flavor : flavors) {
     size_t dimX, dimY;
-    if (!getProductDims(path, flavor, &dimX, &dimY)) {
+    if (!getProductDims(files, flavor, &dimX, &dimY)) {
       // std::cout << "failed to get product dimensions for " << path
       //           << " flavor: " << flavor << std::endl;
       return std::nullopt;
@@ -130,23 +159,41 @@ getMaxResolution(const std::filesystem::path &path) {
   return std::make_pair(maxDimX, maxDimY);
 }
 
-std::optional<std::string>
-Sampler::writeCacheEntry(sqlite3 *conn, const ComputationCache &cache) {
-  const char *updateQuery =
-      "INSERT OR REPLACE INTO COMPUTATIONS(PRODUCT, SAMPLEMAP, SAMPLEDIMX, "
-      "SAMPLEDIMY, NOK, MAXDIMX, MAXDIMY, LASTMOD, BANDPERCENTILES)"
-      "  VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?);";
-
+static const char *getEntryQuery =
+    "SELECT SAMPLEMAP, SAMPLEDIMX, "
+    "SAMPLEDIMY, NOK, MAXDIMX, MAXDIMY, LASTMOD, BANDPERCENTILES "
+    "FROM COMPUTATIONS WHERE PRODUCT = ?;";
+static const char *getQualityMapQuery =
+    "SELECT QUALITYMAP FROM COMPUTATIONS WHERE PRODUCT = ?;";
+static const char *writeEntryQuery =
+    "INSERT OR REPLACE INTO COMPUTATIONS(PRODUCT, SAMPLEMAP, SAMPLEDIMX, "
+    "SAMPLEDIMY, NOK, MAXDIMX, MAXDIMY, LASTMOD, BANDPERCENTILES, "
+    "QUALITYMAP)"
+    "  VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?, ?);";
+
+// Hands a cached statement back in a reusable state on every return path
+struct StatementReset {
   sqlite3_stmt *stmt;
-  if (sqlite3_prepare_v2(conn, updateQuery, -1, &stmt, NULL) != SQLITE_OK) {
-    return "failed to prepare statment: " + std::string(sqlite3_errmsg(conn));
+
+  explicit StatementReset(sqlite3_stmt *stmt) : stmt(stmt) {}
+  ~StatementReset() {
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
   }
+};
+
+std::optional<std::string>
+Sampler::writeCacheEntry(sqlite3 *conn, const ComputationCache &cache) {
+  sqlite3_stmt *stmt = statementCache.at(conn).writeEntry;
+  StatementReset reset(stmt);
 
   // std::cout << "lastmod: " << cache.unixModTime << std::endl;
 
+  std::vector<uint8_t> sampleMap = cache.sampleCache.map.serialize();
+
   sqlite3_bind_text(stmt, 1, cache.productName.c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_blob(stmt, 2, cache.sampleCache.bitrange,
-                    (int)cache.sampleCache.size, SQLITE_STATIC);
+  sqlite3_bind_blob(stmt, 2, sampleMap.data(), (int)sampleMap.size(),
+                    SQLITE_STATIC);
   sqlite3_bind_int64(stmt, 3, *((int64_t *)&cache.sampleCache.nCols));
   sqlite3_bind_int64(stmt, 4, *((int64_t *)&cache.sampleCache.nRows));
   sqlite3_bind_int64(stmt, 5, *((int64_t *)&cache.sampleCache.nOK));
@@ -157,36 +204,38 @@ Sampler::writeCacheEntry(sqlite3 *conn, const ComputationCache &cache) {
                     cache.bandPercentiles.size() *
                         sizeof(NormalizationPercentile),
                     SQLITE_STATIC);
+  sqlite3_bind_blob(stmt, 10, cache.sampleCache.qualityMap.data(),
+                    (int)cache.sampleCache.qualityMap.size(), SQLITE_STATIC);
 
   int ret;
   while (ret = sqlite3_step(stmt), ret == SQLITE_ROW || ret == SQLITE_OK) {
   }
 
   if (ret != SQLITE_DONE) {
-    auto errmsg = "sqlite step error: " + std::string(sqlite3_errmsg(conn));
-    sqlite3_finalize(stmt);
-    return errmsg;
+    return "sqlite step error: " + std::string(sqlite3_errmsg(conn));
   }
 
-  sqlite3_finalize(stmt);
-
   return std::nullopt;
 }
 
 std::optional<std::string> Sampler::setupSQLCache() {
 
-  size_t nConns = std::max(sampleOptions.nCacheGenThreads,
-                           sampleOptions.nCacheQueryThreads);
+  size_t nConns = std::max({sampleOptions.nCacheGenThreads,
+                            sampleOptions.nCacheQueryThreads, (size_t)1});
   connectionPool.resize(nConns);
-  for (size_t i = 0; i < nConns; i++) {
+  for (size_t i = 0; i <= nConns; i++) {
+    sqlite3 **conn = i < nConns ? &connectionPool[i] : &writerConnection;
     int ret = sqlite3_open_v2(
-        sampleOptions.dbPath.c_str(), &connectionPool[i],
+        sampleOptions.dbPath.c_str(), conn,
         SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL);
 
     if (ret != SQLITE_OK) {
-      return std::format("sqlite_open_v2: {}",
-                         sqlite3_errmsg(connectionPool[i]));
+      return std::format("sqlite_open_v2: {}", sqlite3_errmsg(*conn));
     }
+
+    // the writer's checkpoints can briefly lock readers out, wait instead
+    // of failing
+    sqlite3_busy_timeout(*conn, 30000);
   }
 
   const char *tableSetup =
@@ -201,10 +250,52 @@ std::optional<std::string> Sampler::setupSQLCache() {
       "MAXDIMY         UNSIGNED BIG INT                    NOT NULL,"
       ""
       "BANDPERCENTILES BLOB                              NOT NULL,"
+      "QUALITYMAP      BLOB                                NOT NULL,"
       ""
       "LASTMOD         UNSIGNED BIG INT                    NOT NULL"
       ");";
 
+  // Cache entries are derived data: on a layout change drop them and let
+  // ensureCache regenerate.
+  sqlite3_stmt *versionStmt;
+  if (sqlite3_prepare_v2(connectionPool[0], "PRAGMA user_version;", -1,
+                         &versionStmt, NULL) != SQLITE_OK) {
+    return std::format("sqlite3_prepare_v2: {}",
+                       sqlite3_errmsg(connectionPool[0]));
+  }
+
+  int schemaVersion = 0;
+  if (sqlite3_step(versionStmt) == SQLITE_ROW) {
+    schemaVersion = sqlite3_column_int(versionStmt, 0);
+  }
+  sqlite3_finalize(versionStmt);
+
+  if (schemaVersion != cacheSchemaVersion) {
+    std::string migrate =
+        std::format("DROP TABLE IF EXISTS COMPUTATIONS; PRAGMA user_version "
+                    "= {};",
+                    cacheSchemaVersion);
+    char *errmsg = nullptr;
+    if (sqlite3_exec(connectionPool[0], migrate.c_str(), NULL, NULL,
+                     &errmsg) != SQLITE_OK) {
+      std::string err = std::format("cache schema migration: {}", errmsg);
+      sqlite3_free(errmsg);
+      return err;
+    }
+  }
+
+  // WAL keeps readers and the single writer from blocking each other. The
+  // cache is derived data, so NORMAL sync (no fsync per commit) is enough.
+  char *walErr = nullptr;
+  if (sqlite3_exec(connectionPool[0], "PRAGMA journal_mode = WAL;", NULL, NULL,
+                   &walErr) != SQLITE_OK ||
+      sqlite3_exec(writerConnection, "PRAGMA synchronous = NORMAL;", NULL,
+                   NULL, &walErr) != SQLITE_OK) {
+    std::string err = std::format("enabling WAL: {}", walErr ? walErr : "?");
+    sqlite3_free(walErr);
+    return err;
+  }
+
   // assert(sampleOptions.nThreads > 0);
 
   sqlite3_stmt *stmt;
@@ -228,6 +319,22 @@ std::optional<std::string> Sampler::setupSQLCache() {
 
   sqlite3_finalize(stmt);
 
+  std::vector<sqlite3 *> conns = connectionPool;
+  conns.push_back(writerConnection);
+  for (sqlite3 *conn : conns) {
+    CachedStatements &statements = statementCache[conn];
+    if (sqlite3_prepare_v3(conn, getEntryQuery, -1, SQLITE_PREPARE_PERSISTENT,
+                           &statements.getEntry, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v3(conn, getQualityMapQuery, -1,
+                           SQLITE_PREPARE_PERSISTENT, &statements.getQualityMap,
+                           NULL) != SQLITE_OK ||
+        sqlite3_prepare_v3(conn, writeEntryQuery, -1,
+                           SQLITE_PREPARE_PERSISTENT, &statements.writeEntry,
+                           NULL) != SQLITE_OK) {
+      return std::format("sqlite3_prepare_v3: {}", sqlite3_errmsg(conn));
+    }
+  }
+
   return std::nullopt;
 }
 
@@ -235,38 +342,28 @@ std::optional<std::string> Sampler::getCacheEntry(sqlite3 *conn,
                                                   const SampleInfo &info,
                                                   ComputationCache *cache,
                                                   bool *oCachePresent) {
-  const char *query =
-      "SELECT SAMPLEMAP, SAMPLEDIMX, "
-      "SAMPLEDIMY, NOK, MAXDIMX, MAXDIMY, LASTMOD, BANDPERCENTILES "
-      "FROM COMPUTATIONS WHERE PRODUCT = ?;";
-
-  sqlite3_stmt *stmt;
-  int ret = sqlite3_prepare_v2(conn, query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK) {
-    return std::format("sqlite3_prepare_v2: {}", sqlite3_errmsg(conn));
-  }
+  sqlite3_stmt *stmt = statementCache.at(conn).getEntry;
+  StatementReset reset(stmt);
 
   sqlite3_bind_text(stmt, 1, info.productName.c_str(), -1, SQLITE_STATIC);
 
-  ret = sqlite3_step(stmt);
+  int ret = sqlite3_step(stmt);
 
   if (ret != SQLITE_ROW) {
     *oCachePresent = false;
     if (ret == SQLITE_DONE) {
-      sqlite3_finalize(stmt);
       return std::nullopt;
     }
 
-    auto errmsg = sqlite3_errmsg(conn);
-    sqlite3_finalize(stmt);
-    return std::string(errmsg);
+    return std::string(sqlite3_errmsg(conn));
   }
 
-  size_t samplemapSize = sqlite3_column_bytes(stmt, 0);
-  const void *sqliteSampleMap = sqlite3_column_blob(stmt, 0);
-
-  uint8_t *sampleMap = (uint8_t *)malloc(samplemapSize);
-  memcpy(sampleMap, sqliteSampleMap, samplemapSize);
+  std::optional<SampleMap> sampleMap = SampleMap::deserialize(
+      (const uint8_t *)sqlite3_column_blob(stmt, 0),
+      sqlite3_column_bytes(stmt, 0));
+  if (!sampleMap) {
+    return std::format("corrupt sample map for {}", info.productName);
+  }
 
   uint64_t sampleDimX;
   int64_t sqliteSampleDimX = sqlite3_column_int64(stmt, 1);
@@ -299,8 +396,6 @@ std::optional<std::string> Sampler::getCacheEntry(sqlite3 *conn,
   memcpy(cache->bandPercentiles.data(), sqlite3_column_blob(stmt, 7),
          nPercentileElements * sizeof(NormalizationPercentile));
 
-  sqlite3_finalize(stmt);
-
   // std::cout << "maxDimY from read: " << maxDimY << std::endl;
   // std::cout << "lastmod from read: " << lastMod << std::endl;
 
@@ -309,8 +404,7 @@ std::optional<std::string> Sampler::getCacheEntry(sqlite3 *conn,
   cache->unixModTime = lastMod;
 
   cache->sampleCache.nOK = nOK;
-  cache->sampleCache.bitrange = sampleMap;
-  cache->sampleCache.size = samplemapSize;
+  cache->sampleCache.map = std::move(sampleMap.value());
   cache->sampleCache.nCols = sampleDimX;
   cache->sampleCache.nRows = sampleDimY;
 
@@ -321,6 +415,26 @@ std::optional<std::string> Sampler::getCacheEntry(sqlite3 *conn,
   return std::nullopt;
 }
 
+std::optional<std::string>
+Sampler::getQualityMap(sqlite3 *conn, const SampleInfo &info,
+                       std::vector<uint8_t> *qualityMap) {
+  sqlite3_stmt *stmt = statementCache.at(conn).getQualityMap;
+  StatementReset reset(stmt);
+
+  sqlite3_bind_text(stmt, 1, info.productName.c_str(), -1, SQLITE_STATIC);
+
+  int ret = sqlite3_step(stmt);
+  if (ret != SQLITE_ROW) {
+    return ret == SQLITE_DONE ? "no quality map for " + info.productName
+                              : std::string(sqlite3_errmsg(conn));
+  }
+
+  const uint8_t *blob = (const uint8_t *)sqlite3_column_blob(stmt, 0);
+  qualityMap->assign(blob, blob + sqlite3_column_bytes(stmt, 0));
+
+  return std::nullopt;
+}
+
 bool Sampler::cacheValid(const SampleInfo &info,
                          const ComputationCache &cache) {
   assert(std::filesystem::exists(info.path));
@@ -333,10 +447,7 @@ bool Sampler::cacheValid(const SampleInfo &info,
     return false;
   }
 
-  struct stat s;
-  stat(info.path.c_str(), &s);
-
-  if ((uint64_t)s.st_mtim.tv_sec != cache.unixModTime) {
+  if (info.files.modTime != cache.unixModTime) {
     // std::cout << std::format("cache differs in time {}, {}",
     //                          (uint64_t)s.st_mtim.tv_sec, cache.unixModTime)
     //           << std::endl;
@@ -346,11 +457,38 @@ bool Sampler::cacheValid(const SampleInfo &info,
   return true;
 }
 
+// Samplers alive in this process, for the fork handlers
+static std::mutex liveSamplersLock;
+static std::unordered_set<Sampler *> liveSamplers;
+
+// Bytes on disk of a product zip, or of the files in a product directory
+static uintmax_t productBytes(const std::filesystem::directory_entry &entry) {
+  std::error_code ec;
+  if (!entry.is_directory(ec)) {
+    uintmax_t size = entry.file_size(ec);
+    return ec ? 0 : size;
+  }
+
+  uintmax_t size = 0;
+  for (const auto &file : std::filesystem::directory_iterator(entry, ec)) {
+    uintmax_t fileSize = file.is_regular_file(ec) ? file.file_size(ec) : 0;
+    size += ec ? 0 : fileSize;
+  }
+  return size;
+}
+
 Sampler::Sampler(const std::filesystem::path &dataDir,
                  SampleOptions sampleOptions,
                  SampleCacheGenOptions cacheGenOptions,
                  std::optional<DateRange> dateRange, bool preproc)
     : cacheGenOptions(cacheGenOptions), sampleOptions(sampleOptions) {
+  if (sampleOptions.worldSize == 0 ||
+      sampleOptions.rank >= sampleOptions.worldSize) {
+    throw std::invalid_argument(
+        std::format("rank {} is outside a world of size {}",
+                    sampleOptions.rank, sampleOptions.worldSize));
+  }
+
   GDALAllRegister();
   this->dataPath = dataDir;
   this->cacheGenOptions = cacheGenOptions;
@@ -358,13 +496,19 @@ Sampler::Sampler(const std::filesystem::path &dataDir,
   this->dateRange = dateRange;
   this->preproc = preproc;
 
+  slabs = std::make_shared<SlabPool>(SlabPool::Options{
+      .hugePages = sampleOptions.hugePages,
+      .numaLocal = sampleOptions.numaLocal,
+  });
+
+  // products are zips (deflated or stored) or plain directories of the
+  // repacked GeoTIFFs
   std::regex re("^REPACK_S2[A-Z]_[A-Z0-9]+_(\\d{4})(\\d{2})(\\d{2})T[1-9]+_[A-"
-                "Z0-9]+_[A-Z0-9]+_([A-Z0-9]+)_[A-Z0-9]+\\.SAFE\\.zip$");
+                "Z0-9]+_[A-Z0-9]+_([A-Z0-9]+)_[A-Z0-9]+\\.SAFE(\\.zip)?$");
 
-  for (const auto &path :
-       std::filesystem::recursive_directory_iterator(dataDir)) {
-    if (path.is_directory())
-      continue;
+  for (auto it = std::filesystem::recursive_directory_iterator(dataDir);
+       it != std::filesystem::recursive_directory_iterator(); it++) {
+    const auto &path = *it;
 
     std::smatch match;
 
@@ -372,6 +516,15 @@ Sampler::Sampler(const std::filesystem::path &dataDir,
     if (!std::regex_match(fname, match, re))
       continue;
 
+    bool isZip = match[5].matched;
+    if (path.is_directory()) {
+      it.disable_recursion_pending();
+      if (isZip)
+        continue;
+    } else if (!isZip) {
+      continue;
+    }
+
     size_t year = std::stoi(match[1]);
     size_t month = std::stoi(match[2]);
     size_t day = std::stoi(match[3]);
@@ -397,16 +550,8 @@ Sampler::Sampler(const std::filesystem::path &dataDir,
       continue;
     }
 
-    // Get highest resolution dataset and make sure resolutions are whole number
-    // multiple of eachother
-    const auto maxRes = getMaxResolution(path);
-    if (!maxRes) {
-      std::cout
-          << "resolutions in dataset are malformed or are of incorrect scale"
-          << std::endl;
-      continue;
-    }
-
+    // only what sharding needs, the layout and resolutions are read below
+    // for this rank's products alone
     infos.push_back({
         .path = std::filesystem::canonical(path.path()),
         .year = year,
@@ -414,15 +559,47 @@ Sampler::Sampler(const std::filesystem::path &dataDir,
         .day = day,
         .productName = productName.value(),
         .tileName = tileName,
-        .maxDimX = maxRes->first,
-        .maxDimY = maxRes->second,
+        .maxDimX = 0,
+        .maxDimY = 0,
+        .files = {.size = productBytes(path)},
         // .cache = std::nullopt,
     });
+  }
 
-    std::cout << year << " " << month << " " << day << " " << tileName << ": "
-              << path << std::endl;
+  if (sampleOptions.worldSize > 1) {
+    shardProducts(sampleOptions.rank, sampleOptions.worldSize);
   }
 
+  std::vector<SampleInfo> resolved;
+  for (auto &info : infos) {
+    auto [files, filesErr] = resolveProductFiles(info.path, info.productName);
+    if (!files) {
+      std::cout << "could not resolve product layout of " << info.path << ": "
+                << filesErr << std::endl;
+      continue;
+    }
+
+    // Get highest resolution dataset and make sure resolutions are whole number
+    // multiple of eachother
+    const auto maxRes = getMaxResolution(*files);
+    if (!maxRes) {
+      std::cout
+          << "resolutions in dataset are malformed or are of incorrect scale"
+          << std::endl;
+      continue;
+    }
+
+    info.maxDimX = maxRes->first;
+    info.maxDimY = maxRes->second;
+    info.files = std::move(*files);
+
+    std::cout << info.year << " " << info.month << " " << info.day << " "
+              << info.tileName << ": " << info.path << std::endl;
+
+    resolved.push_back(std::move(info));
+  }
+  infos = std::move(resolved);
+
   std::regex cdlRe("^([0-9]{4})_30m_cdls.tif$");
 
   for (const auto &path :
@@ -451,258 +628,369 @@ Sampler::Sampler(const std::filesystem::path &dataDir,
     std::cout << "no sql init errors?" << std::endl;
   }
 
-  auto cacheError = ensureCache();
+  cacheError = ensureCache();
 
   if (cacheError) {
     std::cout << "cache error: " << cacheError.value() << std::endl;
   } else {
     std::cout << "no cache errors?" << std::endl;
   }
+
+  static std::once_flag forkHandlers;
+  std::call_once(forkHandlers, [] {
+    pthread_atfork(&Sampler::prepareFork, &Sampler::parentAfterFork,
+                   &Sampler::childAfterFork);
+  });
+  {
+    std::lock_guard<std::mutex> guard(liveSamplersLock);
+    liveSamplers.insert(this);
+  }
+
+  startBackgroundCache();
 }
 
-size_t Sampler::computeSampleIndex(size_t sampleOKIndex,
-                                   const SampleCache &cache) {
-  size_t sampleIndex = 0;
-  size_t currentCount = 0;
-
-  for (size_t i = 0; i < cache.size / 8; i++) {
-    size_t cnt = std::popcount(((uint64_t *)cache.bitrange)[i]);
-
-    if (currentCount + cnt > (sampleOKIndex + 1)) {
-      cnt = 0;
-      size_t j = 0;
-      for (; j < 64 && cnt < ((sampleOKIndex + 1) - currentCount); j++) {
-        cnt += (size_t)((bool)((1ul << (/* 63 -  */ j)) &
-                               ((((uint64_t *)cache.bitrange)[i]))));
-      }
+std::optional<std::string>
+Sampler::buildCache(const std::filesystem::path &path,
+                    SampleOptions sampleOptions, SampleCacheGenOptions options,
+                    std::optional<DateRange> dateRange) {
+  sampleOptions.rank = 0;
+  sampleOptions.worldSize = 1;
+  sampleOptions.generateMissingCache = true;
+
+  Sampler sampler(path, sampleOptions, options, dateRange, false);
+  return sampler.getCacheError();
+}
 
-      assert(cnt == (sampleOKIndex + 1 - currentCount));
+void Sampler::shardProducts(size_t rank, size_t worldSize) {
+  // Zero and cloud-masked areas compress to almost nothing, so the repacked
+  // size tracks the number of valid windows (nOK) without needing a cache
+  // entry. Every rank sees the same files and therefore computes the same
+  // assignment, no matter how far its own cache is built.
+  std::vector<std::pair<uintmax_t, size_t>> bySize(infos.size());
+  for (size_t i = 0; i < infos.size(); i++) {
+    bySize[i] = std::make_pair(infos[i].files.size, i);
+  }
 
-      sampleIndex += j;
-      currentCount += cnt;
-      // break;
-    } else if (currentCount + cnt == (sampleOKIndex + 1)) {
-      currentCount += cnt;
-      assert(((uint64_t *)cache.bitrange)[i] != 0);
-      sampleIndex += 64 - __builtin_clzl(((uint64_t *)cache.bitrange)[i]);
-    } else {
-      currentCount += cnt;
-      sampleIndex += 64;
+  std::sort(bySize.begin(), bySize.end(), [&](const auto &a, const auto &b) {
+    if (a.first != b.first) {
+      return a.first > b.first;
     }
-
-    if (currentCount == (sampleOKIndex + 1)) {
-      break;
+    return infos[a.second].productName < infos[b.second].productName;
+  });
+
+  // longest processing time first: largest product goes to the lightest rank
+  std::vector<uintmax_t> load(worldSize, 0);
+  std::vector<SampleInfo> shard;
+  for (const auto &[size, index] : bySize) {
+    size_t target = std::min_element(load.begin(), load.end()) - load.begin();
+    load[target] += std::max(size, (uintmax_t)1);
+
+    if (target == rank) {
+      shard.push_back(std::move(infos[index]));
     }
   }
 
-  return sampleIndex - 1;
+  std::cout << std::format("rank {}/{}: {} of {} products, {} bytes", rank,
+                           worldSize, shard.size(), infos.size(), load[rank])
+            << std::endl;
+
+  infos = std::move(shard);
 }
 
-std::pair<std::optional<Sampler::SampleCache>, std::string>
-Sampler::genSampleCache(const SampleInfo &info,
-                        Sampler::SampleCacheGenOptions genOptions) {
-  const std::filesystem::path &path = info.path;
+size_t Sampler::computeSampleIndex(size_t sampleOKIndex,
+                                   const SampleCache &cache) {
+  return cache.map.select(sampleOKIndex);
+}
 
-  const auto productName = getProductName(path);
-  if (!productName) {
-    return std::make_pair(std::nullopt, "Could not get product name from path");
+std::optional<std::string> Sampler::readCacheInputs(const SampleInfo &info,
+                                                    CacheInputs *inputs) {
+  const auto mskProductPath = info.files.bundle("MSK");
+  if (!mskProductPath) {
+    return "product has no MSK bundle";
   }
 
-  std::filesystem::path mskProductPath =
-      path / std::filesystem::path(productName.value() + "-MSK.tif");
+  auto maxDims = getMaxResolution(info.files);
+  if (!maxDims.has_value()) {
+    return "failed to retreive maximum dimensions---either this is a "
+           "filesystem issue or the dimension scaling is invalid in this "
+           "product";
+  }
+  inputs->maxDimX = maxDims->first;
+  inputs->maxDimY = maxDims->second;
 
-  GDALDataset *ds = GDALDataset::Open(
-      ("vrt:///vsizip/" + mskProductPath.string() +
-       // std::format("?outsize={},{}", info.maxDimX, info.maxDimY))
-       "")
-          .c_str());
+  // 1. masks
+  GDALDatasetUniquePtr ds =
+      GDALDatasetUniquePtr(GDALDataset::Open(mskProductPath->c_str()));
 
   if (!ds) {
-    return std::make_pair(std::nullopt, "failed to open file " +
-                                            std::string("/vsizip/") +
-                                            mskProductPath.string());
+    return "failed to open file " + mskProductPath.value();
   }
 
   size_t nBands = ds->GetBands().size();
-  // std::cout << "nBands: " << nBands << std::endl;
   if (nBands < 2) {
-    return std::make_pair(std::nullopt,
-                          "mask dataset doesn't have enough bands!");
+    return "mask dataset doesn't have enough bands!";
   }
 
   for (size_t bandNum = 0; bandNum < nBands; bandNum++) {
     if (ds->GetRasterBand(bandNum + 1)->GetRasterDataType() != GDT_Byte) {
-      return std::make_pair(std::nullopt, "Band " + std::to_string(bandNum) +
-                                              " datatype is not GDT_Byte");
+      return "Band " + std::to_string(bandNum) + " datatype is not GDT_Byte";
     }
   }
 
-  size_t cldIdx = nBands - 3;
-  size_t snwIdx = nBands - 2;
-  size_t sclIdx = nBands - 1;
+  inputs->nCols = ds->GetRasterXSize();
+  inputs->nRows = ds->GetRasterYSize();
+  inputs->nMaskBands = nBands;
 
-  uint8_t ***bands = (uint8_t ***)malloc(
-      sizeof(uint8_t) * ds->GetRasterXSize() * ds->GetRasterYSize() * nBands);
-  for (size_t bandNum = 0; bandNum < nBands; bandNum++) {
-    CPLErr err = ds->GetRasterBand(bandNum + 1)
-                     ->RasterIO(GDALRWFlag::GF_Read, 0, 0, ds->GetRasterXSize(),
-                                ds->GetRasterYSize(),
-                                (char *)bands + bandNum * ds->GetRasterXSize() *
-                                                    ds->GetRasterYSize(),
-                                ds->GetRasterXSize(), ds->GetRasterYSize(),
-                                GDT_Byte, 0, 0);
+  size_t nPixels = inputs->nCols * inputs->nRows;
 
-    if (err) {
-      free(bands);
-      return std::make_pair(std::nullopt,
-                            "Band " + std::to_string(bandNum) +
-                                "read failed: " + std::to_string(err));
+  // a joined mask from satsample_mapgen only needs the window pass
+  inputs->mask.resize(nPixels);
+  inputs->precomputed = readPrecomputedMask(
+      info.files, cacheGenOptions.cldMax, cacheGenOptions.snwMax,
+      inputs->mask.data(), inputs->nCols, inputs->nRows);
+
+  if (!inputs->precomputed) {
+    inputs->mask.resize(nPixels * nBands);
+
+    for (size_t bandNum = 0; bandNum < nBands; bandNum++) {
+      CPLErr err = ds->GetRasterBand(bandNum + 1)->RasterIO(
+          GDALRWFlag::GF_Read, 0, 0, inputs->nCols, inputs->nRows,
+          inputs->mask.data() + bandNum * nPixels, inputs->nCols,
+          inputs->nRows, GDT_Byte, 0, 0);
+
+      if (err) {
+        return "Band " + std::to_string(bandNum) +
+               "read failed: " + std::to_string(err);
+      }
     }
   }
 
-  uint8_t *stage = (uint8_t *)malloc(sizeof(uint8_t) * ds->GetRasterXSize() *
-                                     ds->GetRasterYSize());
+  // 2. bands for the normalization percentiles
+  for (const auto &flavor : flavors) {
+    std::string dsPath = info.files.bundle(flavor).value_or("");
+
+    GDALDatasetUniquePtr bandDS =
+        GDALDatasetUniquePtr(GDALDataset::Open(dsPath.c_str(), GF_Read));
+
+    if (!bandDS) {
+      return std::format("failed to open product: {}", dsPath);
+    }
+
+    for (const auto &band : bandDS->GetBands()) {
+      CacheInputs::PercentileInput &input = inputs->bands.emplace_back();
+
+      // satsample_repack stores them while it has the pixels in memory
+      const char *storedLower = band->GetMetadataItem("SATS_PERCENTILE_1");
+      const char *storedUpper = band->GetMetadataItem("SATS_PERCENTILE_99");
+      if (storedLower && storedUpper) {
+        input.stored = NormalizationPercentile{
+            .lower = (float)CPLAtof(storedLower),
+            .upper = (float)CPLAtof(storedUpper),
+        };
+        continue;
+      }
+
+      // reflectance is stored as UInt16, read it as such and take the
+      // percentiles from a histogram instead of sorting a float copy
+      input.raw.resize((size_t)band->GetXSize() * band->GetYSize());
+
+      CPLErr e = band->RasterIO(GF_Read, 0, 0, bandDS->GetRasterXSize(),
+                                bandDS->GetRasterYSize(),
+                                (void *)input.raw.data(),
+                                bandDS->GetRasterXSize(),
+                                bandDS->GetRasterYSize(), GDT_UInt16, 0, 0);
+
+      if (e) {
+        return std::format("failed to read band {} of {}, error {}",
+                           band->GetBand(), dsPath, (int)e);
+      }
+    }
+  }
+
+  return std::nullopt;
+}
+
+std::pair<std::optional<Sampler::ComputationCache>, std::string>
+Sampler::computeCacheEntry(const SampleInfo &info, CacheInputs &&inputs) {
+  const std::vector<size_t> percentiles = {1, 99};
+
+  // 1. sample map
+  const size_t nPixels = inputs.nCols * inputs.nRows;
+  const size_t scalingFactor = inputs.maxDimX / inputs.nCols;
 
-  size_t nPixels = ds->GetRasterXSize() * ds->GetRasterYSize();
+  uint8_t *stage = (uint8_t *)malloc(sizeof(uint8_t) * nPixels);
+  uint8_t *quality = (uint8_t *)malloc(sizeof(uint8_t) * nPixels);
 
-  size_t scalingFactor = info.maxDimX / ds->GetRasterXSize();
+  if (inputs.precomputed) {
+    memcpy(stage, inputs.mask.data(), nPixels);
+    cpuproc::mapgen(stage, inputs.nCols, inputs.nRows,
+                    cacheGenOptions.sampleDim / scalingFactor,
+                    cacheGenOptions.minOKPercentage, quality);
+  } else {
+    unsigned char *bands = inputs.mask.data();
+    size_t nBands = inputs.nMaskBands;
+    size_t cldIdx = nBands - 3;
+    size_t snwIdx = nBands - 2;
+    size_t sclIdx = nBands - 1;
 
 #if HAS_CUDA
-  cudaproc::generateSampleMap(
-      (unsigned char *)bands, nBands - 3,
-      (unsigned char *)((char *)bands + cldIdx * nPixels),
-      cacheGenOptions.cldMax,
-      (unsigned char *)((char *)bands + snwIdx * nPixels),
-      cacheGenOptions.snwMax,
-      (unsigned char *)((char *)bands + sclIdx * nPixels),
-      (unsigned char *)stage, ds->GetRasterXSize(), ds->GetRasterYSize(),
-      cacheGenOptions.sampleDim / scalingFactor,
-      cacheGenOptions.minOKPercentage);
+    cudaproc::generateSampleMap(
+        bands, nBands - 3, bands + cldIdx * nPixels, cacheGenOptions.cldMax,
+        bands + snwIdx * nPixels, cacheGenOptions.snwMax,
+        bands + sclIdx * nPixels, (unsigned char *)stage, inputs.nCols,
+        inputs.nRows, cacheGenOptions.sampleDim / scalingFactor,
+        cacheGenOptions.minOKPercentage, quality);
 #else
-  cpuproc::generateSampleMap(
-      (unsigned char *)bands, nBands - 3,
-      (unsigned char *)((char *)bands + cldIdx * nPixels),
-      cacheGenOptions.cldMax,
-      (unsigned char *)((char *)bands + snwIdx * nPixels),
-      cacheGenOptions.snwMax,
-      (unsigned char *)((char *)bands + sclIdx * nPixels),
-      (unsigned char *)stage, ds->GetRasterXSize(), ds->GetRasterYSize(),
-      cacheGenOptions.sampleDim, cacheGenOptions.minOKPercentage);
+    cpuproc::generateSampleMap(
+        bands, nBands - 3, bands + cldIdx * nPixels, cacheGenOptions.cldMax,
+        bands + snwIdx * nPixels, cacheGenOptions.snwMax,
+        bands + sclIdx * nPixels, (unsigned char *)stage, inputs.nCols,
+        inputs.nRows, cacheGenOptions.sampleDim / scalingFactor,
+        cacheGenOptions.minOKPercentage, quality);
 #endif
+  }
 
-  size_t nPixelsCondensed = (size_t)(std::ceil(nPixels / 64.0) * 8);
+  // the mask planes are the largest input, drop them before the percentiles
+  inputs.mask = {};
 
-  uint8_t *condensed = (uint8_t *)malloc(nPixelsCondensed);
-  // zero memory, could use calloc instead
-  memset(condensed, 0, nPixelsCondensed);
+  auto [sampleCache, err] =
+      finishSampleCache(stage, quality, inputs.nCols, inputs.nRows);
+  if (!sampleCache) {
+    return std::make_pair(std::nullopt, err);
+  }
 
-  size_t okTotal = 0;
-  for (size_t i = 0; i < nPixelsCondensed; i++) {
-    condensed[i] = 0;
+  // 2. normalization percentiles
+  std::vector<NormalizationPercentile> bandPercentiles;
+  for (auto &band : inputs.bands) {
+    if (band.stored) {
+      bandPercentiles.push_back(band.stored.value());
+      continue;
+    }
 
-    // condensed[i] = (stage[i * 8]) != 0;
+    auto values =
+        cpuproc::percentilesU16(band.raw.data(), band.raw.size(), percentiles);
+    assert(values.size() == percentiles.size());
 
-    condensed[i] = 0;
-    for (int j = 0; j < 8 && ((i * 8 + j) < nPixels); j++) {
-      uint8_t ok = (((uint8_t *)stage)[i * 8 + j]) != 0;
+    bandPercentiles.push_back({.lower = values[0], .upper = values[1]});
+    band.raw = {};
+  }
 
-      if (((10980 / 2) - ((i * 8 + j) % (10980 / 2))) < 128) {
-        assert(!ok);
-      }
+  return std::make_pair(
+      ComputationCache{
+          .sampleCache = std::move(sampleCache.value()),
+          .maxDimX = inputs.maxDimX,
+          .maxDimY = inputs.maxDimY,
+          .bandPercentiles = std::move(bandPercentiles),
+          .productName = info.productName,
+          .unixModTime = info.files.modTime,
+      },
+      "");
+}
 
-      assert(ok == 1 || ok == 0);
-      assert(7 - j >= 0);
-      assert(j <= 7);
+std::pair<std::optional<Sampler::SampleCache>, std::string>
+Sampler::finishSampleCache(uint8_t *stage, uint8_t *quality, size_t nCols,
+                           size_t nRows) {
+  size_t nPixels = nCols * nRows;
 
-      okTotal += ok;
-      condensed[i] |= (ok << (j));
-    }
-  }
+  SampleMap map = SampleMap::fromBytes(stage, nPixels);
 
+  // mostly long runs of 0 and 255, deflates by well over an order of magnitude
+  size_t qualitySize = 0;
+  void *deflated = CPLZLibDeflate(quality, nPixels, 6, NULL, 0, &qualitySize);
+
+  free(quality);
   free(stage);
-  free(bands);
-  ds->Close();
+
+  if (!deflated) {
+    return std::make_pair(std::nullopt, "failed to compress quality map");
+  }
 
   auto ret = std::make_pair(SampleCache{}, "");
   // ret.first = std::move(cache);
-  ret.first.bitrange = condensed;
-  ret.first.size = nPixelsCondensed;
-  ret.first.nOK = okTotal;
-  ret.first.nRows = (size_t)ds->GetRasterYSize();
-  ret.first.nCols = (size_t)ds->GetRasterXSize();
+  ret.first.nOK = map.count();
+  ret.first.map = std::move(map);
+  ret.first.nRows = nRows;
+  ret.first.nCols = nCols;
+  ret.first.qualityMap.assign((uint8_t *)deflated,
+                              (uint8_t *)deflated + qualitySize);
+  VSIFree(deflated);
 
   return ret;
 };
 
-std::pair<std::vector<Sampler::NormalizationPercentile>,
-          std::optional<std::string>>
-Sampler::getNormalizationPercentiles(const SampleInfo &info) {
-  const std::vector<size_t> percentiles = {1, 99};
+std::optional<std::string>
+Sampler::applyQualityThreshold(sqlite3 *conn, const SampleInfo &info,
+                               SampleCache *cache) {
+  if (sampleOptions.minQuality < 0) {
+    return std::nullopt;
+  }
 
-  std::vector<Sampler::NormalizationPercentile> normalizationPercentiles;
-  for (const auto &flavor : flavors) {
-    std::string dsPath =
-        "/vsizip/" + (std::filesystem::canonical(info.path) /
-                      (info.productName + "-" + flavor + ".tif"))
-                         .string();
+  std::lock_guard<std::mutex> guard(thresholdedMapsLock);
 
-    GDALDatasetUniquePtr ds =
-        GDALDatasetUniquePtr(GDALDataset::Open(dsPath.c_str(), GF_Read));
+  auto memo = thresholdedMaps.find(info.productName);
+  metrics::add(memo == thresholdedMaps.end()
+                   ? metrics::Counter::QUALITY_MAP_MISSES
+                   : metrics::Counter::QUALITY_MAP_HITS);
+  if (memo == thresholdedMaps.end()) {
+    std::vector<uint8_t> deflated;
+    auto err = getQualityMap(conn, info, &deflated);
+    if (err) {
+      return err;
+    }
 
-    if (!ds) {
-      return std::make_pair(std::vector<NormalizationPercentile>{},
-                            std::format("failed to open product: {}", dsPath));
+    size_t nPixels = cache->nRows * cache->nCols;
+    std::vector<uint8_t> quality(nPixels);
+    size_t inflatedSize = 0;
+    if (!CPLZLibInflate(deflated.data(), deflated.size(), quality.data(),
+                        quality.size(), &inflatedSize) ||
+        inflatedSize != nPixels) {
+      return "failed to inflate quality map of " + info.productName;
     }
 
-    for (const auto &band : ds->GetBands()) {
-      float *data =
-          (float *)malloc(sizeof(float) * band->GetXSize() * band->GetYSize());
+    uint8_t minQuality =
+        (uint8_t)std::clamp(sampleOptions.minQuality * 255.0f, 0.0f, 255.0f);
+    for (auto &q : quality) {
+      q = q > minQuality;
+    }
 
-      CPLErr e = band->RasterIO(GF_Read, 0, 0, ds->GetRasterXSize(),
-                                ds->GetRasterYSize(), (void *)data,
-                                ds->GetRasterXSize(), ds->GetRasterYSize(),
-                                GDT_Float32, 0, 0);
+    SampleCache thresholded = {.nRows = cache->nRows, .nCols = cache->nCols};
+    thresholded.map = SampleMap::fromBytes(quality.data(), nPixels);
+    thresholded.nOK = thresholded.map.count();
 
-      if (e) {
-        free(data);
-        return std::make_pair(
-            std::vector<NormalizationPercentile>{},
-            std::format("failed to read band {} of {}, error {}",
-                        band->GetBand(), dsPath, (int)e));
-      }
+    memo = thresholdedMaps.emplace(info.productName, std::move(thresholded))
+               .first;
+  }
 
-#if 0 & HAS_CUDA
-      auto bandPercentiles = ::sats::cuda::percentiles(
-          data, band->GetXSize() * band->GetYSize(), percentiles);
-#else
-      auto bandPercentiles = cpuproc::percentiles(
-          data, band->GetXSize() * band->GetYSize(), percentiles);
-#endif
+  const SampleCache &thresholded = memo->second;
 
-      assert(bandPercentiles.size() == percentiles.size());
+  cache->map = thresholded.map;
+  cache->nOK = thresholded.nOK;
 
-      normalizationPercentiles.push_back({
-          .lower = bandPercentiles[0],
-          .upper = bandPercentiles[1],
-      });
+  return std::nullopt;
+}
 
-      free(data);
-    }
-  }
+void Sampler::setMinQuality(float minQuality) {
+  std::lock_guard<std::mutex> guard(thresholdedMapsLock);
 
-  return std::make_pair(normalizationPercentiles, std::nullopt);
+  sampleOptions.minQuality = minQuality;
+  for (auto &[product, cache] : thresholdedMaps) {
+    freeSampleCache(cache);
+  }
+  thresholdedMaps.clear();
 }
 
 std::optional<std::string> Sampler::ensureCache() {
   std::vector<SampleInfo *> cacheGenQueue(infos.size(), nullptr);
   size_t cacheGenQueueIndex = 0;
+  std::vector<uint8_t> valid(infos.size(), 0);
 
   omp_lock_t queueGenErrorLock;
   std::string queueGenError = "";
   omp_init_lock(&queueGenErrorLock);
 
-  omp_set_num_threads(sampleOptions.nCacheQueryThreads);
-#pragma omp parallel for
+  // num_threads instead of omp_set_num_threads, which would change the
+  // default for every later parallel region in the process
+#pragma omp parallel for num_threads(sampleOptions.nCacheQueryThreads)
   for (size_t i = 0; i < infos.size(); i++) {
     size_t threadNum = omp_get_thread_num();
     sqlite3 *conn = connectionPool[threadNum];
@@ -735,140 +1023,511 @@ std::optional<std::string> Sampler::ensureCache() {
       continue;
     }
 
+    valid[i] = 1;
     freeSampleCache(cache.sampleCache);
   }
   omp_destroy_lock(&queueGenErrorLock);
 
+  std::vector<size_t> ready;
+  for (size_t i = 0; i < infos.size(); i++) {
+    if (valid[i]) {
+      ready.push_back(i);
+    }
+  }
+
   if (!queueGenError.empty()) {
+    markReady(ready);
     return "queuegen errors: " + queueGenError;
   }
 
-  omp_lock_t cacheGenErrorLock;
-  std::string cacheGenError = "";
-  omp_init_lock(&cacheGenErrorLock);
+  if (!sampleOptions.generateMissingCache) {
+    if (cacheGenQueueIndex == 0) {
+      markReady(ready);
+      return std::nullopt;
+    }
 
-  std::cout << "num teams: " << omp_get_num_teams() << std::endl;
-  omp_set_num_threads(sampleOptions.nCacheGenThreads);
-#pragma omp parallel for
-  for (size_t i = 0; i < cacheGenQueueIndex; i++) {
-    auto [sampleCache, err] =
-        genSampleCache(*cacheGenQueue[i], cacheGenOptions);
-
-    if (!sampleCache.has_value()) {
-      omp_set_lock(&cacheGenErrorLock);
-      if (cacheGenError.size() != 0) {
-        cacheGenError += ", ";
-      }
+    std::unordered_set<std::string> missing;
+    for (size_t i = 0; i < cacheGenQueueIndex; i++) {
+      missing.insert(cacheGenQueue[i]->productName);
+    }
 
-      cacheGenError += cacheGenQueue[i]->productName + ": " + err + "\n";
+    std::erase_if(infos, [&](const SampleInfo &info) {
+      return missing.contains(info.productName);
+    });
 
-      omp_unset_lock(&cacheGenErrorLock);
+    // everything left has a valid entry
+    ready.resize(infos.size());
+    std::iota(ready.begin(), ready.end(), 0);
+    markReady(ready);
 
-      continue;
-    }
+    return std::format("{} products have no valid precomputed cache entry and "
+                       "were skipped, run satsample_buildcache on {}",
+                       missing.size(), dataPath.string());
+  }
 
-    auto [normalizationPercentiles, percentileErr] =
-        getNormalizationPercentiles(*cacheGenQueue[i]);
+  markReady(ready);
+  cacheGenQueue.resize(cacheGenQueueIndex);
 
-    if (percentileErr) {
-      omp_set_lock(&cacheGenErrorLock);
-      if (cacheGenError.size() != 0) {
-        cacheGenError += ", ";
-      }
+  if (sampleOptions.backgroundCache) {
+    backgroundQueue = std::move(cacheGenQueue);
+    return std::nullopt;
+  }
+
+  return generateCache(std::move(cacheGenQueue));
+}
 
-      cacheGenError +=
-          cacheGenQueue[i]->productName +
-          " percentile generation error: " + percentileErr.value() + "\n";
+std::optional<std::string>
+Sampler::generateCache(std::vector<SampleInfo *> cacheGenQueue) {
+  std::string cacheGenError = "";
+  std::mutex cacheGenErrorLock;
+  auto addCacheGenError = [&](const std::string &err) {
+    std::lock_guard<std::mutex> guard(cacheGenErrorLock);
+    if (cacheGenError.size() != 0) {
+      cacheGenError += ", ";
+    }
+    cacheGenError += err + "\n";
+  };
 
-      omp_unset_lock(&cacheGenErrorLock);
+  // Largest first: the product size tracks both the bytes read and the
+  // number of mask pixels, so the longest entries start right away instead
+  // of trailing behind everything else.
+  std::sort(cacheGenQueue.begin(), cacheGenQueue.end(),
+            [](const SampleInfo *a, const SampleInfo *b) {
+              if (a->files.size != b->files.size) {
+                return a->files.size > b->files.size;
+              }
+              return a->productName < b->productName;
+            });
+
+  uintmax_t totalBytes = 0;
+  for (const SampleInfo *info : cacheGenQueue) {
+    totalBytes += info->files.size;
+  }
 
-      continue;
+  // I/O and compute run on separate pools: nCacheGenThreads readers keep the
+  // disks busy while the map and percentile passes use the cores. Inputs
+  // hold full resolution bands, so at most one per reader and one per
+  // compute thread exist at once.
+  size_t nIOThreads = std::max(sampleOptions.nCacheGenThreads, (size_t)1);
+  size_t nComputeThreads = sampleOptions.nCacheComputeThreads
+                               ? sampleOptions.nCacheComputeThreads
+                               : nIOThreads;
+  std::counting_semaphore<> inFlight(nIOThreads + nComputeThreads);
+
+  std::mutex progressLock;
+  std::condition_variable progressCv;
+  size_t productsDone = 0;
+  uintmax_t bytesDone = 0;
+  auto finishProduct = [&](const SampleInfo *info) {
+    {
+      std::lock_guard<std::mutex> guard(progressLock);
+      productsDone++;
+      bytesDone += info->files.size;
     }
+    progressCv.notify_one();
+  };
+
+  CacheWriter writer(writerConnection);
 
-    auto maxDims = getMaxResolution(cacheGenQueue[i]->path.string());
-    if (!maxDims.has_value()) {
-      omp_set_lock(&cacheGenErrorLock);
-      if (cacheGenError.size() != 0) {
-        cacheGenError += ", ";
+  // destroyed in reverse order: the I/O pool drains first, then compute,
+  // before the writer flushes
+  TaskPool computePool(nComputeThreads);
+  TaskPool ioPool(nIOThreads);
+
+  std::cout << std::format("generating {} cache entries, {} bytes, {} I/O and "
+                           "{} compute threads",
+                           cacheGenQueue.size(), totalBytes, nIOThreads,
+                           nComputeThreads)
+            << std::endl;
+
+  auto start = std::chrono::steady_clock::now();
+
+  for (const SampleInfo *info : cacheGenQueue) {
+    ioPool.submit([&, info] {
+      // the sampler is going away, skip what hasn't started
+      if (stopBackgroundCache) {
+        finishProduct(info);
+        return;
       }
 
-      cacheGenError += cacheGenQueue[i]->productName +
-                       ": failed to retreive maximum dimensions---either this "
-                       "is a filesystem issue or the dimension scaling is "
-                       "invalid in this product\n";
+      inFlight.acquire();
 
-      omp_unset_lock(&cacheGenErrorLock);
+      auto inputs = std::make_shared<CacheInputs>();
+      std::optional<std::string> err;
+      {
+        trace::Scope scope("readCacheInputs", "cache", info - infos.data());
+        err = readCacheInputs(*info, inputs.get());
+      }
 
-      freeSampleCache(sampleCache.value());
-      continue;
-    }
+      if (err) {
+        inFlight.release();
+        addCacheGenError(info->productName + ": " + err.value());
+        finishProduct(info);
+        return;
+      }
+
+      computePool.submit([&, info, inputs] {
+        std::pair<std::optional<ComputationCache>, std::string> computed;
+        {
+          trace::Scope scope("computeCacheEntry", "cache",
+                             info - infos.data());
+          computed = computeCacheEntry(*info, std::move(*inputs));
+        }
+        auto &[cache, err] = computed;
+        inFlight.release();
+
+        if (!cache) {
+          addCacheGenError(info->productName + ": " + err);
+          finishProduct(info);
+          return;
+        }
 
-    struct stat st;
-    int ret = stat(cacheGenQueue[i]->path.c_str(), &st);
-    uint64_t lastModTime = st.st_mtim.tv_sec;
-
-    ComputationCache cache = {.sampleCache = std::move(sampleCache.value()),
-                              .maxDimX = maxDims->first,
-                              .maxDimY = maxDims->second,
-                              .bandPercentiles = normalizationPercentiles,
-                              .productName =
-                                  cacheGenQueue[i]->productName.c_str(),
-                              .unixModTime = lastModTime};
-
-    // write cache entry
-    std::optional<std::string> writeErr = std::nullopt;
-#pragma omp critical(WRITE_CACHE)
-    writeErr = writeCacheEntry(connectionPool[omp_get_thread_num()], cache);
-
-    if (writeErr) {
-      omp_set_lock(&cacheGenErrorLock);
-      cacheGenError += cacheGenQueue[i]->productName +
-                       " cache write error: " + writeErr.value() + "\n";
-      omp_unset_lock(&cacheGenErrorLock);
+        // hand the entry to the writer thread, committed in batches; the
+        // product becomes sampleable once its batch is committed
+        writer.submit(
+            [this, cache = std::move(cache.value())](sqlite3 *conn) {
+              auto err = writeCacheEntry(conn, cache);
+              if (err) {
+                return std::make_optional(cache.productName +
+                                          " cache write error: " + err.value());
+              }
+              return err;
+            },
+            [this, info] { markReady({(size_t)(info - infos.data())}); });
+        finishProduct(info);
+      });
+    });
+  }
+
+  // progress with an ETA from the byte rate so far
+  {
+    std::unique_lock<std::mutex> guard(progressLock);
+    while (productsDone < cacheGenQueue.size()) {
+      progressCv.wait_for(guard, std::chrono::seconds(10));
+
+      double elapsed = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+      double rate = elapsed > 0 ? bytesDone / elapsed : 0;
+      double eta = rate > 0 ? (totalBytes - bytesDone) / rate : 0;
+
+      std::cout << std::format("cache: {}/{} products, {:.1f}% of bytes, "
+                               "{:.0f}s elapsed, eta {:.0f}s",
+                               productsDone, cacheGenQueue.size(),
+                               totalBytes ? 100.0 * bytesDone / totalBytes
+                                          : 100.0,
+                               elapsed, eta)
+                << std::endl;
     }
+  }
+
+  ioPool.wait();
+  computePool.wait();
 
-    freeSampleCache(sampleCache.value());
+  if (auto writeErr = writer.flush()) {
+    cacheGenError += writeErr.value();
   }
-  omp_destroy_lock(&cacheGenErrorLock);
 
   if (cacheGenError.size() != 0) {
     return cacheGenError;
   }
 
   return std::nullopt;
-} // namespace sats
+}
+
+void Sampler::startBackgroundCache() {
+  if (backgroundQueue.empty()) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(readyLock);
+    backgroundRunning = true;
+  }
+
+  std::cout << std::format("generating {} cache entries in the background, "
+                           "{} of {} products ready",
+                           backgroundQueue.size(), readyCount(),
+                           infos.size())
+            << std::endl;
+
+  backgroundThread = std::make_unique<std::thread>([this] {
+    auto err = generateCache(std::move(backgroundQueue));
+    if (err) {
+      std::cout << "background cache error: " << err.value() << std::endl;
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(readyLock);
+      if (err) {
+        cacheError = cacheError.value_or("") + err.value();
+      }
+      backgroundRunning = false;
+    }
+    readyCv.notify_all();
+  });
+}
+
+void Sampler::markReady(const std::vector<size_t> &products) {
+  {
+    std::lock_guard<std::mutex> guard(readyLock);
+    // infos is final by the first call, and each product is committed once
+    if (readyProducts.empty()) {
+      readyProducts.resize(infos.size());
+    }
+
+    size_t count = nReady.load(std::memory_order_relaxed);
+    for (size_t product : products) {
+      if (count < readyProducts.size()) {
+        readyProducts[count++] = product;
+      }
+    }
+    nReady.store(count, std::memory_order_release);
+  }
+  readyCv.notify_all();
+}
+
+// Holding every readyLock across fork() leaves the child's copies unlocked
+// and consistent.
+void Sampler::prepareFork() {
+  liveSamplersLock.lock();
+  for (Sampler *sampler : liveSamplers) {
+    sampler->readyLock.lock();
+  }
+}
+
+void Sampler::parentAfterFork() {
+  for (Sampler *sampler : liveSamplers) {
+    sampler->readyLock.unlock();
+  }
+  liveSamplersLock.unlock();
+}
+
+void Sampler::childAfterFork() {
+  for (Sampler *sampler : liveSamplers) {
+    // entries committed so far stay sampleable, waitForReady stops waiting
+    // for more
+    sampler->backgroundRunning = false;
+    sampler->stopBackgroundCache = true;
+
+    // the thread only exists in the parent, joining it here would hang or
+    // abort; leak the handle instead
+    (void)sampler->backgroundThread.release();
+
+    sampler->readyLock.unlock();
+  }
+  liveSamplersLock.unlock();
+}
+
+float Sampler::getCoverage() const {
+  if (infos.empty()) {
+    return 1.0f;
+  }
+
+  return (float)readyCount() / infos.size();
+}
+
+bool Sampler::waitForReady(size_t nProducts,
+                           std::optional<std::chrono::milliseconds> timeout) {
+  std::unique_lock<std::mutex> guard(readyLock);
+  auto done = [&] {
+    return readyCount() >= nProducts || !backgroundRunning;
+  };
+
+  if (timeout) {
+    readyCv.wait_for(guard, timeout.value(), done);
+  } else {
+    readyCv.wait(guard, done);
+  }
+
+  return readyCount() >= nProducts;
+}
+
+bool Sampler::waitForCoverage(
+    float fraction, std::optional<std::chrono::milliseconds> timeout) {
+  fraction = std::clamp(fraction, 0.0f, 1.0f);
+  return waitForReady((size_t)std::ceil(fraction * infos.size()), timeout);
+}
 
 std::string Sampler::getDSPath(const SampleInfo &info,
                                const std::string &flavor) {
   std::string dsPath =
-      "vrt:///vsizip/" +
-      (std::filesystem::canonical(info.path) /
-       (info.productName + "-" + flavor + ".tif" +
-        std::format("?outsize={},{}", info.maxDimX, info.maxDimY)))
-          .string();
+      "vrt://" + info.files.bundle(flavor).value_or("") +
+      std::format("?outsize={},{}", info.maxDimX, info.maxDimY);
 
   return dsPath;
 }
 
-static std::string getDatasetCRS(const std::string &path) {
-  GDALDatasetUniquePtr ds =
-      GDALDatasetUniquePtr(GDALDataset::Open(path.c_str()));
+static std::pair<size_t, size_t>
+pixelToCRS(const double *gt, const std::pair<size_t, size_t> &pixelCoords) {
+  return std::make_pair(
+      gt[0] + pixelCoords.first * gt[1] + pixelCoords.second * gt[2],
+      gt[3] + pixelCoords.first * gt[4] + pixelCoords.second * gt[5]);
+}
+
+std::optional<Sampler::Sample>
+Sampler::readSample(const SampleInfo &info, const ComputationCache &cache,
+                    size_t sampleIndexX, size_t sampleIndexY) {
+  // sized for every band up front, so the slot isn't traded for a bigger
+  // one half way through
+  RawBuffer raw{SlabAllocator<uint16_t>(slabs)};
+  raw.reserve(cache.bandPercentiles.size() * cacheGenOptions.sampleDim *
+              cacheGenOptions.sampleDim);
+
+  Georef georef;
+  size_t nBands =
+      readRawWindow(info, sampleIndexX, sampleIndexY, &raw, &georef);
+
+  if (!nBands || nBands > cache.bandPercentiles.size()) {
+    metrics::add(metrics::Counter::READ_FAILURES);
+    return std::nullopt;
+  }
+
+  metrics::add(metrics::Counter::SAMPLES_READ);
+  metrics::add(metrics::Counter::BYTES_READ, raw.size() * sizeof(uint16_t));
 
-  return std::string(ds->GetProjectionRef());
+  // percentile based linear normalization, applied on decode
+  std::vector<float> lower(nBands), scale(nBands);
+  for (size_t i = 0; i < nBands; i++) {
+    NormalizationPercentile norm = cache.bandPercentiles[i];
+    lower[i] = norm.lower;
+    scale[i] = 1.0 / (norm.upper - norm.lower);
+  }
+
+  return Sample{
+      .raw = std::move(raw),
+      .lower = std::move(lower),
+      .scale = std::move(scale),
+      .nBands = nBands + 1, // + ndvi
+      .dim = cacheGenOptions.sampleDim,
+      .crs = std::move(georef.crs),
+      .coordsMin = pixelToCRS(georef.geoTransform,
+                              std::make_pair(sampleIndexX, sampleIndexY)),
+      .coordsMax = pixelToCRS(
+          georef.geoTransform,
+          std::make_pair(sampleIndexX + cacheGenOptions.sampleDim,
+                         sampleIndexY + cacheGenOptions.sampleDim)),
+      .year = info.year,
+      .month = info.month,
+      .day = info.day,
+  };
 }
 
-static std::pair<size_t, size_t>
-datasetPixelToCRS(const std::string &path,
-                  const std::pair<size_t, size_t> &pixelCoords) {
-  GDALDatasetUniquePtr ds =
-      GDALDatasetUniquePtr(GDALDataset::Open(path.c_str()));
+// Normalized raw bands followed by ndvi ((B8 - B4) / (B8 + B4), B4 and B8
+// being the third and fourth HIRES bands). Every raw band is normalized,
+// including the last one the float readSample loop used to leave as raw
+// reflectance; ShardSampler normalizes the same way.
+template <typename T>
+static void decodeSample(const Sampler::Sample &sample, T *out) {
+  metrics::ScopedTimer timer(metrics::Stage::NORMALIZE);
+
+  const size_t bandSize = sample.dim * sample.dim;
+  const size_t nRaw = sample.nBands - 1;
+
+  for (size_t i = 0; i < nRaw; i++) {
+    cpuproc::normalizeBand(sample.raw.data() + i * bandSize, bandSize,
+                           sample.lower[i], sample.scale[i],
+                           out + i * bandSize);
+  }
+
+  cpuproc::ndvi(sample.raw.data() + 2 * bandSize,
+                sample.raw.data() + 3 * bandSize, bandSize,
+                out + nRaw * bandSize);
+}
 
-  double gt[6];
-  ds->GetGeoTransform(gt);
+void Sampler::Sample::decode() {
+  if (!bands.empty() || !nBands || !dim) {
+    return;
+  }
 
-  return std::make_pair(
-      gt[0] + pixelCoords.first * gt[1] + pixelCoords.second * gt[2],
-      gt[3] + pixelCoords.first * gt[4] + pixelCoords.second * gt[5]);
+  bands.resize(nBands * dim * dim);
+  decodeSample(*this, bands.data());
+}
+
+size_t Sampler::readRawWindow(const SampleInfo &info, size_t x, size_t y,
+                              RawBuffer *bands, Georef *georef) {
+  const size_t dim = cacheGenOptions.sampleDim;
+  const size_t bandSize = dim * dim;
+
+  size_t nBands = 0;
+  for (const auto &flavor : flavors) {
+    std::string dsPath = getDSPath(info, flavor);
+
+    GDALDatasetUniquePtr ds;
+    {
+      metrics::ScopedTimer timer(metrics::Stage::DATASET_OPEN);
+      ds = GDALDatasetUniquePtr(GDALDataset::FromHandle(
+          GDALOpenShared(dsPath.c_str(), GDALAccess::GA_ReadOnly)));
+    }
+
+    if (!ds) {
+      std::cout << "failed to open " << dsPath << std::endl;
+      return 0;
+    }
+
+    if (georef && flavor == flavors[0]) {
+      metrics::ScopedTimer timer(metrics::Stage::GEOREF);
+      georef->crs = ds->GetProjectionRef();
+      ds->GetGeoTransform(georef->geoTransform);
+    }
+
+    bands->resize((nBands + ds->GetRasterCount()) * bandSize);
+
+    metrics::ScopedTimer timer(flavor == "HIRES"
+                                   ? metrics::Stage::RASTERIO_HIRES
+                                   : metrics::Stage::RASTERIO_LOWRES);
+
+    for (const auto &band : ds->GetBands()) {
+      CPLErr e = band->RasterIO(GF_Read, x, y, dim, dim,
+                                bands->data() + nBands * bandSize, dim, dim,
+                                GDT_UInt16, 0, 0);
+
+      if (e) {
+        std::cout << "failed to read band " << band->GetBand() << " of "
+                  << info.productName << " of flavor " << flavor
+                  << std::format("({}, {}, {}, {})", x, y, dim, dim)
+                  << std::endl;
+        return 0;
+      }
+
+      nBands++;
+    }
+  }
+
+  return nBands;
+}
+
+std::pair<size_t, size_t> Sampler::jitterWindow(const SampleCache &cache,
+                                                size_t scalingFactor,
+                                                size_t col, size_t row) const {
+  if (scalingFactor < 2) {
+    return {0, 0};
+  }
+
+  size_t jitterX = (size_t)std::rand() % scalingFactor;
+  size_t jitterY = (size_t)std::rand() % scalingFactor;
+
+  // A window shifted by less than one map cell lies inside the union of the
+  // windows at its cell and the cells right of / below it, so it is valid
+  // when those are. That is exact for an all-valid threshold and uses no
+  // state beyond the map itself.
+  bool right = col + 1 < cache.nCols && sampleOK(cache, col + 1, row);
+  bool down = row + 1 < cache.nRows && sampleOK(cache, col, row + 1);
+
+  if (jitterX && jitterY &&
+      !(right && down && sampleOK(cache, col + 1, row + 1))) {
+    // the diagonal neighbour is out, shift along one axis only
+    (right ? jitterY : jitterX) = 0;
+  }
+
+  if (!right) {
+    jitterX = 0;
+  }
+  if (!down) {
+    jitterY = 0;
+  }
+
+  return {jitterX, jitterY};
 }
 
 std::vector<Sampler::Sample> Sampler::randomSampleV2(size_t n) {
@@ -880,26 +1539,42 @@ std::vector<Sampler::Sample> Sampler::randomSampleV2(size_t n) {
     size_t sampleCoordIndex;
     ComputationCache *cache;
 
-    inline bool operator<(const SampleIndex &other) const {
-      if (info < other.info) {
-        return true;
-      } else if (info > other.info) {
-        return false;
-      }
+    // sub-cell offset in full resolution pixels, see SampleOptions::jitter
+    size_t jitterX, jitterY;
 
-      return sampleCoordIndex < other.sampleCoordIndex;
+    inline bool operator<(const SampleIndex &other) const {
+      return std::tie(info, sampleCoordIndex, jitterX, jitterY) <
+             std::tie(other.info, other.sampleCoordIndex, other.jitterX,
+                      other.jitterY);
     }
   };
 
   std::set<SampleIndex> samples;
   std::unordered_map<SampleInfo *, ComputationCache> caches;
 
+  // only products whose cache entry is committed; with a background cache
+  // pass still running that may be none yet
+  if (readyCount() == 0 && !waitForReady(1, std::nullopt)) {
+    std::cout << "randomSampleV2: no product has a cache entry" << std::endl;
+    return std::vector<Sample>{};
+  }
+  const size_t nReadyProducts = readyCount();
+
+  std::optional<metrics::ScopedTimer> drawTimer;
+  drawTimer.emplace(metrics::Stage::INDEX_DRAW);
+
   // cursed loop index modification lol
   for (size_t _i = 1; _i < n + 1; _i++) {
-    size_t infoIndex = (size_t)(std::rand() % infos.size());
+    size_t infoIndex =
+        readyProducts[(size_t)(std::rand() % nReadyProducts)];
     SampleInfo *info = &infos[infoIndex];
 
-    if (!caches.contains(info)) {
+    if (caches.contains(info)) {
+      metrics::add(metrics::Counter::CACHE_REUSES);
+    } else {
+      metrics::ScopedTimer loadTimer(metrics::Stage::CACHE_LOAD);
+      metrics::add(metrics::Counter::CACHE_LOADS);
+
       caches[info] = {};
 
       ComputationCache *cache = &caches[info];
@@ -918,6 +1593,14 @@ std::vector<Sampler::Sample> Sampler::randomSampleV2(size_t n) {
                   << info->productName << std::endl;
         return std::vector<Sample>{};
       }
+
+      err = applyQualityThreshold(connectionPool[0], *info,
+                                  &cache->sampleCache);
+      if (err) {
+        std::cout << "randomSampleV2: quality threshold error: " << err.value()
+                  << std::endl;
+        return std::vector<Sample>{};
+      }
     }
     ComputationCache *cache = &caches[info];
 
@@ -928,10 +1611,20 @@ std::vector<Sampler::Sample> Sampler::randomSampleV2(size_t n) {
 
     auto sampleIndex = computeSampleIndex(sampleNOKIndex, cache->sampleCache);
 
+    std::pair<size_t, size_t> jitter = {0, 0};
+    if (sampleOptions.jitter && cache->sampleCache.nOK) {
+      jitter = jitterWindow(cache->sampleCache,
+                            info->maxDimX / cache->sampleCache.nCols,
+                            sampleIndex % cache->sampleCache.nCols,
+                            sampleIndex / cache->sampleCache.nCols);
+    }
+
     SampleIndex index = {
         .info = info,
         .sampleCoordIndex = sampleIndex,
         .cache = cache,
+        .jitterX = jitter.first,
+        .jitterY = jitter.second,
     };
 
     if (samples.contains(index) || !cache->sampleCache.nOK) {
@@ -941,158 +1634,471 @@ std::vector<Sampler::Sample> Sampler::randomSampleV2(size_t n) {
     }
   }
 
-  // 2. sample (threaded)
+  drawTimer.reset();
+
+  // 2. sample (threaded), every read lands in its own slot so the threads
+  // share no lock
+  const std::vector<SampleIndex> drawn(samples.begin(), samples.end());
+  std::vector<std::optional<Sample>> slots(drawn.size());
+
+#pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < drawn.size(); i++) {
+    const SampleIndex &sample = drawn[i];
+    const auto &info = *sample.info;
+    trace::Scope scope("readSample", "sample", &info - infos.data());
+    const SampleCache *cache = &sample.cache->sampleCache;
+
+    int scalingFactor = info.maxDimX / cache->nCols;
+    assert(scalingFactor);
+    assert(scalingFactor == info.maxDimY / cache->nRows);
+
+    size_t sampleIndexX = sample.sampleCoordIndex % cache->nCols;
+    size_t sampleIndexY = sample.sampleCoordIndex / cache->nCols;
+
+    sampleIndexX = sampleIndexX * scalingFactor + sample.jitterX;
+    sampleIndexY = sampleIndexY * scalingFactor + sample.jitterY;
+
+    slots[i] = readSample(info, *sample.cache, sampleIndexX, sampleIndexY);
+  }
+
+  // 3. compact, moving the bands out of the slots
+  std::vector<Sample> reads;
+  reads.reserve(slots.size());
+  for (auto &slot : slots) {
+    if (slot) {
+      reads.push_back(std::move(slot.value()));
+    }
+  }
+
+  for (auto &cache : caches) {
+    // std::cout << "cache: " << cache.first->productName << std::endl;
+    // for (const auto &percentile : cache.second.bandPercentiles) {
+    //   std::cout << "\tpercentiles: " << percentile.lower << ", "
+    //             << percentile.upper << std::endl;
+    // }
+    freeSampleCache(cache.second.sampleCache);
+  }
+
+  return reads;
+}
+
+std::vector<size_t> Sampler::epochProducts(const EpochOptions &options) const {
+  std::vector<size_t> order(infos.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+
+  // group acquisitions of the same tile so consecutive reads stay local
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    const auto &ia = infos[a];
+    const auto &ib = infos[b];
+    return std::tie(ia.tileName, ia.year, ia.month, ia.day, ia.productName) <
+           std::tie(ib.tileName, ib.year, ib.month, ib.day, ib.productName);
+  });
+
+  size_t nShards = std::max(options.worldSize, (size_t)1) *
+                   std::max(options.nWorkers, (size_t)1);
+  size_t shard = options.rank * std::max(options.nWorkers, (size_t)1) +
+                 options.worker;
+
+  std::vector<size_t> products;
+  for (size_t i = shard; i < order.size(); i += nShards) {
+    products.push_back(order[i]);
+  }
+
+  return products;
+}
+
+std::optional<std::string>
+Sampler::checkEpochOptions(const EpochOptions &options) const {
+  if (sampleOptions.worldSize > 1 && options.worldSize > 1) {
+    return "the sampler is already sharded by SampleOptions rank / "
+           "worldSize, EpochOptions must not shard again";
+  }
+  if (options.rank >= std::max(options.worldSize, (size_t)1) ||
+      options.worker >= std::max(options.nWorkers, (size_t)1)) {
+    return std::format("EpochOptions rank {} of {}, worker {} of {} is out "
+                       "of range",
+                       options.rank, options.worldSize, options.worker,
+                       options.nWorkers);
+  }
+  return std::nullopt;
+}
+
+std::vector<Sampler::Sample> Sampler::epochSample(EpochCursor &cursor,
+                                                  const EpochOptions &options,
+                                                  size_t n) {
+  struct Window {
+    size_t product;
+    size_t x, y;
+  };
+
+  if (auto err = checkEpochOptions(options)) {
+    std::cout << "epochSample: " << *err << std::endl;
+    return {};
+  }
+
+  const std::vector<size_t> products = epochProducts(options);
+  const size_t stride =
+      options.stride ? options.stride : cacheGenOptions.sampleDim;
+
+  // a batch whose reads all failed would look like the end of the shard, so
+  // keep going until something was read or the shard is exhausted
   std::vector<Sample> reads;
+  while (reads.empty() && cursor.product < products.size()) {
+    std::vector<Window> windows;
+    std::unordered_map<size_t, ComputationCache> caches;
+
+    // 1. walk the grid from the cursor until n valid windows are found
+    while (windows.size() < n && cursor.product < products.size()) {
+      size_t infoIndex = products[cursor.product];
+      const SampleInfo &info = infos[infoIndex];
+
+      ComputationCache &cache = caches[infoIndex];
+      bool haveCache = false;
+      auto err = getCacheEntry(connectionPool[0], info, &cache, &haveCache);
+      if (!err && haveCache) {
+        err = applyQualityThreshold(connectionPool[0], info,
+                                    &cache.sampleCache);
+      }
 
-#pragma omp parallel
-  {
-#pragma omp single
-    for (const auto &sample : samples) {
-#pragma omp task
-      {
-        SampleIndex sampleInfo = sample;
-        const auto &info = *sampleInfo.info;
-        SampleCache *cache = &sampleInfo.cache->sampleCache;
+      if (err || !haveCache) {
+        std::cout << "epochSample: no cache for " << info.productName << ": "
+                  << err.value_or("not present") << std::endl;
+        caches.erase(infoIndex);
+        cursor.product++;
+        cursor.window = 0;
+        continue;
+      }
 
-        int scalingFactor = info.maxDimX / cache->nCols;
-        assert(scalingFactor);
-        assert(scalingFactor == info.maxDimY / cache->nRows);
+      const SampleCache &sampleCache = cache.sampleCache;
+      size_t scalingFactor = info.maxDimX / sampleCache.nCols;
+      size_t gridStride = std::max(stride / scalingFactor, (size_t)1);
+      size_t gridCols = (sampleCache.nCols + gridStride - 1) / gridStride;
+      size_t gridRows = (sampleCache.nRows + gridStride - 1) / gridStride;
+
+      for (; cursor.window < gridCols * gridRows && windows.size() < n;
+           cursor.window++) {
+        size_t col = (cursor.window % gridCols) * gridStride;
+        size_t row = (cursor.window / gridCols) * gridStride;
+
+        if (sampleOK(sampleCache, col, row)) {
+          windows.push_back({
+              .product = infoIndex,
+              .x = col * scalingFactor,
+              .y = row * scalingFactor,
+          });
+        }
+      }
 
-        size_t sampleIndexX =
-            sample.sampleCoordIndex % sample.cache->sampleCache.nCols;
-        size_t sampleIndexY =
-            sample.sampleCoordIndex / sample.cache->sampleCache.nCols;
+      if (cursor.window >= gridCols * gridRows) {
+        cursor.product++;
+        cursor.window = 0;
+      }
+    }
 
-        sampleIndexX *= scalingFactor;
-        sampleIndexY *= scalingFactor;
+    // 2. read (threaded), keeping grid order
+    std::vector<std::optional<Sample>> slots(windows.size());
 
-        // std::cout << "final path: " << info.path << std::endl;
+#pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < windows.size(); i++) {
+      const Window &window = windows[i];
+      trace::Scope scope("readSample", "sample", window.product);
+      slots[i] = readSample(infos[window.product], caches.at(window.product),
+                            window.x, window.y);
+    }
 
-        std::vector<std::vector<float>> bands;
-        for (const auto &flavor : flavors) {
-          std::string dsPath = getDSPath(info, flavor);
+    for (auto &slot : slots) {
+      if (slot) {
+        reads.push_back(std::move(slot.value()));
+      }
+    }
 
-          GDALDatasetUniquePtr ds =
-              GDALDatasetUniquePtr(GDALDataset::FromHandle(
-                  GDALOpenShared(dsPath.c_str(), GDALAccess::GA_ReadOnly)));
+    for (auto &cache : caches) {
+      freeSampleCache(cache.second.sampleCache);
+    }
+  }
 
-          if (!ds) {
-            std::cout << "failed to open " << dsPath << std::endl;
+  return reads;
+}
 
-            // for (const auto &band : bands) {
-            //   free(band);
-            // }
+std::optional<std::string>
+Sampler::fillBatch(const std::vector<Sample> &samples, void *bandsOut,
+                   float *labelsOut, BatchDType dtype) {
+  if (samples.empty()) {
+    return std::nullopt;
+  }
 
-            continue;
+  metrics::ScopedTimer timer(metrics::Stage::TENSOR_COPY);
 
-            // return
-          }
+  const size_t nChannels = samples[0].nBands;
+  const size_t bandSize = cacheGenOptions.sampleDim * cacheGenOptions.sampleDim;
 
-          bool readError = false;
-          for (const auto &band : ds->GetBands()) {
-            // std::cout << "read band " << band->GetBand() << " of "
-            //           << info.productName << " of flavor " << flavor
-            //           << std::format("({}, {}, {}, {})", sampleIndexX,
-            //                          sampleIndexY, cacheGenOptions.sampleDim,
-            //                          cacheGenOptions.sampleDim)
-            //           << std::endl;
-            // float *data =
-            //     (float *)malloc(sizeof(float) * cacheGenOptions.sampleDim *
-            //                     cacheGenOptions.sampleDim);
-
-            auto &data = bands.emplace_back(cacheGenOptions.sampleDim *
-                                            cacheGenOptions.sampleDim);
-
-            CPLErr e = band->RasterIO(
-                GF_Read, sampleIndexX, sampleIndexY, cacheGenOptions.sampleDim,
-                cacheGenOptions.sampleDim, data.data(),
-                cacheGenOptions.sampleDim, cacheGenOptions.sampleDim,
-                GDT_Float32, 0, 0);
-
-            if (e) {
-              std::cout << "failed to read band " << band->GetBand() << " of "
-                        << info.productName << " of flavor " << flavor
-                        << std::format("({}, {}, {}, {})", sampleIndexX,
-                                       sampleIndexY, cacheGenOptions.sampleDim,
-                                       cacheGenOptions.sampleDim)
-                        << std::endl;
-              readError = true;
-              break;
-            }
-
-            if (readError) {
-              bands.clear();
-            }
-          }
+  for (const auto &sample : samples) {
+    if (sample.nBands != nChannels) {
+      return std::format("sample band counts differ ({} vs {})", sample.nBands,
+                         nChannels);
+    }
+  }
+
+#pragma omp parallel for
+  for (size_t i = 0; i < samples.size(); i++) {
+    size_t offset = i * nChannels * bandSize;
+    trace::Scope scope("decode", "sample", i);
+
+    switch (dtype) {
+    case BatchDType::FLOAT32:
+      decodeSample(samples[i], (float *)bandsOut + offset);
+      break;
+    case BatchDType::FLOAT16:
+      decodeSample(samples[i], (cpuproc::Half *)bandsOut + offset);
+      break;
+    case BatchDType::BFLOAT16:
+      decodeSample(samples[i], (cpuproc::BFloat16 *)bandsOut + offset);
+      break;
+    }
+  }
+
+#pragma omp parallel for
+  for (size_t i = 0; i < samples.size(); i++) {
+    float *labels = labelsOut + i * bandSize;
+
+    auto cdlPath = yearToCDL.find(samples[i].year);
+    if (cdlPath == yearToCDL.end() || cdlPath->second.empty()) {
+      std::cout << "cdl for year " << samples[i].year << " is empty!"
+                << std::endl;
+      memset(labels, 0, bandSize * sizeof(float));
+      continue;
+    }
+
+    metrics::ScopedTimer cdlTimer(metrics::Stage::CDL_READ);
+    metrics::add(metrics::Counter::CDL_READS);
+    trace::Scope scope("cdlRead", "label", i);
+
+    // straight into the batch, no per-sample label buffer
+    bool read =
+        cdl::read(cdlPath->second, samples[i].crs.c_str(),
+                  cdl::ProjWin{
+                      .xmin = (double)samples[i].coordsMin.first,
+                      .xmax = (double)samples[i].coordsMax.first,
+                      .ymin = (double)samples[i].coordsMin.second,
+                      .ymax = (double)samples[i].coordsMax.second,
+                  },
+                  cacheGenOptions.sampleDim, cacheGenOptions.sampleDim, labels);
+
+    if (!read) {
+      metrics::add(metrics::Counter::CDL_EMPTY);
+      std::cout << "cdl read for " << samples[i].year << " returned empty!"
+                << std::endl;
+      memset(labels, 0, bandSize * sizeof(float));
+    }
+  }
+
+  return std::nullopt;
+}
+
+std::optional<std::string>
+Sampler::exportShards(const std::filesystem::path &outDir,
+                      const ShardExportOptions &options) {
+  const size_t dim = cacheGenOptions.sampleDim;
+  const size_t bandSize = dim * dim;
+  const size_t stride = options.stride ? options.stride : dim;
+  // windows read per parallel round, written out in grid order
+  const size_t chunkSize = 4 * (size_t)omp_get_max_threads();
+
+  std::unique_ptr<ShardWriter> writer;
+
+  // every product, in the same tile-grouped order as an unsharded epoch
+  const std::vector<size_t> products = epochProducts(EpochOptions{
+      .stride = stride, .rank = 0, .worldSize = 1, .worker = 0, .nWorkers = 1});
+
+  for (size_t productIndex = 0; productIndex < products.size();
+       productIndex++) {
+    const SampleInfo &info = infos[products[productIndex]];
+
+    ComputationCache cache;
+    bool haveCache = false;
+    auto err = getCacheEntry(connectionPool[0], info, &cache, &haveCache);
+    if (!err && haveCache) {
+      err = applyQualityThreshold(connectionPool[0], info, &cache.sampleCache);
+    }
+
+    if (err || !haveCache) {
+      std::cout << "exportShards: no cache for " << info.productName << ": "
+                << err.value_or("not present") << std::endl;
+      continue;
+    }
+
+    if (cache.bandPercentiles.size() > shard::maxBands) {
+      freeSampleCache(cache.sampleCache);
+      return std::format("{} has {} bands, shards hold at most {}",
+                         info.productName, cache.bandPercentiles.size(),
+                         shard::maxBands);
+    }
+
+    shard::ShardProduct product = {};
+    strncpy(product.name, info.productName.c_str(), sizeof(product.name) - 1);
+    product.year = info.year;
+    product.month = info.month;
+    product.day = info.day;
+    product.nBands = cache.bandPercentiles.size();
+    for (size_t i = 0; i < cache.bandPercentiles.size(); i++) {
+      product.lower[i] = cache.bandPercentiles[i].lower;
+      product.upper[i] = cache.bandPercentiles[i].upper;
+    }
+
+    // 1. valid windows on the grid
+    const SampleCache &sampleCache = cache.sampleCache;
+    size_t scalingFactor = info.maxDimX / sampleCache.nCols;
+    size_t gridStride = std::max(stride / scalingFactor, (size_t)1);
+
+    std::vector<std::pair<size_t, size_t>> windows;
+    for (size_t row = 0; row < sampleCache.nRows; row += gridStride) {
+      for (size_t col = 0; col < sampleCache.nCols; col += gridStride) {
+        if (sampleOK(sampleCache, col, row)) {
+          windows.emplace_back(col * scalingFactor, row * scalingFactor);
         }
+      }
+    }
+    freeSampleCache(cache.sampleCache);
 
-        // compute ndvi
-        // (B8 - B4) / (B8 + B4)
-        std::vector<float> ndviMask(cacheGenOptions.sampleDim *
-                                    cacheGenOptions.sampleDim);
-        if (!bands.empty()) {
-          const int b4Index = 2;
-          const int b8Index = 3;
-
-          for (size_t i = 0;
-               i < cacheGenOptions.sampleDim * cacheGenOptions.sampleDim; i++) {
-            float b4 = bands[b4Index][i];
-            float b8 = bands[b8Index][i];
-            ndviMask[i] = (b8 - b4) / (b4 + b8);
+    auto cdlPath = yearToCDL.find(info.year);
+    bool haveCDL = cdlPath != yearToCDL.end() && !cdlPath->second.empty();
+    if (!haveCDL) {
+      std::cout << "cdl for year " << info.year << " is empty!" << std::endl;
+    }
+
+    // 2. read raw bands and labels a chunk at a time, then append in order.
+    // The label window comes from the georef of the same read, so a product
+    // that fails to open is skipped window by window like in readSample.
+    std::vector<RawBuffer> bands(chunkSize,
+                                 RawBuffer{SlabAllocator<uint16_t>(slabs)});
+    std::vector<std::vector<uint8_t>> labels(chunkSize);
+    std::vector<size_t> nBands(chunkSize);
+    std::vector<Georef> georefs(chunkSize);
+
+    for (size_t start = 0; start < windows.size(); start += chunkSize) {
+      size_t count = std::min(chunkSize, windows.size() - start);
+
+#pragma omp parallel for schedule(dynamic)
+      for (size_t i = 0; i < count; i++) {
+        auto [x, y] = windows[start + i];
+        trace::Scope scope("exportWindow", "shard", start + i);
+        nBands[i] = readRawWindow(info, x, y, &bands[i], &georefs[i]);
+        labels[i].assign(bandSize, 0);
+
+        if (nBands[i] != product.nBands) {
+          if (nBands[i]) {
+            std::cout << std::format("exportShards: {} window ({}, {}) has {} "
+                                     "bands, its cache has {}",
+                                     info.productName, x, y, nBands[i],
+                                     product.nBands)
+                      << std::endl;
           }
+          nBands[i] = 0;
+          continue;
+        }
+
+        if (!haveCDL) {
+          continue;
+        }
+
+        const double *gt = georefs[i].geoTransform;
+        std::vector<float> dat = cdl::read(
+            cdlPath->second, georefs[i].crs.c_str(),
+            cdl::ProjWin{
+                .xmin = gt[0] + x * gt[1] + y * gt[2],
+                .xmax = gt[0] + (x + dim) * gt[1] + (y + dim) * gt[2],
+                .ymin = gt[3] + x * gt[4] + y * gt[5],
+                .ymax = gt[3] + (x + dim) * gt[4] + (y + dim) * gt[5],
+            },
+            dim, dim);
+
+        if (dat.empty()) {
+          std::cout << "cdl read for " << info.year << " returned empty!"
+                    << std::endl;
+          continue;
+        }
+
+        for (size_t j = 0; j < bandSize; j++) {
+          labels[i][j] = (uint8_t)dat[j];
         }
+      }
 
-        // percentile based linear normalization
-        for (size_t i = 0; i < bands.size() - 1; i++) {
-          NormalizationPercentile norm = sampleInfo.cache->bandPercentiles[i];
+      for (size_t i = 0; i < count; i++) {
+        if (!nBands[i]) {
+          continue;
+        }
 
-          for (size_t j = 0;
-               j < cacheGenOptions.sampleDim * cacheGenOptions.sampleDim; j++) {
-            bands[i][j] =
-                (bands[i][j] - norm.lower) * (1.0 / (norm.upper - norm.lower));
+        if (!writer) {
+          auto [created, err] = ShardWriter::create(
+              outDir,
+              ShardWriter::Shape{
+                  .nBands = product.nBands, .dim = dim, .ndvi = options.ndvi},
+              options.chipsPerShard);
+          if (err) {
+            return err;
           }
+          writer = std::move(created);
         }
 
-        if (!bands.empty()) {
-          bands.push_back((ndviMask));
-
-#pragma omp critical(UPDATE_BANDS)
-          reads.push_back(Sample{
-              .bands = bands,
-              .crs = getDatasetCRS(getDSPath(info, flavors[0])),
-              .coordsMin =
-                  datasetPixelToCRS(getDSPath(info, flavors[0]),
-                                    std::make_pair(sampleIndexX, sampleIndexY)),
-              .coordsMax = datasetPixelToCRS(
-                  getDSPath(info, flavors[0]),
-                  std::make_pair(sampleIndexX + cacheGenOptions.sampleDim,
-                                 sampleIndexY + cacheGenOptions.sampleDim)),
-              .year = sample.info->year,
-              .month = sample.info->month,
-              .day = sample.info->day,
-          });
+        auto [x, y] = windows[start + i];
+        if (auto err = writer->addChip(product, x, y, bands[i].data(),
+                                       labels[i].data())) {
+          return err;
         }
       }
     }
+
+    std::cout << std::format("exportShards: {} ({}/{}): {} chips",
+                             info.productName, productIndex + 1,
+                             products.size(), windows.size())
+              << std::endl;
   }
 
-  for (auto &cache : caches) {
-    // std::cout << "cache: " << cache.first->productName << std::endl;
-    // for (const auto &percentile : cache.second.bandPercentiles) {
-    //   std::cout << "\tpercentiles: " << percentile.lower << ", "
-    //             << percentile.upper << std::endl;
-    // }
-    freeSampleCache(cache.second.sampleCache);
+  if (!writer) {
+    return "exportShards: no chips exported";
   }
 
-  // 3. return (join)
-  return reads;
+  if (auto err = writer->close()) {
+    return err;
+  }
+
+  std::cout << std::format("exportShards: wrote {} chips to {} shards in {}",
+                           writer->chipsWritten(), writer->shardsWritten(),
+                           outDir.string())
+            << std::endl;
+
+  return std::nullopt;
 }
 
 Sampler::~Sampler() {
+  // queued products are skipped, the ones being read or computed finish and
+  // are committed
+  {
+    std::lock_guard<std::mutex> guard(liveSamplersLock);
+    liveSamplers.erase(this);
+  }
+
+  stopBackgroundCache = true;
+  if (backgroundThread && backgroundThread->joinable()) {
+    backgroundThread->join();
+  }
+
+  for (auto &[product, cache] : thresholdedMaps) {
+    freeSampleCache(cache);
+  }
+
+  for (auto &[conn, statements] : statementCache) {
+    sqlite3_finalize(statements.getEntry);
+    sqlite3_finalize(statements.getQualityMap);
+    sqlite3_finalize(statements.writeEntry);
+  }
+
   for (const auto &connection : connectionPool) {
     sqlite3_close_v2(connection);
   }
+  sqlite3_close_v2(writerConnection);
 }
 
 // std::vector<float *> Sampler::randomSample() {
@@ -1,19 +1,30 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <filesystem>
+#include <memory>
+#include <mutex>
 #include <omp.h>
 #include <optional>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include <sqlite3.h>
 
+#include "productLayout.h"
+#include "sampleMap.h"
+#include "slabPool.h"
+
 #ifndef PYBIND11_EXPORT
 #define PYBIND11_EXPORT
 #endif
 
 class SamplerTest_IndexTest_Test;
+class SamplerBench;
 namespace sats {
 
 struct DateRange {
@@ -32,6 +43,47 @@ public:
     std::filesystem::path dbPath;
     size_t nCacheGenThreads;
     size_t nCacheQueryThreads;
+
+    // Cache generation runs the map and percentile passes of this many
+    // products at once, 0 for one per nCacheGenThreads. Each holds the
+    // product's full resolution bands (over a GB for a full tile).
+    size_t nCacheComputeThreads = 0;
+
+    // distributed training: each rank only indexes and samples its own
+    // share of the products. The constructor throws std::invalid_argument
+    // unless rank < worldSize.
+    size_t rank = 0;
+    size_t worldSize = 1;
+
+    // When >= 0, sample from windows whose stored quality score (valid
+    // fraction) exceeds this instead of the map built with minOKPercentage.
+    // Changing it needs no cache regeneration.
+    float minQuality = -1;
+
+    // When false, products without a valid cache entry are skipped instead
+    // of generated at startup. Training sets this once the store has been
+    // filled ahead of time (see buildCache / satsample_buildcache).
+    bool generateMissingCache = true;
+
+    // The sample map is at the mask's (20 m) resolution, so drawn windows
+    // only ever start on every scalingFactor-th full resolution pixel. When
+    // set, randomSampleV2 shifts each window by a random sub-cell offset that
+    // the neighbouring map cells show to be valid.
+    bool jitter = false;
+
+    // When set, the constructor only checks the existing cache entries and
+    // generates the missing ones on a background thread. randomSampleV2 then
+    // draws from the products whose entries are committed so far, see
+    // waitForCoverage. Epoch passes and exportShards still expect every
+    // entry, wait for full coverage before starting them. Forked children
+    // and unpickled copies only sample what was committed before, the pass
+    // keeps running in the original alone.
+    bool backgroundCache = false;
+
+    // Backing of the slab pool the sample buffers are recycled through, see
+    // SlabPool::Options
+    bool hugePages = false;
+    bool numaLocal = false;
   };
 
   struct SampleCacheGenOptions {
@@ -41,17 +93,76 @@ public:
     uint8_t cldMax, snwMax;
   };
 
+  // Element type of the batch band tensor
+  enum class BatchDType {
+    FLOAT32,
+    FLOAT16,
+    BFLOAT16,
+  };
+
+  // Raw window bands. Those the sampler reads come out of its SlabPool and
+  // go back to it when the sample is dropped.
+  using RawBuffer = std::vector<uint16_t, SlabAllocator<uint16_t>>;
+
   struct Sample {
-    std::vector<std::vector<float>> bands;
+    // (nBands - 1, dim, dim) raw reflectance, row-major. Normalization and
+    // the ndvi band are only applied when decoding (fillBatch / decode), so
+    // samples in flight stay at half the size of float bands.
+    RawBuffer raw;
+    // per raw band: normalized = (raw - lower) * scale
+    std::vector<float> lower;
+    std::vector<float> scale;
+
+    size_t nBands = 0; // decoded channels, raw bands + ndvi
+    size_t dim = 0;
+
+    // (nBands, dim, dim) float32 decode, empty until decode() is called and
+    // for an empty (default constructed) sample
+    std::vector<float> bands;
+    void decode();
+
+    float *band(size_t i) { return bands.data() + i * dim * dim; }
+    const float *band(size_t i) const { return bands.data() + i * dim * dim; }
 
     std::string crs;
     std::pair<size_t, size_t> coordsMin;
     std::pair<size_t, size_t> coordsMax;
 
-    size_t year, month, day;
+    size_t year = 0, month = 0, day = 0;
+  };
+
+  // Deterministic, non-overlapping pass over every valid window.
+  struct EpochOptions {
+    // grid step in full resolution pixels, 0 uses sampleDim
+    size_t stride;
+
+    // shards are rank-major, product i belongs to shard
+    // i % (worldSize * nWorkers). rank / worldSize are only for samplers that
+    // index every product; one sharded by SampleOptions::rank / worldSize
+    // rejects them, see checkEpochOptions.
+    size_t rank, worldSize;
+    size_t worker, nWorkers;
+  };
+
+  // Pre-tiled chip export, see ShardWriter / ShardSampler
+  struct ShardExportOptions {
+    // grid step in full resolution pixels, 0 uses sampleDim
+    size_t stride;
+    size_t chipsPerShard;
+
+    // store NDVI with each chip instead of deriving it when reading
+    bool ndvi;
+  };
+
+  // Resumable position within a shard's epoch
+  struct EpochCursor {
+    size_t product; // index into the shard's product order
+    size_t window;  // grid window index within that product
   };
 
   Sampler() = delete;
+  Sampler(const Sampler &) = delete;
+  Sampler &operator=(const Sampler &) = delete;
 
   virtual ~Sampler();
 
@@ -63,28 +174,82 @@ public:
 
   std::vector<Sample> randomSampleV2(size_t n);
 
+  // Reads up to n windows of the shard described by `options`, starting at
+  // `cursor` and advancing it. Returns an empty vector once the shard is
+  // exhausted.
+  std::vector<Sample> epochSample(EpochCursor &cursor,
+                                  const EpochOptions &options, size_t n);
+
+  // Error if `options` can't describe a shard of this sampler: ranks come
+  // from either SampleOptions or EpochOptions, sharding by both would leave
+  // each rank 1 / worldSize^2 of the products.
+  std::optional<std::string>
+  checkEpochOptions(const EpochOptions &options) const;
+
+  // Decodes `samples` into a contiguous (n, C, dim, dim) band buffer of
+  // `dtype` elements and reads the matching CDL labels into a float
+  // (n, 1, dim, dim) buffer.
+  std::optional<std::string> fillBatch(const std::vector<Sample> &samples,
+                                       void *bandsOut, float *labelsOut,
+                                       BatchDType dtype = BatchDType::FLOAT32);
+
+  // Writes every valid window on the `options.stride` grid of every product
+  // as raw uint16 chips plus CDL labels into shard files under `outDir`.
+  std::optional<std::string> exportShards(const std::filesystem::path &outDir,
+                                          const ShardExportOptions &options);
+
   size_t getSampleDim() const { return cacheGenOptions.sampleDim; }
 
+  // Error from filling or validating the cache, if any. With
+  // SampleOptions::backgroundCache, generation errors appear once the
+  // background pass is done.
+  std::optional<std::string> getCacheError() const {
+    std::lock_guard<std::mutex> guard(readyLock);
+    return cacheError;
+  }
+
+  // Fraction of products with a committed cache entry, the ones
+  // randomSampleV2 draws from
+  float getCoverage() const;
+
+  // Blocks until at least `fraction` of the products are ready, the
+  // background generation finished, or `timeout` passed. Returns whether
+  // the coverage was reached.
+  bool waitForCoverage(
+      float fraction,
+      std::optional<std::chrono::milliseconds> timeout = std::nullopt);
+
+  // Fills the cache store at sampleOptions.dbPath for every product under
+  // `path` (across all ranks) without setting up a sampler for training.
+  static std::optional<std::string>
+  buildCache(const std::filesystem::path &path, SampleOptions sampleOptions,
+             SampleCacheGenOptions options, std::optional<DateRange> dateRange);
+
+  // Switches the sampling-time quality threshold, see
+  // SampleOptions::minQuality
+  void setMinQuality(float minQuality);
+
 private:
   friend class ::SamplerTest_IndexTest_Test;
+  friend class ::SamplerBench;
   // FRIEND_TEST(SamplerTest, IndexTest);
 
   struct SampleCache {
-    uint8_t *bitrange = nullptr;
-    size_t size;
+    // valid window origins, row-major over nCols x nRows
+    SampleMap map;
 
     size_t nOK;
 
     size_t nRows;
     size_t nCols;
+
+    // zlib deflated per-window quality, nRows x nCols bytes of
+    // floor(255 * valid fraction). Only filled by computeCacheEntry, sampling
+    // loads it on demand through getQualityMap.
+    std::vector<uint8_t> qualityMap;
   };
 
-  inline void freeSampleCache(SampleCache &cache) {
-    if (cache.bitrange) {
-      free(cache.bitrange);
-      cache.bitrange = nullptr;
-    }
-  }
+  inline void freeSampleCache(SampleCache &cache) { cache.map = SampleMap(); }
 
   struct NormalizationPercentile {
     float lower; // 1st
@@ -112,36 +277,159 @@ private:
 
     size_t maxDimX, maxDimY;
 
+    ProductFiles files;
+
     // std::optional<SampleCache> cache;
   };
 
   static std::string getDSPath(const SampleInfo &info,
                                const std::string &flavor);
 
-  std::pair<std::vector<NormalizationPercentile>, std::optional<std::string>>
-  getNormalizationPercentiles(const SampleInfo &info);
-
   std::vector<SampleInfo> infos;
 
+  void shardProducts(size_t rank, size_t worldSize);
+
   size_t computeSampleIndex(size_t okIndex, const SampleCache &cache);
 
+  inline bool sampleOK(const SampleCache &cache, size_t col, size_t row) const {
+    return cache.map.test(row * cache.nCols + col);
+  }
+
+  std::vector<size_t> epochProducts(const EpochOptions &options) const;
+
+  // Draws a sub-cell offset (in full resolution pixels, < scalingFactor) for
+  // the window at map cell (col, row), see SampleOptions::jitter.
+  std::pair<size_t, size_t> jitterWindow(const SampleCache &cache,
+                                         size_t scalingFactor, size_t col,
+                                         size_t row) const;
+
+  std::optional<Sample> readSample(const SampleInfo &info,
+                                   const ComputationCache &cache,
+                                   size_t sampleIndexX, size_t sampleIndexY);
+
+  // CRS and geotransform of the first flavor's dataset, the full resolution
+  // grid windows are read on
+  struct Georef {
+    std::string crs;
+    double geoTransform[6];
+  };
+
+  // Reads the window at (x, y) of every flavor as raw uint16 bands, (nBands,
+  // sampleDim, sampleDim). Returns the number of bands, 0 on failure. When
+  // `georef` is set it is filled from the first flavor's dataset, sparing
+  // callers another open.
+  size_t readRawWindow(const SampleInfo &info, size_t x, size_t y,
+                       RawBuffer *bands, Georef *georef = nullptr);
+
+  // a slot per sample in flight, reused batch after batch
+  std::shared_ptr<SlabPool> slabs;
+
   // omp_lock_t sqlWriteLock;
   std::vector<sqlite3 *> connectionPool;
+  // dedicated to the CacheWriter thread
+  sqlite3 *writerConnection = nullptr;
   std::optional<std::string> setupSQLCache();
 
+  // Prepared once per connection by setupSQLCache and reset after each use
+  struct CachedStatements {
+    sqlite3_stmt *getEntry = nullptr;
+    sqlite3_stmt *getQualityMap = nullptr;
+    sqlite3_stmt *writeEntry = nullptr;
+  };
+  std::unordered_map<sqlite3 *, CachedStatements> statementCache;
+
   std::optional<std::string> getCacheEntry(sqlite3 *conn,
                                            const SampleInfo &info,
                                            ComputationCache *cache,
                                            bool *oCachePresent);
   std::optional<std::string> writeCacheEntry(sqlite3 *conn,
                                              const ComputationCache &cache);
+  std::optional<std::string> getQualityMap(sqlite3 *conn,
+                                           const SampleInfo &info,
+                                           std::vector<uint8_t> *qualityMap);
+
+  static constexpr int cacheSchemaVersion = 4;
+
+  // Replaces cache's map with the minQuality view, built once per
+  // product and memoized.
+  std::optional<std::string> applyQualityThreshold(sqlite3 *conn,
+                                                   const SampleInfo &info,
+                                                   SampleCache *cache);
+  std::mutex thresholdedMapsLock;
+  std::unordered_map<std::string, SampleCache> thresholdedMaps;
 
   bool cacheValid(const SampleInfo &info, const ComputationCache &cache);
 
+  // Queues missing or stale entries and generates them, or leaves them in
+  // backgroundQueue for startBackgroundCache
   std::optional<std::string> ensureCache();
+  std::optional<std::string> cacheError;
+
+  std::optional<std::string> generateCache(std::vector<SampleInfo *> queue);
+
+  std::vector<SampleInfo *> backgroundQueue;
+  std::unique_ptr<std::thread> backgroundThread;
+  std::atomic<bool> stopBackgroundCache = false;
+  void startBackgroundCache();
+
+  // Indices into infos of the products with a committed cache entry, in
+  // commit order. Sized to infos once and appended to under readyLock; the
+  // first nReady entries never change, so samplers read them without the
+  // lock while generation keeps appending.
+  std::vector<size_t> readyProducts;
+  std::atomic<size_t> nReady = 0;
+  bool backgroundRunning = false;
+  mutable std::mutex readyLock;
+  std::condition_variable readyCv;
+
+  void markReady(const std::vector<size_t> &products);
+  size_t readyCount() const { return nReady.load(std::memory_order_acquire); }
+
+  // pthread_atfork handlers. A forked child (e.g. a DataLoader worker) has
+  // none of the parent's threads: the child drops the background pass it
+  // inherited instead of waiting on or joining it.
+  static void prepareFork();
+  static void parentAfterFork();
+  static void childAfterFork();
+
+  // waitForCoverage on a product count
+  bool waitForReady(size_t nProducts,
+                    std::optional<std::chrono::milliseconds> timeout);
+
+  // Everything computeCacheEntry needs from disk, read by the I/O stage of
+  // ensureCache so the compute stage never touches GDAL.
+  struct CacheInputs {
+    size_t nCols, nRows;
+    size_t nMaskBands;
+
+    // true: mask is the joined nCols x nRows mask from satsample_mapgen,
+    // false: mask holds all nMaskBands raw MSK planes
+    bool precomputed = false;
+    std::vector<uint8_t> mask;
+
+    struct PercentileInput {
+      // SATS_PERCENTILE_* metadata, raw is left empty when present
+      std::optional<NormalizationPercentile> stored;
+      std::vector<uint16_t> raw;
+    };
+    // every HIRES then LOWRES band
+    std::vector<PercentileInput> bands;
+
+    size_t maxDimX, maxDimY;
+  };
+
+  std::optional<std::string> readCacheInputs(const SampleInfo &info,
+                                             CacheInputs *inputs);
+
+  std::pair<std::optional<ComputationCache>, std::string>
+  computeCacheEntry(const SampleInfo &info, CacheInputs &&inputs);
 
-  std::pair<std::optional<SampleCache>, std::string>
-  genSampleCache(const SampleInfo &info, SampleCacheGenOptions genOptions);
+  // Run-length encodes a finished nCols x nRows sample map and deflates its
+  // quality map.
+  // Takes ownership of (and frees) both buffers.
+  static std::pair<std::optional<SampleCache>, std::string>
+  finishSampleCache(uint8_t *stage, uint8_t *quality, size_t nCols,
+                    size_t nRows);
 
 public:
   bool preproc;
@@ -0,0 +1,160 @@
+#include "slabPool.h"
+
+#include <cstdint>
+#include <cstring>
+
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace sats {
+
+static constexpr size_t hugePageBytes = 2 << 20;
+
+// power of two class of `bytes`, 0 being minSlotBytes
+static size_t classOf(size_t bytes) {
+  size_t slotBytes = SlabPool::minSlotBytes;
+  size_t index = 0;
+  while (slotBytes < bytes) {
+    slotBytes <<= 1;
+    index++;
+  }
+  return index;
+}
+
+static size_t classBytes(size_t index) {
+  return SlabPool::minSlotBytes << index;
+}
+
+SlabPool::SlabPool(Options options) : options(options) {}
+
+SlabPool::~SlabPool() {
+  for (const auto &[addr, length] : mappings) {
+    munmap(addr, length);
+  }
+}
+
+size_t SlabPool::currentNode() const {
+  if (!options.numaLocal) {
+    return 0;
+  }
+
+  unsigned cpu = 0, node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+    return 0;
+  }
+  return node;
+}
+
+void *SlabPool::mapSlot(size_t slotBytes) {
+  const bool huge = options.hugePages && slotBytes >= hugePageBytes;
+  // mmap only guarantees page alignment, huge pages need 2 MiB
+  const size_t length = huge ? slotBytes + hugePageBytes : slotBytes;
+
+  void *addr = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+
+  uint8_t *slot = (uint8_t *)addr;
+  if (huge) {
+    uintptr_t aligned =
+        ((uintptr_t)addr + hugePageBytes - 1) & ~(hugePageBytes - 1);
+    slot = (uint8_t *)aligned;
+
+    // give back the unaligned head and the tail
+    size_t head = slot - (uint8_t *)addr;
+    if (head) {
+      munmap(addr, head);
+    }
+    size_t tail = length - head - slotBytes;
+    if (tail) {
+      munmap(slot + slotBytes, tail);
+    }
+
+    madvise(slot, slotBytes, MADV_HUGEPAGE);
+  }
+
+  if (options.numaLocal) {
+    // overrides an inherited policy such as numactl --interleave, then
+    // faults the pages in on this thread's node
+    syscall(SYS_mbind, slot, slotBytes, MPOL_LOCAL, nullptr, 0, 0);
+    memset(slot, 0, slotBytes);
+  }
+
+  std::lock_guard<std::mutex> guard(mappingsLock);
+  mappings.emplace_back(slot, slotBytes);
+
+  return slot;
+}
+
+void *SlabPool::allocate(size_t bytes) {
+  const size_t index = classOf(bytes);
+  if (index >= nClasses) {
+    throw std::bad_alloc();
+  }
+
+  SizeClass &sizeClass = classes[index];
+  const size_t node = currentNode();
+
+  void *slot = nullptr;
+  {
+    std::lock_guard<std::mutex> guard(sizeClass.lock);
+    if (node < sizeClass.free.size() && !sizeClass.free[node].empty()) {
+      slot = sizeClass.free[node].back();
+      sizeClass.free[node].pop_back();
+    } else {
+      // any node's slot beats a new mapping
+      for (auto &free : sizeClass.free) {
+        if (!free.empty()) {
+          slot = free.back();
+          free.pop_back();
+          break;
+        }
+      }
+    }
+  }
+
+  if (!slot) {
+    slot = mapSlot(classBytes(index));
+
+    std::lock_guard<std::mutex> guard(sizeClass.lock);
+    sizeClass.slotNode[slot] = node;
+  }
+
+  slotsInUse.fetch_add(1, std::memory_order_relaxed);
+
+  return slot;
+}
+
+void SlabPool::deallocate(void *slot, size_t bytes) {
+  SizeClass &sizeClass = classes[classOf(bytes)];
+
+  {
+    std::lock_guard<std::mutex> guard(sizeClass.lock);
+    size_t node = sizeClass.slotNode[slot];
+    if (node >= sizeClass.free.size()) {
+      sizeClass.free.resize(node + 1);
+    }
+    sizeClass.free[node].push_back(slot);
+  }
+
+  slotsInUse.fetch_sub(1, std::memory_order_relaxed);
+}
+
+SlabPool::Stats SlabPool::stats() const {
+  std::lock_guard<std::mutex> guard(mappingsLock);
+
+  Stats stats = {
+      .mappedBytes = 0,
+      .slotsInUse = slotsInUse.load(std::memory_order_relaxed),
+  };
+  for (const auto &mapping : mappings) {
+    stats.mappedBytes += mapping.second;
+  }
+  return stats;
+}
+
+} // namespace sats
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+namespace sats {
+
+// Recycles large buffers in fixed size slots instead of returning them to
+// malloc, which hands allocations this size straight to mmap / munmap and
+// page faults every one of them in again. Slot sizes are powers of two from
+// minSlotBytes up; a batch's sample buffers are all the same size, so after
+// the first batch every request is served from the free lists.
+//
+// Slots are mapped one at a time and never unmapped before the pool goes.
+class SlabPool {
+public:
+  struct Options {
+    // madvise(MADV_HUGEPAGE) slots of 2 MiB and up, aligned so transparent
+    // huge pages can back them
+    bool hugePages = false;
+
+    // Keep free slots per NUMA node and hand out the ones on the caller's
+    // node. New slots are bound MPOL_LOCAL and faulted in by the allocating
+    // thread.
+    bool numaLocal = false;
+  };
+
+  static constexpr size_t minSlotBytes = 64 << 10;
+
+  SlabPool(const SlabPool &) = delete;
+  SlabPool &operator=(const SlabPool &) = delete;
+
+  explicit SlabPool(Options options);
+
+  // Unmaps every slot, none may be in use
+  virtual ~SlabPool();
+
+  // A slot of at least `bytes` (>= minSlotBytes), std::bad_alloc if the
+  // pool can't grow
+  void *allocate(size_t bytes);
+  void deallocate(void *slot, size_t bytes);
+
+  struct Stats {
+    size_t mappedBytes;
+    size_t slotsInUse;
+  };
+  Stats stats() const;
+
+private:
+  struct SizeClass {
+    std::mutex lock;
+    // free slots by NUMA node, a single list without numaLocal
+    std::vector<std::vector<void *>> free;
+    std::unordered_map<void *, size_t> slotNode;
+  };
+
+  // largest class, 2^(16 + nClasses - 1) = 1 GiB
+  static constexpr size_t nClasses = 15;
+
+  void *mapSlot(size_t slotBytes);
+  size_t currentNode() const;
+
+  Options options;
+  SizeClass classes[nClasses];
+
+  mutable std::mutex mappingsLock;
+  std::vector<std::pair<void *, size_t>> mappings;
+  std::atomic<size_t> slotsInUse = 0;
+};
+
+// std::allocator for containers whose large buffers should come from a
+// SlabPool. Requests below SlabPool::minSlotBytes and default constructed
+// allocators use the heap. Holds a reference to the pool so buffers may
+// outlive whoever created it.
+template <typename T> struct SlabAllocator {
+  using value_type = T;
+  using propagate_on_container_copy_assignment = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  std::shared_ptr<SlabPool> pool;
+
+  SlabAllocator() = default;
+  SlabAllocator(std::shared_ptr<SlabPool> pool) : pool(std::move(pool)) {}
+  template <typename U>
+  SlabAllocator(const SlabAllocator<U> &other) : pool(other.pool) {}
+
+  T *allocate(size_t n) {
+    if (pooled(n)) {
+      return (T *)pool->allocate(n * sizeof(T));
+    }
+    return std::allocator<T>().allocate(n);
+  }
+
+  void deallocate(T *p, size_t n) {
+    if (pooled(n)) {
+      pool->deallocate(p, n * sizeof(T));
+      return;
+    }
+    std::allocator<T>().deallocate(p, n);
+  }
+
+  template <typename U>
+  bool operator==(const SlabAllocator<U> &other) const {
+    return pool == other.pool;
+  }
+
+private:
+  bool pooled(size_t n) const {
+    return pool && n * sizeof(T) >= SlabPool::minSlotBytes;
+  }
+};
+
+} // namespace sats
@@ -0,0 +1,96 @@
+#include "taskPool.h"
+
+#include <algorithm>
+
+namespace sats {
+
+TaskPool::TaskPool(size_t nThreads) {
+  nThreads = std::max(nThreads, (size_t)1);
+
+  for (size_t i = 0; i < nThreads; i++) {
+    workers.push_back(std::make_unique<Worker>());
+  }
+
+  for (size_t i = 0; i < nThreads; i++) {
+    threads.emplace_back(&TaskPool::run, this, i);
+  }
+}
+
+TaskPool::~TaskPool() {
+  {
+    std::lock_guard guard(stateLock);
+    stopping = true;
+  }
+  workCv.notify_all();
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+void TaskPool::submit(Task task) {
+  Worker &worker = *workers[nextWorker++ % workers.size()];
+  {
+    // counted before it is visible, a worker may take and finish it at once
+    std::lock_guard stateGuard(stateLock);
+    nQueued++;
+    nPending++;
+
+    std::lock_guard guard(worker.lock);
+    worker.tasks.push_back(std::move(task));
+  }
+  workCv.notify_one();
+}
+
+void TaskPool::wait() {
+  std::unique_lock guard(stateLock);
+  idleCv.wait(guard, [&]() { return nPending == 0; });
+}
+
+std::optional<TaskPool::Task> TaskPool::take(size_t self) {
+  for (size_t i = 0; i < workers.size(); i++) {
+    Worker &worker = *workers[(self + i) % workers.size()];
+    std::lock_guard guard(worker.lock);
+
+    if (worker.tasks.empty()) {
+      continue;
+    }
+
+    // own work in submit order, stolen work from the far end
+    Task task;
+    if (i == 0) {
+      task = std::move(worker.tasks.front());
+      worker.tasks.pop_front();
+    } else {
+      task = std::move(worker.tasks.back());
+      worker.tasks.pop_back();
+    }
+
+    nQueued--;
+    return task;
+  }
+
+  return std::nullopt;
+}
+
+void TaskPool::run(size_t self) {
+  while (true) {
+    if (auto task = take(self)) {
+      (*task)();
+
+      std::lock_guard guard(stateLock);
+      if (--nPending == 0) {
+        idleCv.notify_all();
+      }
+      continue;
+    }
+
+    std::unique_lock guard(stateLock);
+    workCv.wait(guard, [&]() { return stopping || nQueued > 0; });
+    if (stopping && nQueued == 0) {
+      return;
+    }
+  }
+}
+
+} // namespace sats
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace sats {
+
+// Fixed set of worker threads with a task deque each. Workers run their own
+// deque front to back and steal from the back of the others once it is
+// empty, so a few long tasks at the end don't leave the rest of the pool
+// idle. Independent of OpenMP, so sizing a pool never touches the process
+// wide OpenMP thread count.
+class TaskPool {
+public:
+  using Task = std::function<void()>;
+
+  TaskPool() = delete;
+  TaskPool(const TaskPool &) = delete;
+  TaskPool &operator=(const TaskPool &) = delete;
+
+  explicit TaskPool(size_t nThreads);
+
+  // Finishes every queued task, then joins the workers
+  virtual ~TaskPool();
+
+  // Queues `task` on the workers round robin. Submitting in priority order
+  // gives every worker the most important tasks first.
+  void submit(Task task);
+
+  // Blocks until every task submitted so far has run
+  void wait();
+
+  size_t size() const { return threads.size(); }
+
+private:
+  struct Worker {
+    std::mutex lock;
+    std::deque<Task> tasks;
+  };
+
+  std::optional<Task> take(size_t self);
+  void run(size_t self);
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::thread> threads;
+  std::atomic<size_t> nextWorker = 0;
+
+  // queued = sitting in a deque, pending = queued or running
+  std::mutex stateLock;
+  std::condition_variable workCv;
+  std::condition_variable idleCv;
+  std::atomic<size_t> nQueued = 0;
+  size_t nPending = 0;
+  bool stopping = false;
+};
+
+} // namespace sats
@@ -0,0 +1,199 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <format>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <unistd.h>
+#include <vector>
+
+namespace sats::trace {
+
+static uint64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Slots are guarded by a sequence number instead of a lock: the owner sets
+// seq odd while writing event `i` and to 2 * i + 2 once done, a reader keeps
+// a slot only if seq matched before and after copying it.
+struct Event {
+  std::atomic<uint64_t> seq = 0;
+  std::atomic<const char *> name = nullptr;
+  std::atomic<const char *> category = nullptr;
+  std::atomic<uint64_t> startNs = 0;
+  std::atomic<uint64_t> durNs = 0;
+  std::atomic<int64_t> arg = 0;
+};
+
+struct Ring {
+  Ring(size_t capacity, size_t id)
+      : events(std::make_unique<Event[]>(capacity)), capacity(capacity),
+        id(id) {}
+
+  std::unique_ptr<Event[]> events;
+  size_t capacity;
+  size_t id; // tid in the trace
+
+  // events ever written, only advanced by the owning thread
+  std::atomic<uint64_t> head = 0;
+};
+
+// Rings of exited threads are handed to new threads, like metrics slots
+static std::mutex registryLock;
+static std::vector<std::unique_ptr<Ring>> rings;
+static std::vector<Ring *> freeRings;
+
+static std::atomic<bool> recording = false;
+static std::atomic<size_t> ringCapacity = 1 << 14;
+static std::atomic<uint64_t> startedAt = 0;
+
+static Ring *acquireRing() {
+  std::lock_guard<std::mutex> guard(registryLock);
+
+  if (!freeRings.empty()) {
+    Ring *ring = freeRings.back();
+    freeRings.pop_back();
+    return ring;
+  }
+
+  size_t capacity = std::max(ringCapacity.load(), (size_t)1);
+  return rings.emplace_back(std::make_unique<Ring>(capacity, rings.size()))
+      .get();
+}
+
+static void releaseRing(Ring *ring) {
+  std::lock_guard<std::mutex> guard(registryLock);
+  freeRings.push_back(ring);
+}
+
+static Ring &local() {
+  struct Handle {
+    Ring *ring = acquireRing();
+    ~Handle() { releaseRing(ring); }
+  };
+
+  thread_local Handle handle;
+  return *handle.ring;
+}
+
+void start(size_t eventsPerThread) {
+  ringCapacity = eventsPerThread;
+  startedAt = nowNs();
+  recording = true;
+}
+
+void stop() { recording = false; }
+
+bool active() { return recording.load(std::memory_order_relaxed); }
+
+Scope::Scope(const char *name, const char *category, int64_t arg)
+    : name(name), category(category), arg(arg), recording(active()),
+      startNs(recording ? nowNs() : 0) {}
+
+Scope::~Scope() {
+  if (!recording) {
+    return;
+  }
+
+  uint64_t endNs = nowNs();
+
+  Ring &ring = local();
+  uint64_t index = ring.head.load(std::memory_order_relaxed);
+  Event &event = ring.events[index % ring.capacity];
+
+  event.seq.store(2 * index + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  event.name.store(name, std::memory_order_relaxed);
+  event.category.store(category, std::memory_order_relaxed);
+  event.startNs.store(startNs, std::memory_order_relaxed);
+  event.durNs.store(endNs - startNs, std::memory_order_relaxed);
+  event.arg.store(arg, std::memory_order_relaxed);
+
+  event.seq.store(2 * index + 2, std::memory_order_release);
+  ring.head.store(index + 1, std::memory_order_release);
+}
+
+std::optional<std::string> dump(const std::filesystem::path &path) {
+  std::FILE *file = std::fopen(path.c_str(), "w");
+  if (!file) {
+    return std::format("failed to open {} for writing", path.string());
+  }
+
+  const uint64_t since = startedAt.load();
+  const int pid = getpid();
+
+  std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  bool first = true;
+  auto append = [&](const std::string &event) {
+    if (!first) {
+      out += ",\n";
+    }
+    out += event;
+    first = false;
+  };
+
+  size_t nEvents = 0;
+  {
+    std::lock_guard<std::mutex> guard(registryLock);
+
+    for (const auto &ring : rings) {
+      append(std::format("{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":{},"
+                         "\"tid\":{},\"args\":{{\"name\":\"thread {}\"}}}}",
+                         pid, ring->id, ring->id));
+
+      uint64_t head = ring->head.load(std::memory_order_acquire);
+      uint64_t begin = head > ring->capacity ? head - ring->capacity : 0;
+
+      for (uint64_t i = begin; i < head; i++) {
+        const Event &event = ring->events[i % ring->capacity];
+
+        uint64_t seq = event.seq.load(std::memory_order_acquire);
+        if (seq != 2 * i + 2) {
+          continue; // overwritten since head was read
+        }
+
+        const char *name = event.name.load(std::memory_order_relaxed);
+        const char *category = event.category.load(std::memory_order_relaxed);
+        uint64_t startNs = event.startNs.load(std::memory_order_relaxed);
+        uint64_t durNs = event.durNs.load(std::memory_order_relaxed);
+        int64_t arg = event.arg.load(std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (event.seq.load(std::memory_order_relaxed) != seq ||
+            startNs < since) {
+          continue;
+        }
+
+        append(std::format(
+            "{{\"name\":\"{}\",\"cat\":\"{}\",\"ph\":\"X\",\"pid\":{},"
+            "\"tid\":{},\"ts\":{:.3f},\"dur\":{:.3f},\"args\":{{\"arg\":{}}}}}",
+            name, category, pid, ring->id, (startNs - since) / 1e3,
+            durNs / 1e3, arg));
+        nEvents++;
+      }
+    }
+  }
+
+  out += "\n]}\n";
+
+  bool ok = std::fwrite(out.data(), 1, out.size(), file) == out.size();
+  ok = std::fclose(file) == 0 && ok;
+  if (!ok) {
+    return std::format("failed to write {}", path.string());
+  }
+
+  std::cout << std::format("trace: {} events written to {}", nEvents,
+                           path.string())
+            << std::endl;
+
+  return std::nullopt;
+}
+
+} // namespace sats::trace
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+
+namespace sats::trace {
+
+// Optional timeline of what every thread was doing, dumped as Chrome trace
+// JSON (chrome://tracing, ui.perfetto.dev). Each thread records into its own
+// ring buffer without locks; once a ring is full the oldest events are
+// overwritten. Off until start().
+
+// Starts (or restarts) recording. Rings created from now on hold
+// `eventsPerThread` events, existing ones keep their size. Events from
+// before the call are not dumped.
+void start(size_t eventsPerThread = 1 << 14);
+
+// Stops recording, the rings keep their events for dump()
+void stop();
+
+bool active();
+
+// Writes the events recorded since the last start() as Chrome trace JSON.
+// Safe while threads are still recording, events being written are skipped.
+std::optional<std::string> dump(const std::filesystem::path &path);
+
+// Records the lifetime of the scope as one complete ("X") event. `name` and
+// `category` must outlive the dump, i.e. be string literals. `arg` shows up
+// as args.arg, e.g. a sample or product index.
+class Scope {
+public:
+  Scope(const char *name, const char *category, int64_t arg = -1);
+
+  Scope(const Scope &) = delete;
+  Scope &operator=(const Scope &) = delete;
+
+  ~Scope();
+
+private:
+  const char *name;
+  const char *category;
+  int64_t arg;
+  bool recording;
+  uint64_t startNs;
+};
+
+} // namespace sats::trace
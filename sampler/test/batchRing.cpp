@@ -0,0 +1,167 @@
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "batchRing.h"
+
+using sats::BatchRing;
+
+namespace {
+
+class BatchRingTest : public testing::Test {
+protected:
+  void SetUp() override {
+    name = "satsample-test-" + std::to_string(getpid());
+    auto [created, err] = BatchRing::create(
+        name, BatchRing::Shape{
+                  .nSlots = 3, .batchSize = 2, .nChannels = 5, .dim = 4});
+    ASSERT_TRUE(created) << err.value_or("");
+    ring = std::move(created);
+  }
+
+  std::string name;
+  std::unique_ptr<BatchRing> ring;
+};
+
+} // namespace
+
+TEST_F(BatchRingTest, RejectsEmptyShape) {
+  auto [created, err] = BatchRing::create(
+      name + "-empty",
+      BatchRing::Shape{.nSlots = 3, .batchSize = 0, .nChannels = 5, .dim = 4});
+  EXPECT_FALSE(created);
+  EXPECT_TRUE(err);
+}
+
+TEST_F(BatchRingTest, FreeSlotsRunOut) {
+  std::vector<size_t> slots;
+  for (size_t i = 0; i < 3; i++) {
+    auto slot = ring->acquireFree(0);
+    ASSERT_TRUE(slot);
+    slots.push_back(*slot);
+  }
+  EXPECT_NE(slots[0], slots[1]);
+  EXPECT_NE(slots[1], slots[2]);
+  EXPECT_NE(slots[0], slots[2]);
+
+  EXPECT_FALSE(ring->acquireFree(0));
+  EXPECT_FALSE(ring->acquireReady(0));
+}
+
+TEST_F(BatchRingTest, PublishAcquireRelease) {
+  auto slot = ring->acquireFree(0);
+  ASSERT_TRUE(slot);
+
+  ring->bands(*slot)[0] = 1.5f;
+  ring->labels(*slot)[ring->labelsPerSlot() - 1] = 7.0f;
+  ring->publish(*slot, 2);
+
+  // another process sees the same memory
+  auto [attached, err] = BatchRing::attach(name);
+  ASSERT_TRUE(attached) << err.value_or("");
+  EXPECT_EQ(attached->getShape().nSlots, 3);
+  EXPECT_EQ(attached->bandsPerSlot(), 2 * 5 * 4 * 4);
+
+  auto ready = attached->acquireReady(0);
+  ASSERT_EQ(ready, slot);
+  EXPECT_EQ(attached->validCount(*ready), 2);
+  EXPECT_EQ(attached->bands(*ready)[0], 1.5f);
+  EXPECT_EQ(attached->labels(*ready)[attached->labelsPerSlot() - 1], 7.0f);
+
+  // claimed, so neither consumer gets it again
+  EXPECT_FALSE(ring->acquireReady(0));
+  EXPECT_FALSE(ring->acquire(*slot, 0));
+
+  attached->release(*ready);
+  for (size_t i = 0; i < 3; i++) {
+    EXPECT_TRUE(ring->acquireFree(0));
+  }
+}
+
+TEST_F(BatchRingTest, ReadyInPublishOrder) {
+  auto a = ring->acquireFree(0);
+  auto b = ring->acquireFree(0);
+  auto c = ring->acquireFree(0);
+  ASSERT_TRUE(a && b && c);
+
+  ring->publish(*c, 1);
+  ring->publish(*a, 1);
+  ring->publish(*b, 1);
+
+  EXPECT_EQ(ring->acquireReady(0), c);
+  EXPECT_EQ(ring->acquireReady(0), a);
+  EXPECT_EQ(ring->acquireReady(0), b);
+}
+
+TEST_F(BatchRingTest, AcquireSpecificSlot) {
+  auto a = ring->acquireFree(0);
+  auto b = ring->acquireFree(0);
+  ASSERT_TRUE(a && b);
+
+  EXPECT_FALSE(ring->acquire(*b, 0));
+  EXPECT_FALSE(ring->acquire(3, 0));
+
+  ring->publish(*a, 1);
+  ring->publish(*b, 1);
+  EXPECT_TRUE(ring->acquire(*b, 0));
+  EXPECT_EQ(ring->acquireReady(0), a);
+}
+
+TEST_F(BatchRingTest, AbandonFreesTheSlot) {
+  std::vector<size_t> slots;
+  for (size_t i = 0; i < 3; i++) {
+    slots.push_back(ring->acquireFree(0).value());
+  }
+
+  ring->abandon(slots[1]);
+  EXPECT_FALSE(ring->acquireReady(0));
+  EXPECT_EQ(ring->acquireFree(0), slots[1]);
+
+  // only FILLING slots can be abandoned
+  ring->publish(slots[0], 1);
+  ring->abandon(slots[0]);
+  EXPECT_EQ(ring->acquireReady(0), slots[0]);
+}
+
+TEST_F(BatchRingTest, ReclaimDead) {
+  // a live owner keeps its slot
+  auto mine = ring->acquireFree(0);
+  ASSERT_TRUE(mine);
+  EXPECT_EQ(ring->reclaimDead(), 0);
+
+  // a child claims one slot for filling and one for consuming, then dies
+  auto ready = ring->acquireFree(0);
+  ASSERT_TRUE(ready);
+  ring->publish(*ready, 1);
+
+  pid_t pid = fork();
+  ASSERT_GE(pid, 0);
+  if (pid == 0) {
+    auto [attached, err] = BatchRing::attach(name);
+    bool ok = attached && attached->acquireFree(0) && attached->acquireReady(0);
+    _exit(ok ? 0 : 1);
+  }
+
+  int status = 0;
+  ASSERT_EQ(waitpid(pid, &status, 0), pid);
+  ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  EXPECT_FALSE(ring->acquireFree(0));
+  EXPECT_EQ(ring->reclaimDead(), 2);
+  EXPECT_EQ(ring->reclaimDead(), 0);
+
+  EXPECT_TRUE(ring->acquireFree(0));
+  EXPECT_TRUE(ring->acquireFree(0));
+  EXPECT_FALSE(ring->acquireFree(0));
+}
+
+TEST_F(BatchRingTest, AttachRejectsMissingSegment) {
+  auto [attached, err] = BatchRing::attach(name + "-missing");
+  EXPECT_FALSE(attached);
+  EXPECT_TRUE(err);
+}
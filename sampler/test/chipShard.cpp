@@ -0,0 +1,197 @@
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "chipShard.h"
+
+using sats::ShardSampler;
+using sats::ShardWriter;
+namespace shard = sats::shard;
+
+namespace {
+
+struct Chip {
+  size_t product;
+  std::vector<uint16_t> bands;
+  std::vector<uint8_t> labels;
+};
+
+static shard::ShardProduct makeProduct(const char *name, size_t nBands,
+                                       float offset) {
+  shard::ShardProduct product = {};
+  strncpy(product.name, name, sizeof(product.name) - 1);
+  product.year = 2022;
+  product.month = 7;
+  product.day = 14;
+  product.nBands = nBands;
+  for (size_t b = 0; b < nBands; b++) {
+    product.lower[b] = offset + 100 * b;
+    product.upper[b] = offset + 100 * b + 4000;
+  }
+  return product;
+}
+
+class ChipShardTest : public testing::Test {
+protected:
+  static constexpr size_t nBands = 4;
+  static constexpr size_t dim = 8;
+  static constexpr size_t pixels = dim * dim;
+
+  void SetUp() override {
+    dir = std::filesystem::temp_directory_path() /
+          ("satsample-shard-" + std::to_string(getpid()));
+    std::filesystem::remove_all(dir);
+
+    products = {makeProduct("A", nBands, 0), makeProduct("B", nBands, 250)};
+
+    std::mt19937 rng(3);
+    std::uniform_int_distribution<int> reflectance(0, 6000);
+    std::uniform_int_distribution<int> label(0, 255);
+    for (size_t i = 0; i < 7; i++) {
+      Chip chip{.product = i < 4 ? 0u : 1u,
+                .bands = std::vector<uint16_t>(nBands * pixels),
+                .labels = std::vector<uint8_t>(pixels)};
+      for (auto &v : chip.bands) {
+        v = reflectance(rng);
+      }
+      for (auto &v : chip.labels) {
+        v = label(rng);
+      }
+      chips.push_back(std::move(chip));
+    }
+    // a 0/0 ndvi pixel
+    chips[0].bands[shard::redBand * pixels] = 0;
+    chips[0].bands[shard::nirBand * pixels] = 0;
+  }
+
+  void TearDown() override { std::filesystem::remove_all(dir); }
+
+  void writeShards(bool ndvi, size_t chipsPerShard) {
+    auto [writer, err] = ShardWriter::create(
+        dir, ShardWriter::Shape{.nBands = nBands, .dim = dim, .ndvi = ndvi},
+        chipsPerShard);
+    ASSERT_TRUE(writer) << err.value_or("");
+
+    for (size_t i = 0; i < chips.size(); i++) {
+      auto err = writer->addChip(products[chips[i].product], i, 2 * i,
+                                 chips[i].bands.data(),
+                                 chips[i].labels.data());
+      ASSERT_FALSE(err) << err.value();
+    }
+
+    auto closeErr = writer->close();
+    ASSERT_FALSE(closeErr) << closeErr.value();
+    EXPECT_EQ(writer->chipsWritten(), chips.size());
+    EXPECT_EQ(writer->shardsWritten(),
+              (chips.size() + chipsPerShard - 1) / chipsPerShard);
+  }
+
+  // every chip read back in write order matches its normalized source
+  void expectRoundTrip(float ndviTolerance) {
+    auto [sampler, err] = ShardSampler::open(dir);
+    ASSERT_TRUE(sampler) << err.value_or("");
+    ASSERT_EQ(sampler->size(), chips.size());
+    ASSERT_EQ(sampler->getSampleDim(), dim);
+    ASSERT_EQ(sampler->getNChannels(), nBands + 1);
+
+    std::vector<size_t> indices(chips.size());
+    for (size_t i = 0; i < indices.size(); i++) {
+      indices[i] = i;
+    }
+
+    std::vector<float> bands(chips.size() * (nBands + 1) * pixels);
+    std::vector<float> labels(chips.size() * pixels);
+    auto readErr = sampler->readChips(indices, bands.data(), labels.data());
+    ASSERT_FALSE(readErr) << readErr.value();
+
+    for (size_t i = 0; i < chips.size(); i++) {
+      const Chip &chip = chips[i];
+      const auto &product = products[chip.product];
+      const float *out = bands.data() + i * (nBands + 1) * pixels;
+
+      for (size_t b = 0; b < nBands; b++) {
+        for (size_t j = 0; j < pixels; j++) {
+          float expected = (chip.bands[b * pixels + j] - product.lower[b]) /
+                           (product.upper[b] - product.lower[b]);
+          ASSERT_NEAR(out[b * pixels + j], expected, 1e-5)
+              << "chip " << i << " band " << b << " pixel " << j;
+        }
+      }
+
+      const uint16_t *b4 = chip.bands.data() + shard::redBand * pixels;
+      const uint16_t *b8 = chip.bands.data() + shard::nirBand * pixels;
+      for (size_t j = 0; j < pixels; j++) {
+        float sum = (float)b4[j] + (float)b8[j];
+        float got = out[nBands * pixels + j];
+        if (sum == 0) {
+          EXPECT_TRUE(std::isnan(got)) << "chip " << i << " pixel " << j;
+        } else {
+          ASSERT_NEAR(got, ((float)b8[j] - (float)b4[j]) / sum, ndviTolerance)
+              << "chip " << i << " pixel " << j;
+        }
+      }
+
+      for (size_t j = 0; j < pixels; j++) {
+        ASSERT_EQ(labels[i * pixels + j], chip.labels[j])
+            << "chip " << i << " pixel " << j;
+      }
+    }
+
+    auto rangeErr = sampler->readChips({chips.size()}, bands.data(),
+                                       labels.data());
+    EXPECT_TRUE(rangeErr);
+  }
+
+  std::filesystem::path dir;
+  std::vector<shard::ShardProduct> products;
+  std::vector<Chip> chips;
+};
+
+} // namespace
+
+TEST_F(ChipShardTest, RoundTripStoredNdvi) {
+  writeShards(true, 3);
+  // stored as round(ndvi * ndviScale)
+  expectRoundTrip(0.5f / shard::ndviScale + 1e-6f);
+}
+
+TEST_F(ChipShardTest, RoundTripComputedNdvi) {
+  writeShards(false, 100);
+  expectRoundTrip(1e-6f);
+}
+
+TEST_F(ChipShardTest, RejectsMismatchedBands) {
+  auto [writer, err] = ShardWriter::create(
+      dir, ShardWriter::Shape{.nBands = nBands, .dim = dim, .ndvi = true}, 8);
+  ASSERT_TRUE(writer) << err.value_or("");
+
+  auto product = makeProduct("C", nBands - 1, 0);
+  EXPECT_TRUE(writer->addChip(product, 0, 0, chips[0].bands.data(),
+                              chips[0].labels.data()));
+}
+
+TEST_F(ChipShardTest, UnclosedShardIsRemoved) {
+  {
+    auto [writer, err] = ShardWriter::create(
+        dir, ShardWriter::Shape{.nBands = nBands, .dim = dim, .ndvi = true},
+        8);
+    ASSERT_TRUE(writer) << err.value_or("");
+    ASSERT_FALSE(writer->addChip(products[0], 0, 0, chips[0].bands.data(),
+                                 chips[0].labels.data()));
+  }
+
+  for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+    EXPECT_NE(entry.path().extension(), ".sats") << entry.path();
+  }
+
+  auto [sampler, err] = ShardSampler::open(dir);
+  EXPECT_FALSE(sampler);
+}
@@ -0,0 +1,94 @@
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "cpu/normalize.h"
+#include "cpu/percentile.h"
+
+namespace cpuproc = sats::cpuproc;
+
+TEST(PercentilesU16Test, MatchesSortedPercentiles) {
+  std::mt19937_64 rng(1);
+  std::uniform_int_distribution<int> value(0, 10000);
+
+  for (size_t len : {1, 2, 99, 100, 101, 12345}) {
+    std::vector<uint16_t> data(len);
+    std::vector<float> asFloat(len);
+    for (size_t i = 0; i < len; i++) {
+      data[i] = (uint16_t)value(rng);
+      asFloat[i] = data[i];
+    }
+
+    const std::vector<size_t> wanted = {0, 1, 50, 99};
+    auto expected = cpuproc::percentiles(asFloat.data(), len, wanted);
+    auto actual = cpuproc::percentilesU16(data.data(), len, wanted);
+
+    ASSERT_EQ(actual.size(), expected.size());
+    for (size_t i = 0; i < wanted.size(); i++) {
+      EXPECT_EQ(actual[i], expected[i]) << "len " << len << " p" << wanted[i];
+    }
+  }
+}
+
+TEST(PercentilesU16Test, Constant) {
+  std::vector<uint16_t> data(1000, 42);
+  auto p = cpuproc::percentilesU16(data.data(), data.size(), {1, 99});
+
+  EXPECT_EQ(p[0], 42);
+  EXPECT_EQ(p[1], 42);
+}
+
+TEST(ToHalfTest, Exact) {
+  EXPECT_EQ(cpuproc::toHalf(0.0f).bits, 0x0000);
+  EXPECT_EQ(cpuproc::toHalf(-0.0f).bits, 0x8000);
+  EXPECT_EQ(cpuproc::toHalf(1.0f).bits, 0x3c00);
+  EXPECT_EQ(cpuproc::toHalf(-2.0f).bits, 0xc000);
+  EXPECT_EQ(cpuproc::toHalf(0.5f).bits, 0x3800);
+  EXPECT_EQ(cpuproc::toHalf(65504.0f).bits, 0x7bff); // largest finite
+  EXPECT_EQ(cpuproc::toHalf(std::ldexp(1.0f, -14)).bits, 0x0400);
+  EXPECT_EQ(cpuproc::toHalf(std::ldexp(1.0f, -24)).bits, 0x0001);
+}
+
+TEST(ToHalfTest, RoundsToNearestEven) {
+  // halfway between 1 and the next half, 1 + 2^-10: down to the even 1
+  EXPECT_EQ(cpuproc::toHalf(1.0f + std::ldexp(1.0f, -11)).bits, 0x3c00);
+  // halfway between 1 + 2^-10 and 1 + 2^-9: up to the even one
+  EXPECT_EQ(cpuproc::toHalf(1.0f + 3 * std::ldexp(1.0f, -11)).bits, 0x3c02);
+  // just above halfway rounds up
+  EXPECT_EQ(cpuproc::toHalf(1.0f + std::ldexp(1.0f, -11) +
+                            std::ldexp(1.0f, -20))
+                .bits,
+            0x3c01);
+  // rounds past the largest finite value
+  EXPECT_EQ(cpuproc::toHalf(65520.0f).bits, 0x7c00);
+  // below half the smallest subnormal
+  EXPECT_EQ(cpuproc::toHalf(std::ldexp(1.0f, -26)).bits, 0x0000);
+}
+
+TEST(ToHalfTest, Special) {
+  const float inf = std::numeric_limits<float>::infinity();
+  EXPECT_EQ(cpuproc::toHalf(inf).bits, 0x7c00);
+  EXPECT_EQ(cpuproc::toHalf(-inf).bits, 0xfc00);
+  EXPECT_EQ(cpuproc::toHalf(1e10f).bits, 0x7c00);
+
+  uint16_t nan = cpuproc::toHalf(std::nanf("")).bits;
+  EXPECT_EQ(nan & 0x7c00, 0x7c00);
+  EXPECT_NE(nan & 0x03ff, 0);
+}
+
+TEST(ToBFloat16Test, RoundsToNearestEven) {
+  EXPECT_EQ(cpuproc::toBFloat16(1.0f).bits, 0x3f80);
+  EXPECT_EQ(cpuproc::toBFloat16(-2.0f).bits, 0xc000);
+  // 1 + 2^-8 is halfway between 1 and 1 + 2^-7
+  EXPECT_EQ(cpuproc::toBFloat16(1.0f + std::ldexp(1.0f, -8)).bits, 0x3f80);
+  EXPECT_EQ(cpuproc::toBFloat16(1.0f + 3 * std::ldexp(1.0f, -8)).bits,
+            0x3f82);
+
+  uint16_t nan = cpuproc::toBFloat16(std::nanf("")).bits;
+  EXPECT_EQ(nan & 0x7f80, 0x7f80);
+  EXPECT_NE(nan & 0x007f, 0);
+}
@@ -0,0 +1,194 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "productLayout.h"
+
+using sats::ProductLayout;
+using sats::resolveProductFiles;
+
+namespace {
+
+struct ZipEntry {
+  std::string name;
+  uint16_t method; // 0 stored, 8 deflated
+  std::string data;
+  std::string localExtra = {};
+};
+
+static void put16(std::string &out, uint16_t v) {
+  out.push_back((char)(v & 0xff));
+  out.push_back((char)(v >> 8));
+}
+
+static void put32(std::string &out, uint32_t v) {
+  put16(out, v & 0xffff);
+  put16(out, v >> 16);
+}
+
+// Just enough of the zip format for the central directory walk. Deflated
+// entries carry arbitrary bytes, they are never inflated here; the claimed
+// uncompressed size differs from the stored one like a real deflate would.
+static std::string buildZip(const std::vector<ZipEntry> &entries,
+                            const std::string &comment = "") {
+  std::string out, cd;
+
+  for (const auto &e : entries) {
+    uint32_t offset = out.size();
+    uint32_t size = e.method == 0 ? e.data.size() : e.data.size() * 4;
+
+    put32(out, 0x04034b50);
+    put16(out, 20);
+    put16(out, 0);
+    put16(out, e.method);
+    put32(out, 0); // time, date
+    put32(out, 0); // crc, not checked
+    put32(out, e.data.size());
+    put32(out, size);
+    put16(out, e.name.size());
+    put16(out, e.localExtra.size());
+    out += e.name + e.localExtra + e.data;
+
+    put32(cd, 0x02014b50);
+    put16(cd, 20);
+    put16(cd, 20);
+    put16(cd, 0);
+    put16(cd, e.method);
+    put32(cd, 0);
+    put32(cd, 0);
+    put32(cd, e.data.size());
+    put32(cd, size);
+    put16(cd, e.name.size());
+    put16(cd, 0); // extra
+    put16(cd, 0); // comment
+    put16(cd, 0); // disk
+    put16(cd, 0); // internal attributes
+    put32(cd, 0); // external attributes
+    put32(cd, offset);
+    cd += e.name;
+  }
+
+  uint32_t cdOffset = out.size();
+  out += cd;
+
+  put32(out, 0x06054b50);
+  put16(out, 0);
+  put16(out, 0);
+  put16(out, entries.size());
+  put16(out, entries.size());
+  put32(out, cd.size());
+  put32(out, cdOffset);
+  put16(out, comment.size());
+  out += comment;
+
+  return out;
+}
+
+class ProductLayoutTest : public testing::Test {
+protected:
+  void SetUp() override {
+    dir = std::filesystem::temp_directory_path() /
+          ("satsample-layout-" + std::to_string(getpid()));
+    std::filesystem::create_directories(dir);
+  }
+
+  void TearDown() override { std::filesystem::remove_all(dir); }
+
+  std::filesystem::path write(const std::string &name,
+                              const std::string &bytes) {
+    auto path = dir / name;
+    std::ofstream(path, std::ios::binary) << bytes;
+    return std::filesystem::canonical(path);
+  }
+
+  std::filesystem::path dir;
+};
+
+} // namespace
+
+TEST_F(ProductLayoutTest, StoredEntry) {
+  auto zip = buildZip({
+      {.name = "readme.txt", .method = 0, .data = "skip me"},
+      {.name = "P-HIRES.tif", .method = 0, .data = "0123456789",
+       .localExtra = std::string(7, 'x')},
+  });
+  auto path = write("P.zip", zip);
+
+  auto [files, err] = resolveProductFiles(path, "P");
+  ASSERT_TRUE(files) << err;
+  EXPECT_EQ(files->layout, ProductLayout::STORED_ZIP);
+  EXPECT_EQ(files->size, zip.size());
+  ASSERT_EQ(files->bundles.size(), 1);
+
+  // data starts after the local header, its name and its own extra field
+  size_t dataOffset = zip.find("0123456789");
+  EXPECT_EQ(files->bundle("HIRES"),
+            std::format("/vsisubfile/{}_10,{}", dataOffset, path.string()));
+}
+
+TEST_F(ProductLayoutTest, DeflatedEntry) {
+  auto path = write("P.zip",
+                    buildZip({
+                        {.name = "P-HIRES.tif", .method = 0, .data = "abc"},
+                        {.name = "sub/P-MSK.tif", .method = 8, .data = "xyz"},
+                    }));
+
+  auto [files, err] = resolveProductFiles(path, "P");
+  ASSERT_TRUE(files) << err;
+  EXPECT_EQ(files->layout, ProductLayout::ZIP);
+  EXPECT_EQ(files->bundle("MSK"),
+            "/vsizip/" + path.string() + "/sub/P-MSK.tif");
+  EXPECT_TRUE(files->bundle("HIRES")->starts_with("/vsisubfile/"));
+}
+
+TEST_F(ProductLayoutTest, ArchiveComment) {
+  // a comment that itself looks like the start of an end of central
+  // directory record must not be mistaken for one
+  std::string comment = "PK\x05\x06 not a record";
+  comment += std::string(1000, ' ');
+  auto zip = buildZip({{.name = "P-LOWRES.tif", .method = 0, .data = "lo"}},
+                      comment);
+  auto path = write("P.zip", zip);
+
+  auto [files, err] = resolveProductFiles(path, "P");
+  ASSERT_TRUE(files) << err;
+  EXPECT_EQ(files->layout, ProductLayout::STORED_ZIP);
+  EXPECT_TRUE(files->bundle("LOWRES"));
+}
+
+TEST_F(ProductLayoutTest, Truncated) {
+  auto zip = buildZip({{.name = "P-HIRES.tif", .method = 0, .data = "0123"}});
+
+  // shorter than an end of central directory record
+  for (size_t n : {0, 1, 21}) {
+    auto [files, err] =
+        resolveProductFiles(write("short.zip", zip.substr(0, n)), "P");
+    EXPECT_FALSE(files) << n;
+    EXPECT_NE(err.find("not a zip file"), std::string::npos) << err;
+  }
+
+  // end of central directory record cut off
+  {
+    auto [files, err] = resolveProductFiles(
+        write("cut.zip", zip.substr(0, zip.size() - 10)), "P");
+    EXPECT_FALSE(files);
+    EXPECT_NE(err.find("not a zip file"), std::string::npos) << err;
+  }
+
+  // central directory pointing past the end of the file
+  {
+    std::string broken = zip;
+    broken[broken.size() - 3] = '\x7f'; // high byte of the offset
+    auto [files, err] = resolveProductFiles(write("broken.zip", broken), "P");
+    EXPECT_FALSE(files);
+    EXPECT_NE(err.find("unsupported central directory"), std::string::npos)
+        << err;
+  }
+}
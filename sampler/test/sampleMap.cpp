@@ -0,0 +1,97 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "sampleMap.h"
+
+using sats::SampleMap;
+
+// clear cells with a few long valid stretches, like a real map
+static std::vector<uint8_t> randomMask(size_t n, uint64_t seed) {
+  std::vector<uint8_t> mask(n, 0);
+  std::mt19937_64 rng(seed);
+  std::uniform_int_distribution<size_t> runLength(1, 64);
+
+  bool valid = false;
+  for (size_t i = 0; i < n;) {
+    size_t length = runLength(rng);
+    for (size_t j = i; j < std::min(i + length, n); j++) {
+      mask[j] = valid;
+    }
+    i += length;
+    valid = !valid;
+  }
+  return mask;
+}
+
+TEST(SampleMapTest, MatchesBytes) {
+  const auto mask = randomMask(10000, 1);
+  const auto map = SampleMap::fromBytes(mask.data(), mask.size());
+
+  size_t count = 0;
+  for (size_t i = 0; i < mask.size(); i++) {
+    ASSERT_EQ(map.test(i), mask[i] != 0) << i;
+    ASSERT_EQ(map.rank(i), count) << i;
+    if (mask[i]) {
+      ASSERT_EQ(map.select(count), i) << count;
+      count++;
+    }
+  }
+  EXPECT_EQ(map.count(), count);
+}
+
+TEST(SampleMapTest, Empty) {
+  std::vector<uint8_t> mask(100, 0);
+  const auto map = SampleMap::fromBytes(mask.data(), mask.size());
+
+  EXPECT_TRUE(map.empty());
+  EXPECT_EQ(map.count(), 0);
+  EXPECT_FALSE(map.test(50));
+
+  auto restored = SampleMap::deserialize(map.serialize().data(),
+                                         map.serialize().size());
+  ASSERT_TRUE(restored);
+  EXPECT_TRUE(restored->empty());
+}
+
+TEST(SampleMapTest, SerializeRoundTrip) {
+  const auto mask = randomMask(100000, 2);
+  const auto map = SampleMap::fromBytes(mask.data(), mask.size());
+  const auto blob = map.serialize();
+
+  auto restored = SampleMap::deserialize(blob.data(), blob.size());
+  ASSERT_TRUE(restored);
+  EXPECT_EQ(restored->nRuns(), map.nRuns());
+  EXPECT_EQ(restored->count(), map.count());
+  for (size_t k = 0; k < map.count(); k += 97) {
+    ASSERT_EQ(restored->select(k), map.select(k)) << k;
+  }
+}
+
+TEST(SampleMapTest, RejectsTruncated) {
+  const auto mask = randomMask(1000, 3);
+  const auto blob = SampleMap::fromBytes(mask.data(), mask.size()).serialize();
+
+  for (size_t size = 0; size < blob.size(); size++) {
+    EXPECT_FALSE(SampleMap::deserialize(blob.data(), size)) << size;
+  }
+}
+
+TEST(SampleMapTest, RejectsTrailingBytes) {
+  const auto mask = randomMask(1000, 4);
+  auto blob = SampleMap::fromBytes(mask.data(), mask.size()).serialize();
+  blob.push_back(0);
+
+  EXPECT_FALSE(SampleMap::deserialize(blob.data(), blob.size()));
+}
+
+// a corrupt run count must fail before anything is allocated for it
+TEST(SampleMapTest, RejectsHugeRunCount) {
+  // varint 2^56, then a single (gap, length) pair
+  std::vector<uint8_t> blob = {0x80, 0x80, 0x80, 0x80, 0x80,
+                               0x80, 0x80, 0x80, 0x01, 0x00, 0x01};
+
+  EXPECT_FALSE(SampleMap::deserialize(blob.data(), blob.size()));
+}
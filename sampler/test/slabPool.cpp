@@ -0,0 +1,119 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "slabPool.h"
+
+using sats::SlabAllocator;
+using sats::SlabPool;
+
+TEST(SlabPoolTest, ReusesFreedSlots) {
+  SlabPool pool({});
+
+  void *first = pool.allocate(1 << 20);
+  pool.deallocate(first, 1 << 20);
+  void *second = pool.allocate(1 << 20);
+
+  EXPECT_EQ(first, second);
+  EXPECT_EQ(pool.stats().mappedBytes, 1 << 20);
+  EXPECT_EQ(pool.stats().slotsInUse, 1);
+
+  pool.deallocate(second, 1 << 20);
+  EXPECT_EQ(pool.stats().slotsInUse, 0);
+}
+
+TEST(SlabPoolTest, PowerOfTwoClasses) {
+  SlabPool pool({});
+
+  // 100 KiB and 128 KiB share a class, 64 KiB is the smallest
+  void *a = pool.allocate(100 << 10);
+  pool.deallocate(a, 100 << 10);
+  void *b = pool.allocate(128 << 10);
+  void *c = pool.allocate(1);
+
+  EXPECT_EQ(a, b);
+  EXPECT_EQ(pool.stats().mappedBytes, (128 << 10) + SlabPool::minSlotBytes);
+
+  pool.deallocate(b, 128 << 10);
+  pool.deallocate(c, 1);
+}
+
+TEST(SlabPoolTest, SlotsAreDistinctWhileInUse) {
+  SlabPool pool({});
+
+  std::vector<uint8_t *> slots;
+  for (size_t i = 0; i < 8; i++) {
+    slots.push_back((uint8_t *)pool.allocate(SlabPool::minSlotBytes));
+    slots.back()[0] = (uint8_t)i;
+    slots.back()[SlabPool::minSlotBytes - 1] = (uint8_t)i;
+  }
+
+  for (size_t i = 0; i < slots.size(); i++) {
+    EXPECT_EQ(slots[i][0], i);
+    EXPECT_EQ(slots[i][SlabPool::minSlotBytes - 1], i);
+    pool.deallocate(slots[i], SlabPool::minSlotBytes);
+  }
+  EXPECT_EQ(pool.stats().mappedBytes, 8 * SlabPool::minSlotBytes);
+}
+
+TEST(SlabPoolTest, HugePageSlotsAreAligned) {
+  SlabPool pool({.hugePages = true});
+
+  const size_t bytes = 4 << 20;
+  void *slot = pool.allocate(bytes);
+  EXPECT_EQ((uintptr_t)slot % (2 << 20), 0);
+  ((uint8_t *)slot)[bytes - 1] = 1;
+
+  pool.deallocate(slot, bytes);
+}
+
+TEST(SlabPoolTest, NumaLocalSlotsAreZeroed) {
+  SlabPool pool({.numaLocal = true});
+
+  void *slot = pool.allocate(1 << 20);
+  const uint8_t *bytes = (const uint8_t *)slot;
+  for (size_t i = 0; i < (1 << 20); i += 4096) {
+    ASSERT_EQ(bytes[i], 0);
+  }
+
+  pool.deallocate(slot, 1 << 20);
+}
+
+TEST(SlabAllocatorTest, LargeBuffersComeFromThePool) {
+  auto pool = std::make_shared<SlabPool>(SlabPool::Options{});
+  {
+    std::vector<uint16_t, SlabAllocator<uint16_t>> small(
+        16, SlabAllocator<uint16_t>(pool));
+    EXPECT_EQ(pool->stats().slotsInUse, 0);
+
+    std::vector<uint16_t, SlabAllocator<uint16_t>> large(
+        SlabPool::minSlotBytes, SlabAllocator<uint16_t>(pool));
+    EXPECT_EQ(pool->stats().slotsInUse, 1);
+  }
+  EXPECT_EQ(pool->stats().slotsInUse, 0);
+}
+
+TEST(SlabAllocatorTest, DefaultUsesTheHeap) {
+  std::vector<uint16_t, SlabAllocator<uint16_t>> buffer(SlabPool::minSlotBytes);
+  buffer.back() = 1;
+
+  EXPECT_EQ(buffer.back(), 1);
+  EXPECT_FALSE(buffer.get_allocator().pool);
+}
+
+// moved buffers keep their pool, so the slot goes back to it
+TEST(SlabAllocatorTest, MovePropagatesThePool) {
+  auto pool = std::make_shared<SlabPool>(SlabPool::Options{});
+
+  std::vector<uint16_t, SlabAllocator<uint16_t>> source(
+      SlabPool::minSlotBytes, SlabAllocator<uint16_t>(pool));
+  std::vector<uint16_t, SlabAllocator<uint16_t>> target;
+  target = std::move(source);
+
+  EXPECT_EQ(target.get_allocator().pool, pool);
+  target = {};
+  target.shrink_to_fit();
+  EXPECT_EQ(pool->stats().slotsInUse, 0);
+}
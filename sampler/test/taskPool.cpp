@@ -0,0 +1,59 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+
+#include "taskPool.h"
+
+using sats::TaskPool;
+
+TEST(TaskPoolTest, RunsEveryTask) {
+  TaskPool pool(4);
+  std::atomic<size_t> count = 0;
+
+  for (size_t i = 0; i < 10000; i++) {
+    pool.submit([&] { count++; });
+  }
+  pool.wait();
+
+  EXPECT_EQ(count, 10000);
+}
+
+// wait() must not miss a task that finishes before submit returns
+TEST(TaskPoolTest, WaitAfterEverySubmit) {
+  TaskPool pool(8);
+  std::atomic<size_t> count = 0;
+
+  for (size_t i = 0; i < 20000; i++) {
+    pool.submit([&] { count++; });
+    pool.wait();
+    ASSERT_EQ(count, i + 1);
+  }
+}
+
+TEST(TaskPoolTest, TasksSubmitTasks) {
+  TaskPool pool(2);
+  std::atomic<size_t> count = 0;
+
+  for (size_t i = 0; i < 100; i++) {
+    pool.submit([&] {
+      for (size_t j = 0; j < 10; j++) {
+        pool.submit([&] { count++; });
+      }
+    });
+  }
+  pool.wait();
+
+  EXPECT_EQ(count, 1000);
+}
+
+TEST(TaskPoolTest, DestructorFinishesQueued) {
+  std::atomic<size_t> count = 0;
+  {
+    TaskPool pool(1);
+    for (size_t i = 0; i < 100; i++) {
+      pool.submit([&] { count++; });
+    }
+  }
+
+  EXPECT_EQ(count, 100);
+}
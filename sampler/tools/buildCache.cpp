@@ -0,0 +1,75 @@
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <thread>
+
+#include "sampler.h"
+#include "third_party/argparse.hpp"
+
+// Fills the sampler cache store (sample maps, quality maps and normalization
+// percentiles) ahead of training, so training only has to load entries. The
+// cache generation options must match the ones training uses.
+
+struct Args : public argparse::Args {
+  std::string &dataDir = arg("data", "Directory of repacked products");
+  std::string &dbPath = kwarg("db", "Cache store to fill");
+  size_t &nThreads = kwarg("j,threads", "Products generated concurrently")
+                         .set_default(std::thread::hardware_concurrency());
+  size_t &sampleDim =
+      kwarg("sd,sample-dim", "Dimension of box to sample").set_default(256);
+  float &minOKPercentage =
+      kwarg("min-ok", "Minimum valid fraction of a window").set_default(0.99999);
+  uint8_t &cldProbMax =
+      kwarg("cldm,cloud-max", "The maximum cloud probability").set_default(50);
+  uint8_t &snwProbMax =
+      kwarg("snwm,snow-max", "The maximum snow probability").set_default(50);
+  std::optional<std::string> &minDate =
+      kwarg("from", "Only products on or after YYYY-MM-DD");
+  std::optional<std::string> &maxDate =
+      kwarg("to", "Only products on or before YYYY-MM-DD");
+};
+
+static bool parseDate(const std::string &date, size_t *year, size_t *month,
+                      size_t *day) {
+  return std::sscanf(date.c_str(), "%zu-%zu-%zu", year, month, day) == 3;
+}
+
+int main(int argc, const char **argv) {
+  auto args = argparse::parse<Args>(argc, argv);
+
+  std::optional<sats::DateRange> dateRange;
+  if (args.minDate || args.maxDate) {
+    dateRange = sats::DateRange{0, 0, 0, 9999, 12, 31};
+    if ((args.minDate && !parseDate(*args.minDate, &dateRange->minYear,
+                                    &dateRange->minMonth, &dateRange->minDay)) ||
+        (args.maxDate && !parseDate(*args.maxDate, &dateRange->maxYear,
+                                    &dateRange->maxMonth, &dateRange->maxDay))) {
+      std::cout << "dates must be YYYY-MM-DD" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  sats::Sampler::SampleOptions sampleOptions = {
+      .dbPath = args.dbPath,
+      .nCacheGenThreads = args.nThreads,
+      .nCacheQueryThreads = args.nThreads,
+  };
+
+  sats::Sampler::SampleCacheGenOptions cacheGenOptions = {
+      .minOKPercentage = args.minOKPercentage,
+      .sampleDim = args.sampleDim,
+      .cldMax = args.cldProbMax,
+      .snwMax = args.snwProbMax,
+  };
+
+  auto err = sats::Sampler::buildCache(args.dataDir, sampleOptions,
+                                       cacheGenOptions, dateRange);
+  if (err) {
+    std::cout << "cache build failed: " << *err << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,93 @@
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <thread>
+
+#include "sampler.h"
+#include "third_party/argparse.hpp"
+
+// Exports every valid window on a grid into pre-tiled chip shards for
+// ShardSampler. Products without a cache entry are generated first, with the
+// same options training would use.
+
+struct Args : public argparse::Args {
+  std::string &dataDir = arg("data", "Directory of repacked products");
+  std::string &outDir = arg("out", "Directory to write shards to");
+  std::string &dbPath = kwarg("db", "Cache store");
+  size_t &nThreads = kwarg("j,threads", "Worker threads")
+                         .set_default(std::thread::hardware_concurrency());
+  size_t &sampleDim =
+      kwarg("sd,sample-dim", "Dimension of box to sample").set_default(256);
+  size_t &stride = kwarg("stride", "Grid step in pixels, 0 for sample-dim")
+                       .set_default(0);
+  size_t &chipsPerShard =
+      kwarg("chips-per-shard", "Chips per shard file").set_default(1024);
+  bool &ndvi = flag("ndvi", "Store NDVI with each chip");
+  float &minOKPercentage =
+      kwarg("min-ok", "Minimum valid fraction of a window").set_default(0.99999);
+  uint8_t &cldProbMax =
+      kwarg("cldm,cloud-max", "The maximum cloud probability").set_default(50);
+  uint8_t &snwProbMax =
+      kwarg("snwm,snow-max", "The maximum snow probability").set_default(50);
+  std::optional<std::string> &minDate =
+      kwarg("from", "Only products on or after YYYY-MM-DD");
+  std::optional<std::string> &maxDate =
+      kwarg("to", "Only products on or before YYYY-MM-DD");
+};
+
+static bool parseDate(const std::string &date, size_t *year, size_t *month,
+                      size_t *day) {
+  return std::sscanf(date.c_str(), "%zu-%zu-%zu", year, month, day) == 3;
+}
+
+int main(int argc, const char **argv) {
+  auto args = argparse::parse<Args>(argc, argv);
+
+  std::optional<sats::DateRange> dateRange;
+  if (args.minDate || args.maxDate) {
+    dateRange = sats::DateRange{0, 0, 0, 9999, 12, 31};
+    if ((args.minDate && !parseDate(*args.minDate, &dateRange->minYear,
+                                    &dateRange->minMonth, &dateRange->minDay)) ||
+        (args.maxDate && !parseDate(*args.maxDate, &dateRange->maxYear,
+                                    &dateRange->maxMonth, &dateRange->maxDay))) {
+      std::cout << "dates must be YYYY-MM-DD" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  sats::Sampler::SampleOptions sampleOptions = {
+      .dbPath = args.dbPath,
+      .nCacheGenThreads = args.nThreads,
+      .nCacheQueryThreads = args.nThreads,
+  };
+
+  sats::Sampler::SampleCacheGenOptions cacheGenOptions = {
+      .minOKPercentage = args.minOKPercentage,
+      .sampleDim = args.sampleDim,
+      .cldMax = args.cldProbMax,
+      .snwMax = args.snwProbMax,
+  };
+
+  sats::Sampler sampler(args.dataDir, sampleOptions, cacheGenOptions,
+                        dateRange);
+  if (sampler.getCacheError()) {
+    std::cout << "cache setup failed: " << *sampler.getCacheError()
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  auto err = sampler.exportShards(args.outDir,
+                                  sats::Sampler::ShardExportOptions{
+                                      .stride = args.stride,
+                                      .chipsPerShard = args.chipsPerShard,
+                                      .ndvi = args.ndvi,
+                                  });
+  if (err) {
+    std::cout << "export failed: " << *err << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,60 @@
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include <omp.h>
+
+#include "synthetic.h"
+#include "third_party/argparse.hpp"
+
+// Writes a dataset of fake repacked products and its CDL raster for load
+// tests and benchmarks, see synthetic.h for the layout.
+
+struct Args : public argparse::Args {
+  std::string &outDir = arg("out", "Directory to write the dataset to");
+  size_t &nProducts =
+      kwarg("n,products", "Number of products").set_default(16);
+  size_t &datesPerTile =
+      kwarg("dates", "Acquisition dates per tile").set_default(1);
+  size_t &dim =
+      kwarg("dim", "HIRES (10 m) pixels per product side").set_default(1098);
+  size_t &year = kwarg("year", "Acquisition and CDL year").set_default(2022);
+  uint64_t &seed = kwarg("seed", "Random seed").set_default(0);
+  float &cloudCoverage =
+      kwarg("cloud", "Cloudy fraction of each product").set_default(0.05);
+  float &detfooCoverage =
+      kwarg("detfoo", "Fraction of each product inside the detector footprint")
+          .set_default(1);
+  bool &noMskOk = flag("no-msk-ok", "Don't write the joined MSK_OK mask");
+  bool &zip = flag("zip", "Write REPACK_*.SAFE.zip stored zips");
+  int &zstdLevel = kwarg("zstd-level", "ZSTD level").set_default(1);
+  size_t &nThreads = kwarg("j,threads", "Products written concurrently")
+                         .set_default(std::thread::hardware_concurrency());
+};
+
+int main(int argc, const char **argv) {
+  auto args = argparse::parse<Args>(argc, argv);
+
+  omp_set_num_threads(args.nThreads);
+
+  sats::synthetic::Options options = {
+      .nProducts = args.nProducts,
+      .datesPerTile = args.datesPerTile,
+      .dim = args.dim,
+      .year = args.year,
+      .seed = args.seed,
+      .cloudCoverage = args.cloudCoverage,
+      .detfooCoverage = args.detfooCoverage,
+      .mskOk = !args.noMskOk,
+      .zip = args.zip,
+      .zstdLevel = args.zstdLevel,
+  };
+
+  if (auto err = sats::synthetic::generate(args.outDir, options)) {
+    std::cout << "synthetic dataset failed: " << *err << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,352 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <omp.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <gdal_priv.h>
+
+#include "sampler.h"
+#include "third_party/argparse.hpp"
+
+// Sweeps the sampler's threading knobs and batch size against a dataset and
+// writes one CSV row per configuration: randomSampleV2 + fillBatch batches,
+// i.e. what randomBatch does for training.
+//
+// Every row runs in its own child process with a fresh Sampler, so GDAL's
+// block cache and the heap start empty and peak_rss_mb is that row's alone.
+// Cold rows also evict the dataset and the cache store from the page cache
+// first and skip the warmup batches.
+
+struct Args : public argparse::Args {
+  std::string &dataDir = arg("data", "Directory of repacked products");
+  std::string &dbPath = kwarg("db", "Cache store");
+  std::string &outPath =
+      kwarg("o,out", "CSV file to write").set_default("scaling.csv");
+
+  std::vector<size_t> &genThreads =
+      kwarg("gen-threads", "nCacheGenThreads values").set_default("4");
+  std::vector<size_t> &queryThreads =
+      kwarg("query-threads", "nCacheQueryThreads values").set_default("4");
+  std::vector<size_t> &ompThreads =
+      kwarg("omp-threads", "OpenMP thread counts for sampling")
+          .set_default("1,2,4,8");
+  std::vector<size_t> &batchSizes =
+      kwarg("batch", "Batch sizes").set_default("8,32,128");
+
+  std::string &cacheModes =
+      kwarg("cache", "Page cache states: cold, warm or both")
+          .set_default("both");
+  size_t &nBatches = kwarg("batches", "Timed batches per row").set_default(20);
+  size_t &nWarmup =
+      kwarg("warmup", "Untimed batches before warm rows").set_default(3);
+  bool &rebuild = flag("rebuild", "Delete the cache store before the first "
+                                  "row of every gen/query thread pair, so "
+                                  "init_s includes cache generation");
+
+  size_t &sampleDim =
+      kwarg("sd,sample-dim", "Dimension of box to sample").set_default(256);
+  float &minOKPercentage =
+      kwarg("min-ok", "Minimum valid fraction of a window").set_default(0.99999);
+  uint8_t &cldProbMax =
+      kwarg("cldm,cloud-max", "The maximum cloud probability").set_default(50);
+  uint8_t &snwProbMax =
+      kwarg("snwm,snow-max", "The maximum snow probability").set_default(50);
+};
+
+struct Row {
+  size_t genThreads, queryThreads, ompThreads, batchSize;
+  bool cold;
+
+  double initS;
+  size_t nBatches;
+  double samplesPerS;
+  double p50Ms, p99Ms;
+  double cpuUtil; // busy cores on average, (user + sys) / wall
+  double rssMB, peakRssMB; // of the row's process, see runIsolated
+};
+
+static const char *csvHeader =
+    "gen_threads,query_threads,omp_threads,batch,cache,init_s,batches,"
+    "samples_per_s,p50_ms,p99_ms,cpu_util,rss_mb,peak_rss_mb";
+
+static std::string csvRow(const Row &row) {
+  return std::format("{},{},{},{},{},{:.3f},{},{:.1f},{:.2f},{:.2f},{:.2f},"
+                     "{:.1f},{:.1f}",
+                     row.genThreads, row.queryThreads, row.ompThreads,
+                     row.batchSize, row.cold ? "cold" : "warm", row.initS,
+                     row.nBatches, row.samplesPerS, row.p50Ms, row.p99Ms,
+                     row.cpuUtil, row.rssMB, row.peakRssMB);
+}
+
+// Asks the kernel to drop the cached pages of `path`, or of every file under
+// it. Unlike /proc/sys/vm/drop_caches this needs no root.
+static void evictPageCache(const std::filesystem::path &path) {
+  auto evict = [](const std::filesystem::path &file) {
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  };
+
+  std::error_code ec;
+  if (std::filesystem::is_regular_file(path, ec)) {
+    evict(path);
+    return;
+  }
+
+  for (const auto &entry :
+       std::filesystem::recursive_directory_iterator(path, ec)) {
+    if (entry.is_regular_file(ec)) {
+      evict(entry.path());
+    }
+  }
+}
+
+static double cpuSeconds() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static double rssMB() {
+  std::ifstream statm("/proc/self/statm");
+  size_t size = 0, resident = 0;
+  statm >> size >> resident;
+  return resident * (double)sysconf(_SC_PAGESIZE) / (1 << 20);
+}
+
+static double peakRssMB() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss / 1024.0; // KiB on Linux
+}
+
+// nearest rank, `sorted` ascending
+static double percentile(const std::vector<double> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t rank = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+  return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+// `nSamples`: what randomSampleV2 returned, which may be fewer than n
+static std::optional<std::string> runBatch(sats::Sampler &sampler, size_t n,
+                                           std::vector<float> &bands,
+                                           std::vector<float> &labels,
+                                           size_t *nSamples) {
+  auto samples = sampler.randomSampleV2(n);
+  if (samples.empty()) {
+    return "randomSampleV2 returned no samples";
+  }
+  *nSamples = samples.size();
+
+  const size_t bandSize = samples[0].dim * samples[0].dim;
+  bands.resize(samples.size() * samples[0].nBands * bandSize);
+  labels.resize(samples.size() * bandSize);
+
+  return sampler.fillBatch(samples, bands.data(), labels.data());
+}
+
+// Fills the measurements of `row` with a Sampler built for its
+// configuration
+static std::optional<std::string>
+measure(const Args &args,
+        const sats::Sampler::SampleCacheGenOptions &cacheGenOptions,
+        Row *row) {
+  omp_set_num_threads(row->ompThreads);
+
+  auto initStart = std::chrono::steady_clock::now();
+  sats::Sampler sampler(args.dataDir,
+                        {
+                            .dbPath = args.dbPath,
+                            .nCacheGenThreads = row->genThreads,
+                            .nCacheQueryThreads = row->queryThreads,
+                        },
+                        cacheGenOptions, std::nullopt, false);
+  row->initS = std::chrono::duration<double>(
+                   std::chrono::steady_clock::now() - initStart)
+                   .count();
+
+  if (auto err = sampler.getCacheError()) {
+    return "cache failed: " + *err;
+  }
+
+  std::vector<float> bands, labels;
+  size_t nSamples = 0;
+
+  std::optional<std::string> err;
+  for (size_t i = 0; !row->cold && !err && i < args.nWarmup; i++) {
+    err = runBatch(sampler, row->batchSize, bands, labels, &nSamples);
+  }
+
+  std::vector<double> latencies;
+  size_t totalSamples = 0;
+  double cpuStart = cpuSeconds();
+  auto start = std::chrono::steady_clock::now();
+
+  for (size_t i = 0; !err && i < args.nBatches; i++) {
+    auto batchStart = std::chrono::steady_clock::now();
+    err = runBatch(sampler, row->batchSize, bands, labels, &nSamples);
+    latencies.push_back(std::chrono::duration<double, std::milli>(
+                            std::chrono::steady_clock::now() - batchStart)
+                            .count());
+    totalSamples += err ? 0 : nSamples;
+  }
+
+  if (err) {
+    return "batch failed: " + *err;
+  }
+
+  double wallS = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  std::sort(latencies.begin(), latencies.end());
+
+  row->nBatches = latencies.size();
+  row->samplesPerS = totalSamples / wallS;
+  row->p50Ms = percentile(latencies, 50);
+  row->p99Ms = percentile(latencies, 99);
+  row->cpuUtil = (cpuSeconds() - cpuStart) / wallS;
+  row->rssMB = rssMB();
+  row->peakRssMB = peakRssMB();
+
+  return std::nullopt;
+}
+
+// Runs measure() in a forked child and reads the row back through a pipe.
+// ru_maxrss never goes down within a process, so only a fresh one gives each
+// row its own peak; the child starts from the parent's small RSS.
+static std::optional<std::string>
+runIsolated(const Args &args,
+            const sats::Sampler::SampleCacheGenOptions &cacheGenOptions,
+            Row *row) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return "pipe failed";
+  }
+
+  std::cout.flush();
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return "fork failed";
+  }
+
+  if (pid == 0) {
+    close(fds[0]);
+    auto err = measure(args, cacheGenOptions, row);
+    if (err) {
+      std::cout << *err << std::endl;
+    } else if (write(fds[1], row, sizeof(Row)) != sizeof(Row)) {
+      std::cout << "failed to report the row" << std::endl;
+      err = "";
+    }
+    std::cout.flush();
+    _exit(err ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
+  close(fds[1]);
+  Row result;
+  ssize_t nRead = read(fds[0], &result, sizeof(Row));
+  close(fds[0]);
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+  if (nRead != sizeof(Row) || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != EXIT_SUCCESS) {
+    return "measuring the row failed";
+  }
+
+  *row = result;
+  return std::nullopt;
+}
+
+int main(int argc, const char **argv) {
+  auto args = argparse::parse<Args>(argc, argv);
+
+  std::vector<bool> modes;
+  if (args.cacheModes == "cold" || args.cacheModes == "both") {
+    modes.push_back(true);
+  }
+  if (args.cacheModes == "warm" || args.cacheModes == "both") {
+    modes.push_back(false);
+  }
+  if (modes.empty()) {
+    std::cout << "--cache must be cold, warm or both" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::ofstream csv(args.outPath);
+  if (!csv) {
+    std::cout << "failed to open \"" << args.outPath << "\"" << std::endl;
+    return EXIT_FAILURE;
+  }
+  csv << csvHeader << std::endl;
+
+  GDALAllRegister();
+
+  const sats::Sampler::SampleCacheGenOptions cacheGenOptions = {
+      .minOKPercentage = args.minOKPercentage,
+      .sampleDim = args.sampleDim,
+      .cldMax = args.cldProbMax,
+      .snwMax = args.snwProbMax,
+  };
+
+  for (size_t genThreads : args.genThreads) {
+    for (size_t queryThreads : args.queryThreads) {
+      bool fresh = args.rebuild;
+
+      for (bool cold : modes) {
+        for (size_t ompThreads : args.ompThreads) {
+          for (size_t batchSize : args.batchSizes) {
+            if (fresh) {
+              std::filesystem::remove(args.dbPath);
+              std::filesystem::remove(args.dbPath + "-wal");
+              std::filesystem::remove(args.dbPath + "-shm");
+              fresh = false;
+            }
+
+            if (cold) {
+              evictPageCache(args.dataDir);
+              evictPageCache(args.dbPath);
+            }
+
+            Row row = {
+                .genThreads = genThreads,
+                .queryThreads = queryThreads,
+                .ompThreads = ompThreads,
+                .batchSize = batchSize,
+                .cold = cold,
+            };
+
+            if (auto err = runIsolated(args, cacheGenOptions, &row)) {
+              std::cout << *err << std::endl;
+              return EXIT_FAILURE;
+            }
+
+            csv << csvRow(row) << std::endl;
+            std::cout << csvRow(row) << std::endl;
+          }
+        }
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,520 @@
+#include "synthetic.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <format>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <cpl_conv.h>
+#include <cpl_string.h>
+#include <cpl_vsi.h>
+#include <gdal_priv.h>
+#include <ogr_spatialref.h>
+
+#include "cpu/normalize.h"
+
+namespace sats::synthetic {
+
+// band names and order as written by satsample_repack
+static const std::vector<std::string> hiresBands = {"B02_10m", "B03_10m",
+                                                    "B04_10m", "B08_10m"};
+static const std::vector<std::string> lowresBands = {
+    "B05_20m", "B06_20m", "B07_20m", "B8A_20m", "B11_20m", "B12_20m"};
+
+// one DETFOO mask per L2A band, then CLD, SNW, SCL
+static constexpr size_t nDetfoo = 13;
+static constexpr size_t nDetectors = 12;
+
+// typical surface reflectance per band (B02 ... B12), scaled by 10000
+static const std::array<uint16_t, 10> baseReflectance = {
+    600, 900, 800, 3000, 1300, 2400, 2800, 3100, 2200, 1300};
+
+// corn, soybeans, winter wheat, alfalfa, fallow, grassland
+static const std::array<uint8_t, 6> cdlClasses = {1, 5, 24, 36, 61, 176};
+static constexpr size_t cdlFieldSize = 24; // 30 m pixels per field
+
+// Sample::coordsMin/Max are unsigned, so the grid starts at positive
+// EPSG:3857 coordinates
+static constexpr double originX = 1000000;
+static constexpr double originY = 6000000;
+
+// distinct acquisition dates a tile can have in one year, 28 per month
+static constexpr size_t maxDatesPerTile = 12 * 28;
+
+struct Product {
+  std::string name; // S2A_..., without REPACK_
+  size_t month, day;
+  double x0, y0; // top left corner
+};
+
+static size_t nTiles(const Options &options) {
+  return (options.nProducts + options.datesPerTile - 1) / options.datesPerTile;
+}
+
+static size_t gridWidth(const Options &options) {
+  return (size_t)std::ceil(std::sqrt((double)nTiles(options)));
+}
+
+static double productExtent(const Options &options) {
+  return options.dim * 10.0;
+}
+
+// T00AAA, T00AAB, ...; unique for the first 100 * 26^3 products
+static std::string tileName(size_t index) {
+  std::string letters(3, 'A');
+  size_t rest = index;
+  for (size_t i = 0; i < 3; i++) {
+    letters[2 - i] = 'A' + rest % 26;
+    rest /= 26;
+  }
+
+  return std::format("T{:02}{}", rest % 100, letters);
+}
+
+static Product productAt(size_t index, const Options &options) {
+  size_t width = gridWidth(options);
+  double extent = productExtent(options);
+
+  size_t tile = index / options.datesPerTile;
+  size_t dayOfYear =
+      index % options.datesPerTile * (maxDatesPerTile / options.datesPerTile);
+
+  Product product = {
+      .month = 1 + dayOfYear / 28,
+      .day = 1 + dayOfYear % 28,
+      .x0 = originX + (tile % width) * extent,
+      .y0 = originY - (tile / width) * extent,
+  };
+
+  // acquisition times avoid 0, the product regex only takes [1-9]
+  std::string date =
+      std::format("{}{:02}{:02}", options.year, product.month, product.day);
+  product.name =
+      std::format("S2A_MSIL2A_{}T161829_N0400_R112_{}_{}T212046.SAFE", date,
+                  tileName(tile), date);
+
+  return product;
+}
+
+static std::string webMercatorWKT() {
+  OGRSpatialReference srs;
+  srs.importFromEPSG(3857);
+
+  char *wkt = nullptr;
+  srs.exportToWkt(&wkt);
+  std::string out = wkt ? wkt : "";
+  CPLFree(wkt);
+
+  return out;
+}
+
+// Same creation options as satsample_repack's writeBundle. `path` may be a
+// /vsimem/ file.
+static std::optional<std::string>
+writeBundle(const std::string &path, size_t xSize, size_t ySize,
+            double resolution, const Product &product,
+            const std::vector<std::string> &descriptions,
+            const std::vector<const void *> &bands, GDALDataType dataType,
+            bool tiled, int nbits, const Options &options,
+            const std::vector<std::pair<std::string, std::string>> &metadata =
+                {}) {
+  GDALDriver *gtiffDriver =
+      GDALDriver::FromHandle(GDALGetDriverByName("GTiff"));
+
+  CPLStringList createOptions;
+  createOptions.SetNameValue("COMPRESS", "ZSTD");
+  createOptions.SetNameValue("ZSTD_LEVEL",
+                             std::to_string(options.zstdLevel).c_str());
+  createOptions.SetNameValue("TILED", tiled ? "YES" : "NO");
+  if (nbits) {
+    createOptions.SetNameValue("NBITS", std::to_string(nbits).c_str());
+  } else {
+    createOptions.SetNameValue("PREDICTOR", "2");
+  }
+
+  auto ds = GDALDatasetUniquePtr(
+      gtiffDriver->Create(path.c_str(), xSize, ySize, bands.size(), dataType,
+                          createOptions.List()));
+  if (!ds) {
+    return "Failed to create \"" + path + "\"";
+  }
+
+  double geoTransform[6] = {product.x0, resolution, 0, product.y0, 0,
+                            -resolution};
+  ds->SetGeoTransform(geoTransform);
+  ds->SetProjection(webMercatorWKT().c_str());
+
+  for (size_t i = 0; i < bands.size(); i++) {
+    GDALRasterBand *band = ds->GetRasterBand(i + 1);
+    band->SetDescription(descriptions[i].c_str());
+    for (const auto &[key, value] : metadata) {
+      band->SetMetadataItem(key.c_str(), value.c_str());
+    }
+
+    // the percentiles satsample_repack stores, so cache generation skips
+    // the full band read like it does on real data
+    if (dataType == GDT_UInt16) {
+      auto percentiles = cpuproc::percentilesU16((const uint16_t *)bands[i],
+                                                 xSize * ySize, {1, 99});
+      band->SetMetadataItem("SATS_PERCENTILE_1",
+                            std::to_string(percentiles[0]).c_str());
+      band->SetMetadataItem("SATS_PERCENTILE_99",
+                            std::to_string(percentiles[1]).c_str());
+    }
+
+    CPLErr err = band->RasterIO(GF_Write, 0, 0, xSize, ySize,
+                                (void *)bands[i], xSize, ySize, dataType, 0, 0);
+    if (err) {
+      return std::format("Failed to write band {} of \"{}\"", i + 1,
+                         path);
+    }
+  }
+
+  if (ds->Close() != CE_None) {
+    return "Failed to write \"" + path + "\"";
+  }
+
+  return std::nullopt;
+}
+
+// Cloud cover at mask (20 m) resolution: random discs until `coverage` of
+// the product is cloudy
+static std::vector<uint8_t> cloudCover(size_t dim, float coverage,
+                                       std::mt19937_64 &rng) {
+  std::vector<uint8_t> cloud(dim * dim, coverage >= 1 ? 1 : 0);
+  if (coverage <= 0 || coverage >= 1) {
+    return cloud;
+  }
+
+  std::uniform_real_distribution<double> pos(0, dim);
+  std::uniform_real_distribution<double> radius(dim / 30.0, dim / 10.0);
+
+  const size_t target = (size_t)(coverage * dim * dim);
+  size_t covered = 0;
+
+  while (covered < target) {
+    double cx = pos(rng), cy = pos(rng), r = radius(rng);
+    size_t yMin = (size_t)std::max(cy - r, 0.0);
+    size_t yMax = (size_t)std::min(cy + r, (double)dim);
+    size_t xMin = (size_t)std::max(cx - r, 0.0);
+    size_t xMax = (size_t)std::min(cx + r, (double)dim);
+
+    for (size_t y = yMin; y < yMax; y++) {
+      for (size_t x = xMin; x < xMax; x++) {
+        if (!cloud[y * dim + x] &&
+            (x - cx) * (x - cx) + (y - cy) * (y - cy) < r * r) {
+          cloud[y * dim + x] = 1;
+          covered++;
+        }
+      }
+    }
+  }
+
+  return cloud;
+}
+
+// Inside the detector footprint at mask pixel (x, y)? The edge runs slightly
+// diagonal like the swath edge of a real tile.
+static bool inFootprint(size_t x, size_t y, size_t dim, float coverage) {
+  double edge = coverage * dim + ((double)y - dim / 2.0) * 0.2;
+  return coverage >= 1 || x < edge;
+}
+
+// Smooth field pattern plus noise, bright under clouds and 0 outside the
+// footprint. `cloud` is at mask resolution, `scale` pixels of the band per
+// mask pixel.
+static std::vector<uint16_t> reflectance(size_t dim, size_t band,
+                                         const std::vector<uint8_t> &cloud,
+                                         size_t scale, const Options &options,
+                                         std::mt19937_64 &rng) {
+  std::vector<uint16_t> out(dim * dim);
+  std::uniform_int_distribution<int> noise(-200, 200);
+
+  const double base = baseReflectance[band];
+  const double phase = std::uniform_real_distribution<double>(0, 6.28)(rng);
+  const size_t maskDim = dim / scale;
+
+  for (size_t y = 0; y < dim; y++) {
+    for (size_t x = 0; x < dim; x++) {
+      if (!inFootprint(x / scale, y / scale, maskDim,
+                       options.detfooCoverage)) {
+        out[y * dim + x] = 0;
+        continue;
+      }
+      if (cloud[(y / scale) * maskDim + x / scale]) {
+        out[y * dim + x] = (uint16_t)(7000 + noise(rng));
+        continue;
+      }
+
+      double field = std::sin(x * 0.02 + phase) * std::cos(y * 0.015 + phase);
+      out[y * dim + x] =
+          (uint16_t)std::clamp(base * (1.0 + 0.4 * field) + noise(rng), 1.0,
+                               (double)UINT16_MAX);
+    }
+  }
+
+  return out;
+}
+
+// Moves the /vsimem/ bundles into a new zip without compression, like
+// satsample_repack's storeZip
+static std::optional<std::string>
+storeZip(const std::filesystem::path &zipPath,
+         const std::vector<std::string> &files) {
+  VSIUnlink(zipPath.c_str());
+
+  void *zip = CPLCreateZip(zipPath.c_str(), NULL);
+  if (!zip) {
+    return "Failed to create \"" + zipPath.string() + "\"";
+  }
+
+  CPLStringList fileOptions;
+  fileOptions.SetNameValue("COMPRESSED", "NO");
+
+  std::optional<std::string> err;
+  for (const auto &file : files) {
+    vsi_l_offset size = 0;
+    GByte *data = VSIGetMemFileBuffer(file.c_str(), &size, TRUE);
+
+    if (!err &&
+        (!data ||
+         CPLCreateFileInZip(zip, std::filesystem::path(file).filename().c_str(),
+                            fileOptions.List()) != CE_None)) {
+      err = "Failed to add \"" + file + "\" to \"" + zipPath.string() + "\"";
+    } else if (!err) {
+      if (CPLWriteFileInZip(zip, data, (int)size) != CE_None) {
+        err = "Failed to write \"" + zipPath.string() + "\"";
+      }
+      CPLCloseFileInZip(zip);
+    }
+
+    CPLFree(data);
+  }
+
+  if (CPLCloseZip(zip) != CE_None && !err) {
+    err = "Failed to finish \"" + zipPath.string() + "\"";
+  }
+
+  return err;
+}
+
+static std::optional<std::string>
+writeProduct(const std::filesystem::path &dir, size_t index,
+             const Options &options) {
+  const Product product = productAt(index, options);
+  const std::string productDir = "REPACK_" + product.name;
+
+  // zipped products are assembled in memory first
+  const std::filesystem::path buildDir =
+      options.zip ? std::filesystem::path("/vsimem/synthetic") / productDir
+                  : dir / productDir;
+  if (!options.zip) {
+    std::filesystem::create_directories(buildDir);
+  }
+
+  std::vector<std::string> files;
+  auto bundlePath = [&](const std::string &bundle) {
+    files.push_back(buildDir / (product.name + "-" + bundle + ".tif"));
+    return files.back();
+  };
+
+  std::mt19937_64 rng(options.seed * 1000003 + index);
+
+  const size_t hiresDim = options.dim;
+  const size_t maskDim = options.dim / 2;
+  const std::vector<uint8_t> cloud =
+      cloudCover(maskDim, options.cloudCoverage, rng);
+
+  // 1. HIRES / LOWRES
+  std::vector<std::vector<uint16_t>> hires, lowres;
+  for (size_t b = 0; b < hiresBands.size(); b++) {
+    hires.push_back(reflectance(hiresDim, b, cloud, 2, options, rng));
+  }
+  for (size_t b = 0; b < lowresBands.size(); b++) {
+    lowres.push_back(
+        reflectance(maskDim, hiresBands.size() + b, cloud, 1, options, rng));
+  }
+
+  auto pointers = [](const std::vector<std::vector<uint16_t>> &bands) {
+    std::vector<const void *> out;
+    for (const auto &band : bands) {
+      out.push_back(band.data());
+    }
+    return out;
+  };
+
+  std::optional<std::string> err;
+
+  err = writeBundle(bundlePath("HIRES"), hiresDim, hiresDim, 10, product,
+                    hiresBands, pointers(hires), GDT_UInt16, true, 0, options);
+  if (!err) {
+    err = writeBundle(bundlePath("LOWRES"), maskDim, maskDim, 20, product,
+                      lowresBands, pointers(lowres), GDT_UInt16, true, 0,
+                      options);
+  }
+
+  // 2. MSK: DETFOO (detector index, 0 outside the footprint), CLD and SNW
+  // probabilities, SCL classes. MSK_OK is what joining them gives with the
+  // default 50% cloud and snow thresholds, and is tagged with them.
+  const size_t nMaskPixels = maskDim * maskDim;
+  std::vector<uint8_t> detfoo(nMaskPixels), cld(nMaskPixels),
+      snw(nMaskPixels, 0), scl(nMaskPixels), ok(nMaskPixels);
+
+  for (size_t y = 0; y < maskDim; y++) {
+    for (size_t x = 0; x < maskDim; x++) {
+      size_t i = y * maskDim + x;
+      bool inside = inFootprint(x, y, maskDim, options.detfooCoverage);
+
+      detfoo[i] = inside ? (uint8_t)(1 + x * nDetectors / maskDim) : 0;
+      cld[i] = cloud[i] ? 90 : 2;
+      // 0: no data, 9: cloud high probability, 4: vegetation, 5: not
+      // vegetated
+      scl[i] = !inside    ? 0
+               : cloud[i] ? 9
+                          : ((x / 64 + y / 64) % 3 ? 4 : 5);
+      ok[i] = inside && !cloud[i];
+    }
+  }
+
+  std::vector<std::string> maskNames;
+  std::vector<const void *> masks;
+  for (size_t i = 0; i < nDetfoo; i++) {
+    maskNames.push_back(std::format("DETFOO_{}", i));
+    masks.push_back(detfoo.data());
+  }
+  maskNames.insert(maskNames.end(), {"CLD", "SNW", "SCL"});
+  masks.insert(masks.end(), {cld.data(), snw.data(), scl.data()});
+
+  if (!err) {
+    err = writeBundle(bundlePath("MSK"), maskDim, maskDim, 20, product,
+                      maskNames, masks, GDT_Byte, false, 0, options);
+  }
+  if (!err && options.mskOk) {
+    err = writeBundle(bundlePath("MSK_OK"), maskDim, maskDim, 20, product,
+                      {""}, {ok.data()}, GDT_Byte, true, 1, options,
+                      {{"SATS_CLD_MAX", "50"}, {"SATS_SNW_MAX", "50"}});
+  }
+
+  if (options.zip) {
+    // also frees the /vsimem/ files after a failed write
+    auto zipErr = storeZip(dir / (productDir + ".zip"), files);
+    if (!err) {
+      err = zipErr;
+    }
+  }
+
+  return err;
+}
+
+// Patchwork of fields over the whole product grid, written in strips
+static std::optional<std::string> writeCDL(const std::filesystem::path &dir,
+                                           const Options &options) {
+  const size_t width = gridWidth(options);
+  const size_t height = (nTiles(options) + width - 1) / width;
+  const double extent = productExtent(options);
+
+  const size_t xSize = (size_t)std::ceil(width * extent / 30);
+  const size_t ySize = (size_t)std::ceil(height * extent / 30);
+
+  const std::filesystem::path path =
+      dir / std::format("{}_30m_cdls.tif", options.year);
+
+  GDALDriver *gtiffDriver =
+      GDALDriver::FromHandle(GDALGetDriverByName("GTiff"));
+
+  CPLStringList createOptions;
+  createOptions.SetNameValue("COMPRESS", "ZSTD");
+  createOptions.SetNameValue("TILED", "YES");
+
+  auto ds = GDALDatasetUniquePtr(gtiffDriver->Create(
+      path.c_str(), xSize, ySize, 1, GDT_Byte, createOptions.List()));
+  if (!ds) {
+    return "Failed to create \"" + path.string() + "\"";
+  }
+
+  double geoTransform[6] = {originX, 30, 0, originY, 0, -30};
+  ds->SetGeoTransform(geoTransform);
+  ds->SetProjection(webMercatorWKT().c_str());
+
+  const size_t stripRows = 256;
+  std::vector<uint8_t> strip(xSize * stripRows);
+
+  for (size_t y0 = 0; y0 < ySize; y0 += stripRows) {
+    size_t rows = std::min(stripRows, ySize - y0);
+
+    for (size_t y = 0; y < rows; y++) {
+      for (size_t x = 0; x < xSize; x++) {
+        // deterministic per field, no rng state across strips
+        uint64_t field = ((y0 + y) / cdlFieldSize) * 1000003 +
+                         x / cdlFieldSize + options.seed * 7919;
+        field ^= field >> 17;
+        field *= 0x9E3779B97F4A7C15;
+        strip[y * xSize + x] = cdlClasses[(field >> 32) % cdlClasses.size()];
+      }
+    }
+
+    CPLErr err = ds->GetRasterBand(1)->RasterIO(GF_Write, 0, y0, xSize, rows,
+                                                strip.data(), xSize, rows,
+                                                GDT_Byte, 0, 0);
+    if (err) {
+      return "Failed to write \"" + path.string() + "\"";
+    }
+  }
+
+  if (ds->Close() != CE_None) {
+    return "Failed to write \"" + path.string() + "\"";
+  }
+
+  return std::nullopt;
+}
+
+std::optional<std::string> generate(const std::filesystem::path &dir,
+                                    const Options &options) {
+  if (options.dim == 0 || options.dim % 2) {
+    return std::format("dim must be even and nonzero, not {}", options.dim);
+  }
+  if (options.datesPerTile == 0 || options.datesPerTile > maxDatesPerTile) {
+    return std::format("datesPerTile must be in 1..{}, not {}",
+                       maxDatesPerTile, options.datesPerTile);
+  }
+  // the tile names run out at T99ZZZ
+  if (nTiles(options) > 100 * 26 * 26 * 26) {
+    return std::format("too many tiles ({})", nTiles(options));
+  }
+
+  GDALAllRegister();
+  std::filesystem::create_directories(dir);
+
+  std::string errors;
+  std::atomic<size_t> nDone = 0;
+  const size_t reportEvery = std::max(options.nProducts / 20, (size_t)1);
+
+#pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < options.nProducts; i++) {
+    auto err = writeProduct(dir, i, options);
+    if (err) {
+#pragma omp critical(SYNTHETIC_ERRORS)
+      errors += err.value() + "\n";
+    }
+
+    size_t done = ++nDone;
+    if (options.nProducts > 1 && done % reportEvery == 0) {
+#pragma omp critical(SYNTHETIC_ERRORS)
+      std::cout << "synthetic: " << done << "/" << options.nProducts
+                << " products" << std::endl;
+    }
+  }
+
+  if (!errors.empty()) {
+    return errors;
+  }
+
+  return writeCDL(dir, options);
+}
+
+} // namespace sats::synthetic
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+
+namespace sats::synthetic {
+
+// Fake repacked Sentinel-2 products with the structure the sampler expects
+// (REPACK_*.SAFE naming, HIRES/LOWRES/MSK bundles at 10/20/20 m, ZSTD tiled
+// GeoTIFFs) plus a <year>_30m_cdls.tif covering all of them, so benchmarks
+// can run without real data.
+//
+// Tiles sit side by side on a grid in EPSG:3857, every tile is revisited on
+// `datesPerTile` dates spread over the year, so product i is date
+// i % datesPerTile of tile i / datesPerTile.
+struct Options {
+  size_t nProducts = 4;
+  size_t datesPerTile = 1;
+
+  // HIRES (10 m) pixels per side, even so the 20 m bundles divide it
+  size_t dim = 1098;
+
+  size_t year = 2022;
+  uint64_t seed = 0;
+
+  // fraction of each product under cloud (CLD 90, SCL 9)
+  float cloudCoverage = 0.05;
+  // fraction of each product inside the detector footprint, the rest is the
+  // DETFOO 0 no-data edge of a swath
+  float detfooCoverage = 1;
+
+  // also write the joined 1-bit <product>-MSK_OK.tif satsample_repack adds
+  bool mskOk = true;
+  // REPACK_*.SAFE.zip stored zips like satsample_repack writes instead of
+  // REPACK_*.SAFE directories
+  bool zip = false;
+
+  int zstdLevel = 1;
+};
+
+// Writes the products and the CDL raster into `dir`, creating it if needed
+std::optional<std::string> generate(const std::filesystem::path &dir,
+                                    const Options &options);
+
+} // namespace sats::synthetic
@@ -66,7 +66,9 @@ buildSampleMask() {
     (set -x; gdalbuildvrt -resolution user -tr 20 20 -overwrite -separate $vrtFname $DETFOO_MASKS $CLD_MASK $SNW_MASK $SCL_MASK)
     (set -x; gdal_translate -tr 20 20 -co COMPRESS=ZSTD -co ZSTD_LEVEL=15 -co PREDICTOR=2 -co NUM_THREADS=1 -co TILED=NO $vrtFname $BUILD_DIR/$(basename $(echo $PRODUCT_ZIP | sed "s/.zip/-MSK.tif/g")))
 
-    # (set -x; ./sample-map-gen/build/satsample_mapgen --dfm $DETFOO_MASKS --cld $CLD_MASK --snw $SNW_MASK --snwm 50 --cldm 50 -o $BUILD_DIR/MSK_OK.tiff)
+    # precomputed joined mask, picked up by the sampler instead of joining MSK
+    # when its cache is generated with the same --cldm / --snwm
+    (set -x; ./sample-map-gen/build/satsample_mapgen --dfm $DETFOO_MASKS --cld $CLD_MASK --snw $SNW_MASK --scl $SCL_MASK --snwm 50 --cldm 50 --cog -c ZSTD -o $BUILD_DIR/$(basename $(echo $PRODUCT_ZIP | sed "s/.zip/-MSK_OK.tif/g")))
 }
 
 
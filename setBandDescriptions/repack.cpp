@@ -0,0 +1,505 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cpl_conv.h>
+#include <cpl_error.h>
+#include <cpl_string.h>
+#include <cpl_vsi.h>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <future>
+#include <gdal.h>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <regex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <gdal_priv.h>
+
+#include "cpu/maskJoin.h"
+#include "taskPool.h"
+#include "third_party/argparse.hpp"
+
+// Native replacement for sentinelRepackV2.sh. Every product zip is listed
+// once, its JP2 bands are decoded in parallel straight into memory, and the
+// HIRES/LOWRES/MSK bundles, the joined sample mask and the normalization
+// percentiles are all produced from those buffers before the repacked zip is
+// written.
+
+struct Args : public argparse::Args {
+  std::vector<std::string> &products =
+      arg("products", "SAFE product zips to repack").multi_argument();
+  std::optional<std::string> &outDir = kwarg(
+      "od,out-dir", "Where REPACK_<product>.zip goes, default next to input");
+  int &zstdLevel = kwarg("zstd-level", "ZSTD level").set_default(15);
+  uint8_t &snwProbMax =
+      kwarg("snwm,snow-max", "The maximum snow probability").set_default(50);
+  uint8_t &cldProbMax =
+      kwarg("cldm,cloud-max", "The maximum cloud probability").set_default(50);
+  size_t &nThreads =
+      kwarg("j,threads", "Number of decode/compression threads")
+          .set_default(std::thread::hardware_concurrency());
+};
+
+struct Bundle {
+  std::string name; // HIRES, LOWRES, MSK
+  std::vector<std::string> bandNames;
+  double resolution;
+  GDALDataType dataType;
+  bool tiled;
+};
+
+// same bundles, band order and resolutions as sentinelRepackV2.sh
+static const std::vector<Bundle> imageBundles = {
+    {"HIRES", {"B02_10m", "B03_10m", "B04_10m", "B08_10m"}, 10, GDT_UInt16,
+     true},
+    {"LOWRES",
+     {"B05_20m", "B06_20m", "B07_20m", "B8A_20m", "B11_20m", "B12_20m"},
+     20,
+     GDT_UInt16,
+     true},
+};
+static const double maskResolution = 20;
+
+// Matches the percentile picked by sats::cpuproc::percentiles: the element at
+// index floor(p / 100 * len) of the sorted band. A histogram finds it in one
+// pass since the bands are UInt16.
+static std::vector<float> bandPercentiles(const uint16_t *data, size_t len,
+                                          const std::vector<size_t> &ps) {
+  std::vector<size_t> histogram(UINT16_MAX + 1, 0);
+  for (size_t i = 0; i < len; i++) {
+    histogram[data[i]]++;
+  }
+
+  std::vector<float> out;
+  for (size_t p : ps) {
+    size_t index = std::min((size_t)(((float)p / 100.0) * len), len - 1);
+
+    size_t cumulative = 0;
+    size_t value = 0;
+    for (; value < histogram.size(); value++) {
+      cumulative += histogram[value];
+      if (cumulative > index) {
+        break;
+      }
+    }
+
+    out.push_back((float)value);
+  }
+
+  return out;
+}
+
+struct Raster {
+  std::string path;
+  std::string description;
+  std::vector<uint8_t> data;
+  std::vector<std::pair<std::string, std::string>> metadata = {};
+};
+
+struct Grid {
+  size_t xSize, ySize;
+  std::array<double, 6> geoTransform;
+  std::string projection;
+};
+
+// Reads band 1 of `path` onto `grid` (nearest neighbour, like gdalbuildvrt).
+// Each call opens its own handle so all bands of a product decode at once.
+static std::optional<std::string> readRaster(Raster &raster, const Grid &grid,
+                                             GDALDataType dataType) {
+  auto ds = GDALDatasetUniquePtr(
+      GDALDataset::Open(raster.path.c_str(), GA_ReadOnly));
+  if (!ds) {
+    return "Failed to open \"" + raster.path + "\"";
+  }
+
+  raster.data.resize(grid.xSize * grid.ySize *
+                     GDALGetDataTypeSizeBytes(dataType));
+
+  CPLErr err = ds->GetRasterBand(1)->RasterIO(
+      GF_Read, 0, 0, ds->GetRasterXSize(), ds->GetRasterYSize(),
+      raster.data.data(), grid.xSize, grid.ySize, dataType, 0, 0);
+
+  if (err) {
+    return "Failed to read \"" + raster.path + "\"";
+  }
+
+  return std::nullopt;
+}
+
+// Output grid of `path` resampled to `resolution` metres.
+static std::optional<Grid> gridAt(const std::string &path, double resolution) {
+  auto ds =
+      GDALDatasetUniquePtr(GDALDataset::Open(path.c_str(), GA_ReadOnly));
+  if (!ds) {
+    return std::nullopt;
+  }
+
+  Grid grid;
+  if (ds->GetGeoTransform(grid.geoTransform.data()) != CE_None) {
+    return std::nullopt;
+  }
+
+  double scale = resolution / grid.geoTransform[1];
+  grid.xSize = (size_t)(ds->GetRasterXSize() / scale + 0.5);
+  grid.ySize = (size_t)(ds->GetRasterYSize() / scale + 0.5);
+  grid.geoTransform[1] = resolution;
+  grid.geoTransform[5] = -resolution;
+  grid.projection = ds->GetProjectionRef();
+
+  return grid;
+}
+
+static std::optional<std::string>
+writeBundle(const std::string &outPath, const Grid &grid,
+            const std::vector<Raster> &rasters, GDALDataType dataType,
+            bool tiled, int nbits, const Args &args,
+            const std::vector<std::array<float, 2>> *percentiles) {
+  GDALDriver *gtiffDriver =
+      GDALDriver::FromHandle(GDALGetDriverByName("GTiff"));
+
+  CPLStringList options;
+  options.SetNameValue("COMPRESS", "ZSTD");
+  options.SetNameValue("ZSTD_LEVEL", std::to_string(args.zstdLevel).c_str());
+  options.SetNameValue("NUM_THREADS", std::to_string(args.nThreads).c_str());
+  options.SetNameValue("TILED", tiled ? "YES" : "NO");
+  if (nbits) {
+    options.SetNameValue("NBITS", std::to_string(nbits).c_str());
+  } else {
+    options.SetNameValue("PREDICTOR", "2");
+  }
+
+  auto ds = GDALDatasetUniquePtr(
+      gtiffDriver->Create(outPath.c_str(), grid.xSize, grid.ySize,
+                          rasters.size(), dataType, options.List()));
+  if (!ds) {
+    return "Failed to create \"" + outPath + "\"";
+  }
+
+  auto geoTransform = grid.geoTransform;
+  ds->SetGeoTransform(geoTransform.data());
+  ds->SetProjection(grid.projection.c_str());
+
+  for (size_t i = 0; i < rasters.size(); i++) {
+    GDALRasterBand *band = ds->GetRasterBand(i + 1);
+    band->SetDescription(rasters[i].description.c_str());
+    for (const auto &[key, value] : rasters[i].metadata) {
+      band->SetMetadataItem(key.c_str(), value.c_str());
+    }
+
+    if (percentiles) {
+      band->SetMetadataItem("SATS_PERCENTILE_1",
+                            std::to_string((*percentiles)[i][0]).c_str());
+      band->SetMetadataItem("SATS_PERCENTILE_99",
+                            std::to_string((*percentiles)[i][1]).c_str());
+    }
+
+    CPLErr err = band->RasterIO(GF_Write, 0, 0, grid.xSize, grid.ySize,
+                                (void *)rasters[i].data.data(), grid.xSize,
+                                grid.ySize, dataType, 0, 0);
+    if (err) {
+      return "Failed to write band " + std::to_string(i + 1) + " of \"" +
+             outPath + "\"";
+    }
+  }
+
+  if (ds->Close() != CE_None) {
+    return "Failed to write \"" + outPath + "\"";
+  }
+
+  return std::nullopt;
+}
+
+// Copies `files` into a new zip without compression (zip -0), so the sampler
+// can read the GeoTIFFs at their stored offsets.
+static std::optional<std::string>
+storeZip(const std::string &zipPath,
+         const std::vector<std::filesystem::path> &files) {
+  VSIUnlink(zipPath.c_str());
+
+  void *zip = CPLCreateZip(zipPath.c_str(), NULL);
+  if (!zip) {
+    return "Failed to create \"" + zipPath + "\"";
+  }
+
+  CPLStringList fileOptions;
+  fileOptions.SetNameValue("COMPRESSED", "NO");
+
+  std::vector<char> buffer(1 << 24);
+  std::optional<std::string> err;
+  for (const auto &file : files) {
+    VSILFILE *in = VSIFOpenL(file.c_str(), "rb");
+    if (!in || CPLCreateFileInZip(zip, file.filename().c_str(),
+                                  fileOptions.List()) != CE_None) {
+      if (in) {
+        VSIFCloseL(in);
+      }
+      err = "Failed to add \"" + file.string() + "\" to \"" + zipPath + "\"";
+      break;
+    }
+
+    size_t nRead;
+    while ((nRead = VSIFReadL(buffer.data(), 1, buffer.size(), in)) > 0) {
+      if (CPLWriteFileInZip(zip, buffer.data(), (int)nRead) != CE_None) {
+        err = "Failed to write \"" + zipPath + "\"";
+        break;
+      }
+    }
+
+    VSIFCloseL(in);
+    CPLCloseFileInZip(zip);
+
+    if (err) {
+      break;
+    }
+  }
+
+  if (CPLCloseZip(zip) != CE_None && !err) {
+    err = "Failed to finish \"" + zipPath + "\"";
+  }
+
+  return err;
+}
+
+// Runs `f` on `pool` and hands back its result like std::async would
+template <typename F>
+static std::future<std::invoke_result_t<F>> submit(sats::TaskPool &pool, F f) {
+  auto task = std::make_shared<std::packaged_task<std::invoke_result_t<F>()>>(
+      std::move(f));
+  auto result = task->get_future();
+  pool.submit([task]() { (*task)(); });
+  return result;
+}
+
+// Reads, percentiles and bundle writes all go through `pool`, so -j bounds
+// how many of them run at once.
+static std::optional<std::string> repack(const std::filesystem::path &product,
+                                         const Args &args,
+                                         sats::TaskPool &pool) {
+  std::string productName = product.stem().string();
+  std::filesystem::path outDir =
+      args.outDir ? std::filesystem::path(*args.outDir) : product.parent_path();
+  std::filesystem::path buildDir = outDir / ("build-" + productName);
+  std::filesystem::create_directories(buildDir);
+
+  // the bundles only live here until they are zipped, on every way out
+  struct RemoveOnExit {
+    std::filesystem::path path;
+    ~RemoveOnExit() {
+      std::error_code ec;
+      std::filesystem::remove_all(path, ec);
+    }
+  } removeBuildDir{buildDir};
+
+  // one listing of the central directory serves every lookup below
+  std::string root = "/vsizip/" + product.string();
+  char **files = VSIReadDirRecursive(root.c_str());
+  if (!files) {
+    return "Failed to list \"" + root + "\"";
+  }
+
+  auto find = [&](const std::regex &re) {
+    std::vector<std::string> matches;
+    for (char **file = files; *file; file++) {
+      if (std::regex_search(*file, re)) {
+        matches.push_back(root + "/" + *file);
+      }
+    }
+    std::sort(matches.begin(), matches.end());
+    return matches;
+  };
+
+  // HIRES and LOWRES rasters, then the MSK bundle in the order the sampler
+  // expects: DETFOO..., CLD, SNW, SCL
+  std::vector<std::vector<Raster>> bundles;
+  for (const auto &bundle : imageBundles) {
+    std::vector<Raster> rasters;
+    for (const auto &bandName : bundle.bandNames) {
+      auto matches = find(std::regex("_" + bandName + "\\.jp2$"));
+      if (matches.empty()) {
+        CSLDestroy(files);
+        return "\"" + root + "\" has no " + bandName + " band";
+      }
+      rasters.push_back({matches[0], bandName, {}});
+    }
+    bundles.push_back(std::move(rasters));
+  }
+
+  std::vector<Raster> maskRasters;
+  for (const auto &path : find(std::regex("DETFOO.*\\.jp2$"))) {
+    maskRasters.push_back(
+        {path, std::filesystem::path(path).stem().string(), {}});
+  }
+  size_t nDetfooMasks = maskRasters.size();
+  for (const auto &pattern : {"CLD.*20m\\.jp2$", "SNW.*20m\\.jp2$",
+                              "SCL.*20m\\.jp2$"}) {
+    auto matches = find(std::regex(pattern));
+    if (matches.empty()) {
+      CSLDestroy(files);
+      return "\"" + root + "\" has no mask matching " + pattern;
+    }
+    maskRasters.push_back(
+        {matches[0], std::filesystem::path(matches[0]).stem().string(), {}});
+  }
+  CSLDestroy(files);
+
+  if (!nDetfooMasks) {
+    return "\"" + root + "\" has no DETFOO masks";
+  }
+
+  std::vector<Grid> grids;
+  for (size_t i = 0; i < imageBundles.size(); i++) {
+    auto grid = gridAt(bundles[i][0].path, imageBundles[i].resolution);
+    if (!grid) {
+      return "Failed to get the grid of \"" + bundles[i][0].path + "\"";
+    }
+    grids.push_back(*grid);
+  }
+  auto maskGrid = gridAt(bundles[0][0].path, maskResolution);
+  if (!maskGrid) {
+    return "Failed to get the mask grid of \"" + bundles[0][0].path + "\"";
+  }
+
+  auto readStart = std::chrono::steady_clock::now();
+
+  std::vector<std::future<std::optional<std::string>>> reads;
+  for (size_t i = 0; i < bundles.size(); i++) {
+    for (auto &raster : bundles[i]) {
+      reads.push_back(submit(pool, [&, i]() {
+        return readRaster(raster, grids[i], imageBundles[i].dataType);
+      }));
+    }
+  }
+  for (auto &raster : maskRasters) {
+    reads.push_back(submit(
+        pool, [&]() { return readRaster(raster, *maskGrid, GDT_Byte); }));
+  }
+
+  std::optional<std::string> err;
+  for (auto &read : reads) {
+    if (auto readErr = read.get(); readErr && !err) {
+      err = readErr;
+    }
+  }
+  if (err) {
+    return err;
+  }
+
+  auto computeStart = std::chrono::steady_clock::now();
+
+  // normalization percentiles, one band per task
+  std::vector<std::vector<std::array<float, 2>>> percentiles(bundles.size());
+  std::vector<std::future<void>> percentileTasks;
+  for (size_t i = 0; i < bundles.size(); i++) {
+    percentiles[i].resize(bundles[i].size());
+    for (size_t j = 0; j < bundles[i].size(); j++) {
+      percentileTasks.push_back(submit(pool, [&, i, j]() {
+        const auto &data = bundles[i][j].data;
+        auto p = bandPercentiles((const uint16_t *)data.data(),
+                                 data.size() / sizeof(uint16_t), {1, 99});
+        percentiles[i][j] = {p[0], p[1]};
+      }));
+    }
+  }
+
+  // the joined sample mask the sampler ingests (see satsample_mapgen)
+  size_t nMaskPixels = maskGrid->xSize * maskGrid->ySize;
+  std::vector<uint8_t> detfoo(nMaskPixels * nDetfooMasks);
+  for (size_t i = 0; i < nDetfooMasks; i++) {
+    std::copy(maskRasters[i].data.begin(), maskRasters[i].data.end(),
+              detfoo.begin() + i * nMaskPixels);
+  }
+
+  // the sampler only uses the mask for the thresholds it was joined with
+  std::vector<Raster> okMask = {
+      {"",
+       "MSK_OK",
+       {},
+       {{"SATS_CLD_MAX", std::to_string(args.cldProbMax)},
+        {"SATS_SNW_MAX", std::to_string(args.snwProbMax)}}}};
+  okMask[0].data.resize(nMaskPixels);
+  cpuproc::joinMasks(detfoo.data(), nDetfooMasks,
+                     maskRasters[nDetfooMasks].data.data(), args.cldProbMax,
+                     maskRasters[nDetfooMasks + 1].data.data(),
+                     args.snwProbMax, okMask[0].data.data(), maskGrid->xSize,
+                     maskGrid->ySize, args.nThreads);
+  cpuproc::joinSclMask(maskRasters[nDetfooMasks + 2].data.data(),
+                       okMask[0].data.data(), maskGrid->xSize,
+                       maskGrid->ySize, args.nThreads);
+
+  for (auto &task : percentileTasks) {
+    task.get();
+  }
+
+  auto writeStart = std::chrono::steady_clock::now();
+
+  auto outPath = [&](const std::string &bundle) {
+    return buildDir / (productName + "-" + bundle + ".tif");
+  };
+
+  std::vector<std::filesystem::path> outFiles;
+  std::vector<std::future<std::optional<std::string>>> writes;
+  for (size_t i = 0; i < bundles.size(); i++) {
+    outFiles.push_back(outPath(imageBundles[i].name));
+    writes.push_back(submit(pool, [&, i, path = outFiles.back().string()]() {
+      return writeBundle(path, grids[i], bundles[i], imageBundles[i].dataType,
+                         imageBundles[i].tiled, 0, args, &percentiles[i]);
+    }));
+  }
+
+  outFiles.push_back(outPath("MSK"));
+  writes.push_back(submit(pool, [&, path = outFiles.back().string()]() {
+    return writeBundle(path, *maskGrid, maskRasters, GDT_Byte, false, 0, args,
+                       nullptr);
+  }));
+
+  outFiles.push_back(outPath("MSK_OK"));
+  writes.push_back(submit(pool, [&, path = outFiles.back().string()]() {
+    return writeBundle(path, *maskGrid, okMask, GDT_Byte, true, 1, args,
+                       nullptr);
+  }));
+
+  for (auto &write : writes) {
+    if (auto writeErr = write.get(); writeErr && !err) {
+      err = writeErr;
+    }
+  }
+
+  if (!err) {
+    err = storeZip((outDir / ("REPACK_" + product.filename().string())).string(),
+                   outFiles);
+  }
+
+  auto ms = [](auto a, auto b) {
+    return std::chrono::duration<double, std::milli>(b - a).count();
+  };
+  auto end = std::chrono::steady_clock::now();
+  std::cout << productName << ": read " << ms(readStart, computeStart)
+            << " ms, compute " << ms(computeStart, writeStart)
+            << " ms, write " << ms(writeStart, end) << " ms" << std::endl;
+
+  return err;
+}
+
+int main(int argc, const char **argv) {
+  auto args = argparse::parse<Args>(argc, argv);
+
+  GDALAllRegister();
+
+  sats::TaskPool pool(std::max<size_t>(args.nThreads, 1));
+
+  size_t nFailed = 0;
+  for (const auto &product : args.products) {
+    if (auto err = repack(product, args, pool)) {
+      std::cout << product << ": " << *err << std::endl;
+      nFailed++;
+    }
+  }
+
+  return nFailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}